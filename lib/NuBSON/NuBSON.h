@@ -34,8 +34,10 @@ limitations under the License.
     bson bsonValue;
 }
 
-/*! Create a BSON representation of a dictionary object. */
+/*! Create a BSON representation of a dictionary object, keys in enumeration order. */
 - (NuBSON *) initWithDictionary:(NSDictionary *) dict;
+/*! Canonical encoding sorts the keys of every nested dictionary, for byte-stable output. */
+- (NuBSON *) initWithDictionary:(NSDictionary *) dict canonical:(BOOL) canonical;
 /*! Return a dictionary equivalent of a BSON object. */
 - (NSMutableDictionary *) dictionaryValue;
 /*! Return an NSData representation of the BSON object. */
@@ -55,12 +57,51 @@ limitations under the License.
 
 bson *bson_for_object(id object);
 
+/*! Append one object to a buffer under the given key. */
+void add_object_to_bson_buffer(bson_buffer *bb, id key, id object);
+/*! Exact encoded size of a dictionary, computed without encoding it. */
+int bson_size_for_dictionary(NSDictionary *dict);
+
+/*! Decode the value the iterator currently points at (nil if unsupported). */
+id object_for_bson_iterator(const bson_iterator *it);
+/*! Decode every remaining field of the iterator into a dictionary or array. */
+void add_bson_to_object(bson_iterator it, id object);
+
+/*! Binary values at least this long are sliced out of the frame, not copied. */
+#define NUBSON_MIN_SLICE_LENGTH 512
+
+/*!
+ As above, for iterators over frame's bytes: large binary values become
+ NuBSONDataSlices that retain frame, so frame must never be mutated again.
+ */
+id object_for_bson_iterator_in_data(const bson_iterator *it, NSData *frame);
+void add_bson_to_object_in_data(bson_iterator it, id object, NSData *frame);
+/*! Retained, interned string for a NUL-terminated UTF-8 key (nil if invalid). */
+NSString *retained_string_for_key(const char *key);
+
+/*! Immutable view of part of another NSData's bytes, keeping it alive. */
+@interface NuBSONDataSlice : NSData
+{
+    NSData *owner;
+    const void *bytes;
+    NSUInteger length;
+}
++ (NSData *) sliceOfData:(NSData *) data bytes:(const void *) bytes length:(NSUInteger) length;
+@end
+
+/*
+ These are named apart from bson-objc's BSONCodec categories (BSONValue and
+ BSONRepresentation), which are linked into the same binaries.
+ */
 @interface NSData (NuBSON)
-- (NSMutableDictionary *) BSONValue;
+- (NSMutableDictionary *) NuBSONValue;
+/*! Large binary values reference the receiver, which must not change after. */
+- (NSMutableDictionary *) NuBSONValueNoCopy;
 @end
 
 @interface NSDictionary (NuBSON)
-- (NSData *) BSONRepresentation;
+- (NSData *) NuBSONRepresentation;
+- (NSData *) NuBSONCanonicalRepresentation;
 @end
 
 @interface NuBSONBuffer : NSObject
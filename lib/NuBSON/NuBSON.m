@@ -1,5 +1,7 @@
 #import "NuBSON.h"
 #include "bson.h"
+#import <objc/runtime.h>
+#import <pthread.h>
 
 @protocol NuCellProtocol
 - (id) car;
@@ -85,12 +87,145 @@
     return self;
 }
 
+- (void) dealloc
+{
+    bson_destroy(&bsonValue);
+    [super dealloc];
+}
+
 - (NSData *) data
 {
     return [[[NSData alloc] initWithBytes:(bsonValue.data) length:bson_size(&(bsonValue))] autorelease];
 }
 
+static int bson_size_for_value(id object);
+
+static int bson_size_for_name(id key)
+{
+    return 1 + [key lengthOfBytesUsingEncoding:NSUTF8StringEncoding] + 1;
+}
+
+static int bson_size_for_index(int i)
+{
+    int digits = 1;
+    while (i >= 10) {
+        i /= 10;
+        digits++;
+    }
+    return 1 + digits + 1;
+}
+
+/*
+ Mirrors add_object_to_bson_buffer, without writing anything. Returns -1 for
+ values that are not sized up front (they are skipped, or grow the buffer).
+ */
+static int bson_size_for_value(id object)
+{
+    if ([object isKindOfClass:[NSNumber class]]) {
+        switch (*[object objCType]) {
+            case 'd':
+            case 'f':
+            case 'l':
+            case 'L':
+            case 'q':
+            case 'Q':
+                return 8;
+            case 'B':
+                return 1;
+            default:
+                return 4;
+        }
+    }
+    else if ([object isKindOfClass:[NSDictionary class]]) {
+        return bson_size_for_dictionary(object);
+    }
+    else if ([object isKindOfClass:[NSArray class]]) {
+        int size = 4 + 1;
+        for (int i = 0; i < [object count]; i++) {
+            int value = bson_size_for_value([object objectAtIndex:i]);
+            if (value >= 0)
+                size += bson_size_for_index(i) + value;
+        }
+        return size;
+    }
+    else if ([object isKindOfClass:[NSNull class]]) {
+        return 0;
+    }
+    else if ([object isKindOfClass:[NSDate class]]) {
+        return 8;
+    }
+    else if ([object isKindOfClass:[NSData class]]) {
+        return 4 + 1 + [object length];
+    }
+    else if ([object isKindOfClass:[NuBSONObjectID class]]) {
+        return 12;
+    }
+    else if ([object isKindOfClass:[NSString class]]) {
+        return 4 + [object lengthOfBytesUsingEncoding:NSUTF8StringEncoding] + 1;
+    }
+    return -1;
+}
+
+int bson_size_for_dictionary(NSDictionary *dict)
+{
+    int size = 4 + 1;
+    for (NSString *key in dict) {
+        int value = bson_size_for_value([dict objectForKey:key]);
+        if (value >= 0)
+            size += bson_size_for_name(key) + value;
+    }
+    return size;
+}
+
+static NSInteger compare_keys_literally(id a, id b, void *context)
+{
+    return [a compare:b options:NSLiteralSearch];
+}
+
+static void add_object(bson_buffer *bb, id key, id object, BOOL canonical);
+
+/*
+ Keys go out in enumeration order by default. Canonical encoding sorts them
+ (literally, so distinct keys never tie) to get byte-stable documents, at the
+ cost of an array and O(n log n) comparisons per nesting level.
+ */
+static void add_dictionary_to_bson_buffer(bson_buffer *bb, NSDictionary *dict, BOOL canonical)
+{
+    if (!canonical) {
+        for (NSString *key in dict)
+            add_object(bb, key, [dict objectForKey:key], NO);
+        return;
+    }
+
+    NSMutableArray *keys = [[NSMutableArray alloc] initWithCapacity:[dict count]];
+    for (NSString *key in dict)
+      [keys addObject:key];
+    [keys sortUsingFunction:compare_keys_literally context:NULL];
+    for (NSString *key in keys)
+        add_object(bb, key, [dict objectForKey:key], YES);
+    [keys release];
+}
+
+static NSData *bson_data_for_dictionary(NSDictionary *dict, BOOL canonical)
+{
+    // Sized up front, so this is the only allocation. The buffer is handed to
+    // the NSData as is, rather than copied out of a NuBSON.
+    bson_buffer bb;
+    bson_buffer_init_size(&bb, bson_size_for_dictionary(dict));
+    add_dictionary_to_bson_buffer(&bb, dict, canonical);
+
+    char *data = bson_buffer_finish(&bb);
+    int length;
+    bson_little_endian32(&length, data);
+    return [NSData dataWithBytesNoCopy:data length:length freeWhenDone:YES];
+}
+
 void add_object_to_bson_buffer(bson_buffer *bb, id key, id object)
+{
+    add_object(bb, key, object, NO);
+}
+
+static void add_object(bson_buffer *bb, id key, id object, BOOL canonical)
 {
     const char *name = [key cStringUsingEncoding:NSUTF8StringEncoding];
     Class NuCell = NSClassFromString(@"NuCell");
@@ -127,19 +262,13 @@ void add_object_to_bson_buffer(bson_buffer *bb, id key, id object)
     }
     else if ([object isKindOfClass:[NSDictionary class]]) {
         bson_buffer *sub = bson_append_start_object(bb, name);
-        NSMutableArray *keys = [[NSMutableArray alloc] init];
-        for (NSString *key in object)
-          [keys addObject:key];
-        [keys sortUsingSelector:@selector(caseInsensitiveCompare:)];
-        for (NSString *key in keys)
-            add_object_to_bson_buffer(sub, key, [object objectForKey:key]);
-        [keys release];
+        add_dictionary_to_bson_buffer(sub, object, canonical);
         bson_append_finish_object(sub);
     }
     else if ([object isKindOfClass:[NSArray class]]) {
         bson_buffer *arr = bson_append_start_array(bb, name);
         for (int i = 0; i < [object count]; i++) {
-            add_object_to_bson_buffer(arr, [[NSNumber numberWithInt:i] stringValue], [object objectAtIndex:i]);
+            add_object(arr, [[NSNumber numberWithInt:i] stringValue], [object objectAtIndex:i], canonical);
         }
         bson_append_finish_object(arr);
     }
@@ -164,7 +293,7 @@ void add_object_to_bson_buffer(bson_buffer *bb, id key, id object)
             while (cursor && (cursor != [NSNull null])) {
                 id key = [[cursor car] labelName];
                 id value = [[cursor cdr] car];
-                add_object_to_bson_buffer(sub, key, value);
+                add_object(sub, key, value, canonical);
                 cursor = [[cursor cdr] cdr];
             }
             bson_append_finish_object(sub);
@@ -175,7 +304,7 @@ void add_object_to_bson_buffer(bson_buffer *bb, id key, id object)
             id cursor = object;
             int i = 0;
             while (cursor && (cursor != [NSNull null])) {
-                add_object_to_bson_buffer(arr, [[NSNumber numberWithInt:i] stringValue], [cursor car]);
+                add_object(arr, [[NSNumber numberWithInt:i] stringValue], [cursor car], canonical);
                 i++;
                 cursor = [cursor cdr];
             }
@@ -191,17 +320,16 @@ void add_object_to_bson_buffer(bson_buffer *bb, id key, id object)
 }
 
 - (NuBSON *) initWithDictionary:(NSDictionary *) dict
+{
+    return [self initWithDictionary:dict canonical:NO];
+}
+
+- (NuBSON *) initWithDictionary:(NSDictionary *) dict canonical:(BOOL) canonical
 {
     bson b;
     bson_buffer bb;
-    bson_buffer_init(& bb );
-    NSMutableArray *keys = [[NSMutableArray alloc] init];
-    for (NSString *key in dict)
-      [keys addObject:key];
-    [keys sortUsingSelector:@selector(caseInsensitiveCompare:)];
-    for (NSString *key in keys)
-        add_object_to_bson_buffer(&bb, key, [dict objectForKey:key]);
-    [keys release];
+    bson_buffer_init_size(&bb, bson_size_for_dictionary(dict));
+    add_dictionary_to_bson_buffer(&bb, dict, canonical);
 
     bson_from_buffer(&b, &bb);
     return [self initWithBSON:b];
@@ -276,82 +404,156 @@ void dump_bson_iterator(bson_iterator it, const char *indent)
     fprintf(stderr, "\n");
 }
 
-void add_bson_to_object(bson_iterator it, id object)
+id object_for_bson_iterator(const bson_iterator *it)
+{
+    return object_for_bson_iterator_in_data(it, nil);
+}
+
+id object_for_bson_iterator_in_data(const bson_iterator *it, NSData *frame)
 {
     bson_iterator it2;
     bson subobject;
 
-    while(bson_iterator_next(&it)) {
+    id value = nil;
+    switch(bson_iterator_type(it)) {
+        case bson_eoo:
+            break;
+        case bson_double:
+            value = [NSNumber numberWithDouble:bson_iterator_double(it)];
+            break;
+        case bson_string:
+            value = [[[NSString alloc]
+                initWithCString:bson_iterator_string(it) encoding:NSUTF8StringEncoding]
+                autorelease];
+            break;
+        case bson_object:
+            value = [NSMutableDictionary dictionary];
+            bson_iterator_subobject(it, &subobject);
+            bson_iterator_init(&it2, subobject.data);
+            add_bson_to_object_in_data(it2, value, frame);
+            break;
+        case bson_array:
+            value = [NSMutableArray array];
+            bson_iterator_subobject(it, &subobject);
+            bson_iterator_init(&it2, subobject.data);
+            add_bson_to_object_in_data(it2, value, frame);
+            break;
+        case bson_bindata:
+            if (frame && bson_iterator_bin_len(it) >= NUBSON_MIN_SLICE_LENGTH)
+                value = [NuBSONDataSlice sliceOfData:frame
+                    bytes:bson_iterator_bin_data(it)
+                    length:bson_iterator_bin_len(it)];
+            else
+                value = [NSData
+                    dataWithBytes:bson_iterator_bin_data(it)
+                    length:bson_iterator_bin_len(it)];
+            break;
+        case bson_undefined:
+            break;
+        case bson_oid:
+            value = [[[NuBSONObjectID alloc] initWithObjectIDPointer:bson_iterator_oid(it)] autorelease];
+            break;
+        case bson_bool:
+            value = [NSNumber numberWithBool:bson_iterator_bool(it)];
+            break;
+        case bson_date:
+            value = [NSDate dateWithTimeIntervalSince1970:(0.001 * bson_iterator_date(it))];
+            break;
+        case bson_null:
+            value = [NSNull null];
+            break;
+        case bson_regex:
+            break;
+        case bson_code:
+            break;
+        case bson_symbol:
+            break;
+        case bson_codewscope:
+            break;
+        case bson_int:
+            value = [NSNumber numberWithInt:bson_iterator_int(it)];
+            break;
+        case bson_timestamp:
+            break;
+        case bson_long:
+            value = [NSNumber numberWithLong:bson_iterator_long(it)];
+            break;
+        default:
+            break;
+    }
+    return value;
+}
 
-        NSString *key = [[[NSString alloc]
-            initWithCString:bson_iterator_key(&it) encoding:NSUTF8StringEncoding]
-            autorelease];
+/*
+ Decoded keys come from a small vocabulary (_src, _dst, _seq, ... plus
+ application keys), so instead of allocating a string per key per document
+ they are interned in a direct-mapped table keyed by FNV-1a hash and length.
+ A colliding key replaces the slot's occupant; long keys are not interned.
+ */
+#define NUBSON_KEY_TABLE_SIZE 512
+#define NUBSON_MAX_INTERNED_KEY_LENGTH 32
+
+typedef struct {
+    uint32_t hash;
+    int length;
+    char bytes[NUBSON_MAX_INTERNED_KEY_LENGTH];
+    NSString *string;
+} nubson_interned_key;
+
+static nubson_interned_key key_table[NUBSON_KEY_TABLE_SIZE];
+static pthread_mutex_t key_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+NSString *retained_string_for_key(const char *key)
+{
+    uint32_t hash = 2166136261u;
+    int length = 0;
+    for (const unsigned char *p = (const unsigned char *) key; *p; p++, length++)
+        hash = (hash ^ *p) * 16777619u;
+
+    if (length > NUBSON_MAX_INTERNED_KEY_LENGTH)
+        return [[NSString alloc] initWithBytes:key length:length encoding:NSUTF8StringEncoding];
+
+    nubson_interned_key *slot = &key_table[hash % NUBSON_KEY_TABLE_SIZE];
+    NSString *string = nil;
+
+    pthread_mutex_lock(&key_table_lock);
+    if (slot->string && slot->hash == hash && slot->length == length
+        && memcmp(slot->bytes, key, length) == 0)
+        string = [slot->string retain];
+    pthread_mutex_unlock(&key_table_lock);
+    if (string)
+        return string;
+
+    string = [[NSString alloc] initWithBytes:key length:length encoding:NSUTF8StringEncoding];
+    if (!string)
+        return nil;
+
+    pthread_mutex_lock(&key_table_lock);
+    [slot->string release];
+    slot->string = [string retain];
+    slot->hash = hash;
+    slot->length = length;
+    memcpy(slot->bytes, key, length);
+    pthread_mutex_unlock(&key_table_lock);
+    return string;
+}
 
-        id value = nil;
-        switch(bson_iterator_type(&it)) {
-            case bson_eoo:
-                break;
-            case bson_double:
-                value = [NSNumber numberWithDouble:bson_iterator_double(&it)];
-                break;
-            case bson_string:
-                value = [[[NSString alloc]
-                    initWithCString:bson_iterator_string(&it) encoding:NSUTF8StringEncoding]
-                    autorelease];
-                break;
-            case bson_object:
-                value = [NSMutableDictionary dictionary];
-                bson_iterator_subobject(&it, &subobject);
-                bson_iterator_init(&it2, subobject.data);
-                add_bson_to_object(it2, value);
-                break;
-            case bson_array:
-                value = [NSMutableArray array];
-                bson_iterator_subobject(&it, &subobject);
-                bson_iterator_init(&it2, subobject.data);
-                add_bson_to_object(it2, value);
-                break;
-            case bson_bindata:
-                value = [NSData
-                    dataWithBytes:bson_iterator_bin_data(&it)
-                    length:bson_iterator_bin_len(&it)];
-                break;
-            case bson_undefined:
-                break;
-            case bson_oid:
-                value = [[[NuBSONObjectID alloc] initWithObjectIDPointer:bson_iterator_oid(&it)] autorelease];
-                break;
-            case bson_bool:
-                value = [NSNumber numberWithBool:bson_iterator_bool(&it)];
-                break;
-            case bson_date:
-                value = [NSDate dateWithTimeIntervalSince1970:(0.001 * bson_iterator_date(&it))];
-                break;
-            case bson_null:
-                value = [NSNull null];
-                break;
-            case bson_regex:
-                break;
-            case bson_code:
-                break;
-            case bson_symbol:
-                break;
-            case bson_codewscope:
-                break;
-            case bson_int:
-                value = [NSNumber numberWithInt:bson_iterator_int(&it)];
-                break;
-            case bson_timestamp:
-                break;
-            case bson_long:
-                value = [NSNumber numberWithLong:bson_iterator_long(&it)];
-                break;
-            default:
-                break;
-        }
+void add_bson_to_object(bson_iterator it, id object)
+{
+    add_bson_to_object_in_data(it, object, nil);
+}
+
+void add_bson_to_object_in_data(bson_iterator it, id object, NSData *frame)
+{
+    while(bson_iterator_next(&it)) {
+
+        id value = object_for_bson_iterator_in_data(&it, frame);
         if (value) {
             if ([object isKindOfClass:[NSDictionary class]]) {
-                [object setObject:value forKey:key];
+                NSString *key = retained_string_for_key(bson_iterator_key(&it));
+                if (key)
+                    [object setObject:value forKey:key];
+                [key release];
             }
             else if ([object isKindOfClass:[NSArray class]]) {
                 [object addObject:value];
@@ -394,9 +596,34 @@ bson *bson_for_object(id object)
     return b;
 }
 
+@implementation NuBSONDataSlice
+
++ (NSData *) sliceOfData:(NSData *) data bytes:(const void *) bytes length:(NSUInteger) length
+{
+    NuBSONDataSlice *slice = [[[NuBSONDataSlice alloc] init] autorelease];
+    // A slice of a slice holds the original storage, not the chain.
+    if ([data isKindOfClass:[NuBSONDataSlice class]])
+        data = ((NuBSONDataSlice *) data)->owner;
+    slice->owner = [data retain];
+    slice->bytes = bytes;
+    slice->length = length;
+    return slice;
+}
+
+- (void) dealloc
+{
+    [owner release];
+    [super dealloc];
+}
+
+- (const void *) bytes {return bytes;}
+- (NSUInteger) length {return length;}
+
+@end
+
 @implementation NSData (NuBSON)
 
-- (NSMutableDictionary *) BSONValue
+- (NSMutableDictionary *) NuBSONValue
 {
     bson bsonValue;
     bsonValue.data = (char *) [self bytes];
@@ -405,14 +632,29 @@ bson *bson_for_object(id object)
     return [bsonObject dictionaryValue];
 }
 
+- (NSMutableDictionary *) NuBSONValueNoCopy
+{
+    id object = [NSMutableDictionary dictionary];
+    if ([self length] < 5)
+        return object;
+    bson_iterator it;
+    bson_iterator_init(&it, [self bytes]);
+    add_bson_to_object_in_data(it, object, self);
+    return object;
+}
+
 @end
 
 @implementation NSDictionary (NuBSON)
 
-- (NSData *) BSONRepresentation
+- (NSData *) NuBSONRepresentation
 {
-    NuBSON *bsonObject = [[[NuBSON alloc] initWithDictionary:self] autorelease];
-    return [bsonObject data];
+    return bson_data_for_dictionary(self, NO);
+}
+
+- (NSData *) NuBSONCanonicalRepresentation
+{
+    return bson_data_for_dictionary(self, YES);
 }
 
 @end
@@ -427,15 +669,39 @@ bson *bson_for_object(id object)
     return self;
 }
 
+- (void) dealloc
+{
+    bson_buffer_destroy(&bb);
+    [super dealloc];
+}
+
+/*
+ The buffer keeps its bytes and the NuBSON (which frees what it holds) gets a
+ copy, so bsonValue can be called any number of times.
+ */
 - (NuBSON *) bsonValue
 {
+    char *data = bson_buffer_finish(&bb);
+    if (!data)
+        return nil;
+    int size;
+    bson_little_endian32(&size, data);
+    char *copy = malloc(size);
+    if (!copy)
+        return nil;
+    memcpy(copy, data, size);
+
     bson b;
-    bson_from_buffer(&b, &bb);
+    bson_init(&b, copy, 1);
     return [[[NuBSON alloc] initWithBSON:b] autorelease];
 }
 
 - (void) addObject:(id) object withKey:(id) key
 {
+    // A finished buffer already ends in its terminating byte and size.
+    if (bb.finished)
+        [NSException raise:@"NuBSONBufferFinished"
+                    format:@"can't add %@ after bsonValue", key];
     add_object_to_bson_buffer(&bb, key, object);
 }
 
@@ -384,8 +384,17 @@ void bson_iterator_subiterator(const bson_iterator * i, bson_iterator * sub){
    ------------------------------ */
 
 bson_buffer * bson_buffer_init( bson_buffer * b ){
-    b->buf = (char*)bson_malloc( initialBufferSize );
-    b->bufSize = initialBufferSize;
+    return bson_buffer_init_size( b , initialBufferSize );
+}
+
+bson_buffer * bson_buffer_init_size( bson_buffer * b , int size ){
+    if ( size < 5 )
+        size = 5; /* length + eoo */
+    return bson_buffer_init_with( b , (char*)bson_malloc( size ) , size );
+}
+bson_buffer * bson_buffer_init_with( bson_buffer * b , char * buf , int size ){
+    b->buf = buf;
+    b->bufSize = size;
     b->cur = b->buf + 4;
     b->finished = 0;
     b->stackPos = 0;
@@ -90,6 +90,11 @@ void bson_destroy( bson * b );
 void bson_print( bson * b );
 void bson_print_raw( const char * bson , int depth );
 
+/* true if data[0, size) is exactly one well-formed document. bounds-checks
+   every length, key and UTF-8 string, so it is safe on untrusted input and
+   must pass before that input reaches the iterator. (bson_validate.c) */
+bson_bool_t bson_validate( const char * data , int size );
+
 /* advances iterator to named field */
 /* returns bson_eoo (which is false) if field not found */
 bson_type bson_find(bson_iterator* it, const bson* obj, const char* name);
@@ -158,6 +163,10 @@ time_t bson_oid_generated_time(bson_oid_t* oid); /* Gives the time the OID was c
    ------------------------------ */
 
 bson_buffer * bson_buffer_init( bson_buffer * b );
+/* preallocates size bytes. with the exact document size, nothing is realloc'd */
+bson_buffer * bson_buffer_init_size( bson_buffer * b , int size );
+/* builds into buf (malloc'd, size >= 5), which the buffer then owns and may realloc */
+bson_buffer * bson_buffer_init_with( bson_buffer * b , char * buf , int size );
 bson_buffer * bson_ensure_space( bson_buffer * b , const int bytesNeeded );
 
 /**
@@ -0,0 +1,248 @@
+/* bson_validate.c */
+
+/*
+ * Bounds-checked validation of untrusted BSON.
+ *
+ * The iterator in bson.c trusts every length it reads and aborts on unknown
+ * types, so anything received from a peer must pass bson_validate() before it
+ * is iterated. The hot loops (finding key terminators, skipping ASCII in
+ * strings) scan 16 bytes at a time with SSE2 or NEON when the compiler targets
+ * them, and 8 bytes at a time otherwise.
+ */
+
+#include "bson.h"
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define BSON_VALIDATE_SSE2
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BSON_VALIDATE_NEON
+#endif
+
+/* deeper documents are rejected rather than recursed into */
+#define BSON_VALIDATE_MAX_DEPTH 100
+
+static const uint64_t high_bits = 0x8080808080808080ULL;
+
+/* ----------------------------
+   SCANNING
+   ------------------------------ */
+
+/* returns the first NUL in [p, end), or NULL */
+static const char * find_nul( const char * p , const char * end ){
+#if defined(BSON_VALIDATE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    while ( end - p >= 16 ){
+        __m128i v = _mm_loadu_si128( (const __m128i *)p );
+        int mask = _mm_movemask_epi8( _mm_cmpeq_epi8( v , zero ) );
+        if ( mask )
+            return p + __builtin_ctz( mask );
+        p += 16;
+    }
+#elif defined(BSON_VALIDATE_NEON)
+    while ( end - p >= 16 ){
+        uint8x16_t v = vld1q_u8( (const uint8_t *)p );
+        uint64x2_t eq = vreinterpretq_u64_u8( vceqq_u8( v , vdupq_n_u8( 0 ) ) );
+        if ( vgetq_lane_u64( eq , 0 ) | vgetq_lane_u64( eq , 1 ) )
+            break; /* it is in this block; the tail loop finds it */
+        p += 16;
+    }
+#endif
+    for ( ; p < end; p++ )
+        if ( *p == 0 )
+            return p;
+    return NULL;
+}
+
+/* returns the length of the all-ASCII prefix of s[0, n) */
+static int ascii_prefix( const unsigned char * s , int n ){
+    int i = 0;
+#if defined(BSON_VALIDATE_SSE2)
+    for ( ; n - i >= 16; i += 16 ){
+        __m128i v = _mm_loadu_si128( (const __m128i *)(s + i) );
+        if ( _mm_movemask_epi8( v ) )
+            break;
+    }
+#elif defined(BSON_VALIDATE_NEON)
+    for ( ; n - i >= 16; i += 16 ){
+        uint8x16_t v = vandq_u8( vld1q_u8( s + i ) , vdupq_n_u8( 0x80 ) );
+        uint64x2_t w = vreinterpretq_u64_u8( v );
+        if ( vgetq_lane_u64( w , 0 ) | vgetq_lane_u64( w , 1 ) )
+            break;
+    }
+#endif
+    for ( ; n - i >= 8; i += 8 ){
+        uint64_t w;
+        memcpy( &w , s + i , 8 );
+        if ( w & high_bits )
+            break;
+    }
+    while ( i < n && s[i] < 0x80 )
+        i++;
+    return i;
+}
+
+/* strict UTF-8: no overlong forms, surrogates or code points past U+10FFFF */
+static bson_bool_t valid_utf8( const char * str , int n ){
+    const unsigned char * s = (const unsigned char *)str;
+    int i = 0;
+
+    while ( 1 ){
+        int len, k;
+        unsigned int cp, min;
+        unsigned char c;
+
+        i += ascii_prefix( s + i , n - i );
+        if ( i >= n )
+            return 1;
+
+        c = s[i];
+        if ( (c & 0xE0) == 0xC0 ){ len = 2; cp = c & 0x1F; min = 0x80; }
+        else if ( (c & 0xF0) == 0xE0 ){ len = 3; cp = c & 0x0F; min = 0x800; }
+        else if ( (c & 0xF8) == 0xF0 ){ len = 4; cp = c & 0x07; min = 0x10000; }
+        else return 0;
+
+        if ( n - i < len )
+            return 0;
+        for ( k = 1; k < len; k++ ){
+            if ( (s[i+k] & 0xC0) != 0x80 )
+                return 0;
+            cp = (cp << 6) | (s[i+k] & 0x3F);
+        }
+        if ( cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF) )
+            return 0;
+        i += len;
+    }
+}
+
+/* ----------------------------
+   VALIDATION
+   ------------------------------ */
+
+/* int32 length, UTF-8 bytes, NUL. returns bytes used, or -1 */
+static int validate_string( const char * p , int left ){
+    int len;
+    if ( left < 4 )
+        return -1;
+    bson_little_endian32( &len , p );
+    if ( len < 1 || len > left - 4 || p[4 + len - 1] != 0 )
+        return -1;
+    if ( !valid_utf8( p + 4 , len - 1 ) )
+        return -1;
+    return 4 + len;
+}
+
+/* NUL terminated UTF-8 within [p, end). returns bytes used, or -1 */
+static int validate_cstring( const char * p , const char * end ){
+    const char * nul = find_nul( p , end );
+    if ( !nul || !valid_utf8( p , nul - p ) )
+        return -1;
+    return nul - p + 1;
+}
+
+/* returns the document's length, or -1 */
+static int validate_document( const char * p , int size , int depth ){
+    const char * cur;
+    const char * end;
+    int len;
+
+    if ( depth > BSON_VALIDATE_MAX_DEPTH || size < 5 )
+        return -1;
+    bson_little_endian32( &len , p );
+    if ( len < 5 || len > size || p[len - 1] != 0 )
+        return -1;
+
+    cur = p + 4;
+    end = p + len - 1; /* the document's own eoo */
+
+    while ( cur < end ){
+        bson_type type = (bson_type)*cur++;
+        int left, ds, n;
+
+        if ( (n = validate_cstring( cur , end )) < 0 )
+            return -1;
+        cur += n;
+        left = end - cur;
+
+        switch ( type ){
+        case bson_undefined:
+        case bson_null: ds = 0; break;
+        case bson_bool:
+            if ( left < 1 || (unsigned char)*cur > 1 )
+                return -1;
+            ds = 1;
+            break;
+        case bson_int: ds = 4; break;
+        case bson_long:
+        case bson_double:
+        case bson_timestamp:
+        case bson_date: ds = 8; break;
+        case bson_oid: ds = 12; break;
+        case bson_string:
+        case bson_symbol:
+        case bson_code:
+            ds = validate_string( cur , left );
+            break;
+        case bson_bindata:
+            if ( left < 5 )
+                return -1;
+            bson_little_endian32( &n , cur );
+            if ( n < 0 || n > left - 5 )
+                return -1;
+            ds = 5 + n;
+            break;
+        case bson_object:
+        case bson_array:
+            ds = validate_document( cur , left , depth + 1 );
+            break;
+        case bson_codewscope:
+            {
+                int total;
+                if ( left < 4 )
+                    return -1;
+                bson_little_endian32( &total , cur );
+                if ( total < 4 + 5 + 5 || total > left )
+                    return -1;
+                if ( (n = validate_string( cur + 4 , total - 4 )) < 0 )
+                    return -1;
+                if ( validate_document( cur + 4 + n , total - 4 - n , depth + 1 )
+                     != total - 4 - n )
+                    return -1;
+                ds = total;
+                break;
+            }
+        case bson_dbref:
+            if ( (n = validate_string( cur , left )) < 0 )
+                return -1;
+            ds = n + 12;
+            break;
+        case bson_regex:
+            {
+                int opts;
+                if ( (n = validate_cstring( cur , end )) < 0 )
+                    return -1;
+                if ( (opts = validate_cstring( cur + n , end )) < 0 )
+                    return -1;
+                ds = n + opts;
+                break;
+            }
+        default: /* bson_eoo before the end, or an unknown type */
+            return -1;
+        }
+
+        if ( ds < 0 || ds > left )
+            return -1;
+        cur += ds;
+    }
+
+    return len;
+}
+
+bson_bool_t bson_validate( const char * data , int size ){
+    /* a size of -1 would otherwise match validate_document's -1 (invalid). */
+    if ( !data || size < 5 )
+        return 0;
+    return validate_document( data , size , 0 ) == size;
+}
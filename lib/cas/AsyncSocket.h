@@ -178,6 +178,7 @@ typedef enum AsyncSocketError AsyncSocketError;
 	NSMutableArray *theWriteQueue;
 	AsyncWritePacket *theCurrentWrite;
 	NSTimer *theWriteTimer;
+	NSUInteger theWriteChunkSize;      // See writeChunkSize
 
 	id theDelegate;
 	UInt16 theFlags;
@@ -606,6 +607,14 @@ typedef enum AsyncSocketError AsyncSocketError;
 **/
 - (void)enablePreBuffering;
 
+/**
+ * Binds the sockets of a following acceptOnPort: with SO_REUSEPORT, so several sockets (in one process or several)
+ * may accept on the same port. Where the kernel balances between them (Linux 3.9 and later) each gets a share of
+ * the incoming connections; on BSD-derived systems the last one bound gets them all.
+ * Has no effect where SO_REUSEPORT is not defined.
+**/
+- (void)enableReusePort;
+
 /**
  * When you create an AsyncSocket, it is added to the runloop of the current thread.
  * So for manually created sockets, it is easiest to simply create the socket on the thread you intend to use it.
@@ -656,4 +665,14 @@ typedef enum AsyncSocketError AsyncSocketError;
 + (NSData *)LFData;     // 0x0A
 + (NSData *)ZeroData;   // 0x00
 
+/**
+ * Reads of all available data (readDataWithTimeout:tag:) go into chunks from a shared pool,
+ * and the data handed to onSocket:didReadData:withTag: is that chunk, not a copy.
+ * It goes back to the pool when released, so hold on to it only as long as needed.
+ * 
+ * Counts, since launch, of chunks reused from the pool, chunks allocated for it,
+ * and reads too large for it (past 256K), which get an exact allocation instead.
+**/
++ (void)getReadPoolReused:(NSUInteger *)reused allocated:(NSUInteger *)allocated oversized:(NSUInteger *)oversized;
+
 @end
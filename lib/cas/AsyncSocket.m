@@ -13,6 +13,8 @@
 #import <netinet/in.h>
 #import <arpa/inet.h>
 #import <netdb.h>
+#import <sys/ioctl.h>
+#import <pthread.h>
 
 #if TARGET_OS_IPHONE
 // Note: You may need to add the CFNetwork Framework to your project
@@ -26,7 +28,10 @@
 #define READQUEUE_CAPACITY	5           // Initial capacity
 #define WRITEQUEUE_CAPACITY 5           // Initial capacity
 #define READALL_CHUNKSIZE	256         // Incremental increase in buffer size
-#define WRITE_CHUNKSIZE    (1024 * 4)   // Limit on size of each write pass
+#define WRITE_CHUNKSIZE    (1024 * 4)   // Smallest size of each write pass
+#define WRITE_CHUNKSIZE_MAX (1024 * 1024) // Largest size of each write pass
+#define READPOOL_CLASSES	4           // Size classes of pooled read chunks
+#define READPOOL_DEPTH		16          // Free chunks kept per size class
 
 NSString *const AsyncSocketException = @"AsyncSocketException";
 NSString *const AsyncSocketErrorDomain = @"AsyncSocketErrorDomain";
@@ -53,8 +58,119 @@ enum AsyncSocketFlags
 	kDequeueWriteScheduled   = 1 << 11,  // If set, a maybeDequeueWrite operation is already scheduled
 	kSocketCanAcceptBytes    = 1 << 12,  // If set, we know socket can accept bytes. If unset, it's unknown.
 	kSocketHasBytesAvailable = 1 << 13,  // If set, we know socket has bytes available. If unset, it's unknown.
+	kReusePort               = 1 << 14,  // If set, accept sockets are bound with SO_REUSEPORT
+	kSendingBytes            = 1 << 15,  // If set, doSendBytes is running
 };
 
+/**
+ * Chunks that "read all available data" packets read into, in a few size classes.
+ * The chunk itself is handed to the delegate when the read completes (see AsyncReadChunk),
+ * and goes back to the pool once the delegate is done with it,
+ * so such reads neither grow a buffer READALL_CHUNKSIZE at a time nor copy what was read.
+**/
+static const NSUInteger readPoolSizes[READPOOL_CLASSES] = { 4096, 16384, 65536, 262144 };
+static void *readPool[READPOOL_CLASSES][READPOOL_DEPTH];
+static int readPoolCount[READPOOL_CLASSES];
+static NSUInteger readPoolReused, readPoolAllocated, readPoolOversized;
+static pthread_mutex_t readPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Returns a chunk of the smallest size class holding size bytes, or of exactly size bytes past the largest class.
+**/
+static void *ReadPoolTake(NSUInteger size, NSUInteger *capacity)
+{
+	int i = 0;
+	while (i < READPOOL_CLASSES && readPoolSizes[i] < size) i++;
+	
+	if (i == READPOOL_CLASSES)
+	{
+		pthread_mutex_lock(&readPoolLock);
+		readPoolOversized++;
+		pthread_mutex_unlock(&readPoolLock);
+		
+		*capacity = size;
+		return malloc(size);
+	}
+	
+	void *chunk = NULL;
+	pthread_mutex_lock(&readPoolLock);
+	if (readPoolCount[i] > 0)
+	{
+		chunk = readPool[i][--readPoolCount[i]];
+		readPoolReused++;
+	}
+	else
+	{
+		readPoolAllocated++;
+	}
+	pthread_mutex_unlock(&readPoolLock);
+	
+	*capacity = readPoolSizes[i];
+	return chunk ? chunk : malloc(*capacity);
+}
+
+static void ReadPoolGive(void *chunk, NSUInteger capacity)
+{
+	int i = 0;
+	while (i < READPOOL_CLASSES && readPoolSizes[i] != capacity) i++;
+	
+	if (i < READPOOL_CLASSES)
+	{
+		pthread_mutex_lock(&readPoolLock);
+		if (readPoolCount[i] < READPOOL_DEPTH)
+		{
+			readPool[i][readPoolCount[i]++] = chunk;
+			chunk = NULL;
+		}
+		pthread_mutex_unlock(&readPoolLock);
+	}
+	free(chunk);
+}
+
+/**
+ * The data of a completed "read all available data" packet: the chunk it was read into,
+ * given back to the pool on dealloc.
+**/
+@interface AsyncReadChunk : NSData
+{
+	void *chunk;
+	NSUInteger chunkSize;
+	NSUInteger length;
+}
+- (id)initWithChunk:(void *)c size:(NSUInteger)s length:(NSUInteger)l;
+@end
+
+@implementation AsyncReadChunk
+
+- (id)initWithChunk:(void *)c size:(NSUInteger)s length:(NSUInteger)l
+{
+	if((self = [super init]))
+	{
+		chunk = c;
+		chunkSize = s;
+		length = l;
+	}
+	return self;
+}
+
+- (const void *)bytes
+{
+	return chunk;
+}
+
+- (NSUInteger)length
+{
+	return length;
+}
+
+- (void)dealloc
+{
+	ReadPoolGive(chunk, chunkSize);
+	[super dealloc];
+}
+
+@end
+
 @interface AsyncSocket (Private)
 
 // Connecting
@@ -122,6 +238,7 @@ enum AsyncSocketFlags
 - (UInt16)portFromAddress6:(struct sockaddr_in6 *)pSockaddr6;
 
 // Reading
+- (NSUInteger)bytesAvailableHint;
 - (void)doBytesAvailable;
 - (void)completeCurrentRead;
 - (void)endCurrentRead;
@@ -130,6 +247,7 @@ enum AsyncSocketFlags
 - (void)doReadTimeout:(NSTimer *)timer;
 
 // Writing
+- (NSUInteger)writeChunkSize;
 - (void)doSendBytes;
 - (void)completeCurrentWrite;
 - (void)endCurrentWrite;
@@ -185,6 +303,8 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 	NSData *term;
 	BOOL bufferOwner;
 	NSUInteger originalBufferLength;
+	void *chunk;
+	NSUInteger chunkSize;
 	long tag;
 }
 - (id)initWithData:(NSMutableData *)d
@@ -195,6 +315,10 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
         terminator:(NSData *)e
                tag:(long)i;
 
+- (BOOL)readsIntoChunk;
+- (void *)chunkSpaceFor:(NSUInteger)length;
+- (void)flushChunk;
+
 - (NSUInteger)readLengthForNonTerm;
 - (NSUInteger)readLengthForTerm;
 - (NSUInteger)readLengthForTermWithPreBuffer:(NSData *)preBuffer found:(BOOL *)foundPtr;
@@ -240,10 +364,59 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 		readLength = l;
 		term = [e copy];
 		tag = i;
+		chunk = NULL;
+		chunkSize = 0;
 	}
 	return self;
 }
 
+/**
+ * Whether this packet reads into a pooled chunk rather than its buffer:
+ * reads of all available data into a buffer of our own.
+**/
+- (BOOL)readsIntoChunk
+{
+	return bufferOwner && readLength == 0 && term == nil;
+}
+
+/**
+ * Makes sure the chunk has room for length more bytes, moving to a larger one if need be.
+ * Returns where they go.
+**/
+- (void *)chunkSpaceFor:(NSUInteger)length
+{
+	NSUInteger needed = bytesDone + length;
+	if (chunkSize < needed)
+	{
+		NSUInteger capacity;
+		void *larger = ReadPoolTake(needed, &capacity);
+		
+		if (chunk)
+		{
+			memcpy(larger, chunk, bytesDone);
+			ReadPoolGive(chunk, chunkSize);
+		}
+		chunk = larger;
+		chunkSize = capacity;
+	}
+	return chunk + bytesDone;
+}
+
+/**
+ * Moves what was read into the (still empty) buffer, and gives the chunk back.
+**/
+- (void)flushChunk
+{
+	if (chunk == NULL) return;
+	
+	[buffer setLength:0];
+	[buffer appendBytes:chunk length:bytesDone];
+	
+	ReadPoolGive(chunk, chunkSize);
+	chunk = NULL;
+	chunkSize = 0;
+}
+
 /**
  * For read packets without a set terminator, returns the safe length of data that can be read
  * without exceeding the maxLength, or forcing a resize of the buffer if at all possible.
@@ -583,6 +756,7 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 
 - (void)dealloc
 {
+	if (chunk) ReadPoolGive(chunk, chunkSize);
 	[buffer release];
 	[term release];
 	[super dealloc];
@@ -692,6 +866,7 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 		
 		theNativeSocket4 = 0;
 		theNativeSocket6 = 0;
+		theWriteChunkSize = 0;
 		
 		theSocket4 = NULL;
 		theSource4 = NULL;
@@ -944,6 +1119,14 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 	theFlags |= kEnablePreBuffering;
 }
 
+/**
+ * See the header file for a full explanation of reusing ports.
+**/
+- (void)enableReusePort
+{
+	theFlags |= kReusePort;
+}
+
 /**
  * See the header file for a full explanation of this method.
 **/
@@ -1327,6 +1510,14 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 	if (theSocket4)	setsockopt(CFSocketGetNative(theSocket4), SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
 	if (theSocket6)	setsockopt(CFSocketGetNative(theSocket6), SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
 
+#ifdef SO_REUSEPORT
+	if (theFlags & kReusePort)
+	{
+		if (theSocket4)	setsockopt(CFSocketGetNative(theSocket4), SOL_SOCKET, SO_REUSEPORT, &reuseOn, sizeof(reuseOn));
+		if (theSocket6)	setsockopt(CFSocketGetNative(theSocket6), SOL_SOCKET, SO_REUSEPORT, &reuseOn, sizeof(reuseOn));
+	}
+#endif
+
 	// Set the local bindings which causes the sockets to start listening.
 
 	CFSocketError err;
@@ -2093,6 +2284,7 @@ Failed:
 		{
 			// We need to move its data into the front of the partial read buffer.
 			
+			[theCurrentRead flushChunk];
 			void *buffer = [theCurrentRead->buffer mutableBytes] + theCurrentRead->startOffset;
 			
 			[partialReadBuffer replaceBytesInRange:NSMakeRange(0, 0)
@@ -2171,6 +2363,7 @@ Failed:
 	// Closing the streams or sockets resulted in closing the underlying native socket
 	theNativeSocket4 = 0;
 	theNativeSocket6 = 0;
+	theWriteChunkSize = 0;
 	
 	// Remove run loop sources
     if (theSource4 != NULL) 
@@ -3407,6 +3600,18 @@ Failed:
 	}
 }
 
+/**
+ * How many bytes the socket says are waiting to be read, or 0 if it won't say.
+**/
+- (NSUInteger)bytesAvailableHint
+{
+	CFSocketNativeHandle native = (theNativeSocket4 > 0) ? theNativeSocket4 : theNativeSocket6;
+	int available = 0;
+	
+	if (native <= 0 || ioctl(native, FIONREAD, &available) < 0) return 0;
+	return (available > 0) ? (NSUInteger)available : 0;
+}
+
 /**
  * This method is called when a new read is taken from the read queue or when new data becomes available on the stream.
 **/
@@ -3470,6 +3675,12 @@ Failed:
 				}
 			}
 		}
+		else if ([theCurrentRead readsIntoChunk])
+		{
+			// Read type #1 into a pooled chunk, sized from what the socket says it has
+			
+			bytesToRead = MAX([self bytesAvailableHint], READALL_CHUNKSIZE);
+		}
 		else
 		{
 			// Read type #1 or #2
@@ -3477,22 +3688,41 @@ Failed:
 			bytesToRead = [theCurrentRead readLengthForNonTerm];
 		}
 		
-		// Make sure we have enough room in the buffer for our read
+		void *buffer;
+		void *subBuffer;
 		
-		NSUInteger buffSize = [theCurrentRead->buffer length];
-		NSUInteger buffSpace = buffSize - theCurrentRead->startOffset - theCurrentRead->bytesDone;
-		
-		if (bytesToRead > buffSpace)
+		if ([theCurrentRead readsIntoChunk])
 		{
-			NSUInteger buffInc = bytesToRead - buffSpace;
+			// Take whatever room the chunk has; it is ours until the read completes.
+			
+			subBuffer = [theCurrentRead chunkSpaceFor:bytesToRead];
+			buffer = subBuffer - theCurrentRead->bytesDone;
 			
-			[theCurrentRead->buffer increaseLengthBy:buffInc];
+			bytesToRead = theCurrentRead->chunkSize - theCurrentRead->bytesDone;
+			if (theCurrentRead->maxLength > 0)
+			{
+				bytesToRead = MIN(bytesToRead, (theCurrentRead->maxLength - theCurrentRead->bytesDone));
+			}
+		}
+		else
+		{
+			// Make sure we have enough room in the buffer for our read
+			
+			NSUInteger buffSize = [theCurrentRead->buffer length];
+			NSUInteger buffSpace = buffSize - theCurrentRead->startOffset - theCurrentRead->bytesDone;
+			
+			if (bytesToRead > buffSpace)
+			{
+				NSUInteger buffInc = bytesToRead - buffSpace;
+				
+				[theCurrentRead->buffer increaseLengthBy:buffInc];
+			}
+			
+			// Read data into packet buffer
+			
+			buffer = [theCurrentRead->buffer mutableBytes] + theCurrentRead->startOffset;
+			subBuffer = buffer + theCurrentRead->bytesDone;
 		}
-		
-		// Read data into packet buffer
-		
-		void *buffer = [theCurrentRead->buffer mutableBytes] + theCurrentRead->startOffset;
-		void *subBuffer = buffer + theCurrentRead->bytesDone;
 		
 		CFIndex result = [self readIntoBuffer:subBuffer maxLength:bytesToRead];
 		
@@ -3637,7 +3867,18 @@ Failed:
 	
 	NSData *result;
 	
-	if (theCurrentRead->bufferOwner)
+	if (theCurrentRead->bufferOwner && theCurrentRead->chunk)
+	{
+		// We read into a pooled chunk on behalf of the user.
+		// Hand the chunk over as is; it goes back to the pool when the user releases it.
+		result = [[[AsyncReadChunk alloc] initWithChunk:theCurrentRead->chunk
+		                                           size:theCurrentRead->chunkSize
+		                                         length:theCurrentRead->bytesDone] autorelease];
+		
+		theCurrentRead->chunk = NULL;
+		theCurrentRead->chunkSize = 0;
+	}
+	else if (theCurrentRead->bufferOwner)
 	{
 		// We created the buffer on behalf of the user.
 		// Trim our buffer to be the proper size.
@@ -3828,6 +4069,27 @@ Failed:
 	}
 }
 
+/**
+ * How much to hand the write stream at once. It starts at the socket's send buffer (SO_SNDBUF),
+ * shrinks to what a write managed to get in when the buffer fills, and doubles back up (to WRITE_CHUNKSIZE_MAX)
+ * while whole chunks go through.
+**/
+- (NSUInteger)writeChunkSize
+{
+	if (theWriteChunkSize == 0)
+	{
+		CFSocketNativeHandle native = (theNativeSocket4 > 0) ? theNativeSocket4 : theNativeSocket6;
+		int sndbuf = 0;
+		socklen_t len = sizeof(sndbuf);
+		
+		if (native > 0 && getsockopt(native, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == 0 && sndbuf > WRITE_CHUNKSIZE)
+			theWriteChunkSize = MIN((NSUInteger)sndbuf, WRITE_CHUNKSIZE_MAX);
+		else
+			theWriteChunkSize = WRITE_CHUNKSIZE;
+	}
+	return theWriteChunkSize;
+}
+
 - (void)doSendBytes
 {
 	if ((theCurrentWrite == nil) || (theWriteStream == NULL))
@@ -3835,66 +4097,103 @@ Failed:
 		return;
 	}
 	
-	// Note: This method is not called if theCurrentWrite is an AsyncSpecialPacket (startTLS packet)
+	// Called again from maybeDequeueWrite below: the loop here takes the next packet.
+	if (theFlags & kSendingBytes)
+	{
+		return;
+	}
 	
-	NSUInteger totalBytesWritten = 0;
+	// Note: This method is not called if theCurrentWrite is an AsyncSpecialPacket (startTLS packet)
 	
-	BOOL done = NO;
-	BOOL error = NO;
+	theFlags |= kSendingBytes;
 	
-	while (!done && !error && [self canAcceptBytes])
+	while (theCurrentWrite != nil && ![theCurrentWrite isKindOfClass:[AsyncSpecialPacket class]])
 	{
-		// Figure out what to write
-		NSUInteger bytesRemaining = [theCurrentWrite->buffer length] - theCurrentWrite->bytesDone;
-		NSUInteger bytesToWrite = (bytesRemaining < WRITE_CHUNKSIZE) ? bytesRemaining : WRITE_CHUNKSIZE;
-		
-		UInt8 *writestart = (UInt8 *)([theCurrentWrite->buffer bytes] + theCurrentWrite->bytesDone);
+		NSUInteger totalBytesWritten = 0;
 		
-		// Write
-		CFIndex result = CFWriteStreamWrite(theWriteStream, writestart, bytesToWrite);
+		BOOL done = NO;
+		BOOL error = NO;
 		
-		// Unset the "can accept bytes" flag
-		theFlags &= ~kSocketCanAcceptBytes;
-		
-		// Check results
-		if (result < 0)
+		while (!done && !error && [self canAcceptBytes])
 		{
-			error = YES;
+			// Figure out what to write
+			NSUInteger bytesRemaining = [theCurrentWrite->buffer length] - theCurrentWrite->bytesDone;
+			NSUInteger chunkSize = [self writeChunkSize];
+			NSUInteger bytesToWrite = (bytesRemaining < chunkSize) ? bytesRemaining : chunkSize;
+			
+			UInt8 *writestart = (UInt8 *)([theCurrentWrite->buffer bytes] + theCurrentWrite->bytesDone);
+			
+			// Write
+			CFIndex result = CFWriteStreamWrite(theWriteStream, writestart, bytesToWrite);
+			
+			// Unset the "can accept bytes" flag
+			theFlags &= ~kSocketCanAcceptBytes;
+			
+			// Check results
+			if (result < 0)
+			{
+				error = YES;
+			}
+			else
+			{
+				CFIndex bytesWritten = result;
+				
+				// Adapt the chunk size to what the socket took
+				if ((NSUInteger)bytesWritten < bytesToWrite)
+					theWriteChunkSize = MAX((NSUInteger)bytesWritten, WRITE_CHUNKSIZE);
+				else if (bytesToWrite == chunkSize)
+					theWriteChunkSize = MIN(chunkSize * 2, WRITE_CHUNKSIZE_MAX);
+				
+				// Update total amount read for the current write
+				theCurrentWrite->bytesDone += bytesWritten;
+				
+				// Update total amount written in this method invocation
+				totalBytesWritten += bytesWritten;
+				
+				// Is packet done?
+				done = ([theCurrentWrite->buffer length] == theCurrentWrite->bytesDone);
+			}
 		}
-		else
+		
+		if(done)
 		{
-			CFIndex bytesWritten = result;
-			
-			// Update total amount read for the current write
-			theCurrentWrite->bytesDone += bytesWritten;
+			[self completeCurrentWrite];
 			
-			// Update total amount written in this method invocation
-			totalBytesWritten += bytesWritten;
+			// While the stream still takes bytes, go straight on with the next packet
+			// rather than waiting a run loop pass for it.
+			if (theWriteStream != NULL && [theWriteQueue count] > 0 && [self canAcceptBytes])
+			{
+				[self maybeDequeueWrite];
+			}
+			else
+			{
+				[self scheduleDequeueWrite];
+				break;
+			}
+		}
+		else if(error)
+		{
+			theFlags &= ~kSendingBytes;
 			
-			// Is packet done?
-			done = ([theCurrentWrite->buffer length] == theCurrentWrite->bytesDone);
+			CFStreamError err = CFWriteStreamGetError(theWriteStream);
+			[self closeWithError:[self errorFromCFStreamError:err]];
+			return;
 		}
-	}
-	
-	if(done)
-	{
-		[self completeCurrentWrite];
-		[self scheduleDequeueWrite];
-	}
-	else if(error)
-	{
-		CFStreamError err = CFWriteStreamGetError(theWriteStream);
-		[self closeWithError:[self errorFromCFStreamError:err]];
-		return;
-	}
-	else if (totalBytesWritten > 0)
-	{
-		// We're not done with the entire write, but we have written some bytes
-		if ([theDelegate respondsToSelector:@selector(onSocket:didWritePartialDataOfLength:tag:)])
+		else
 		{
-			[theDelegate onSocket:self didWritePartialDataOfLength:totalBytesWritten tag:theCurrentWrite->tag];
+			if (totalBytesWritten > 0)
+			{
+				// We're not done with the entire write, but we have written some bytes
+				if ([theDelegate respondsToSelector:@selector(onSocket:didWritePartialDataOfLength:tag:)])
+				{
+					[theDelegate onSocket:self didWritePartialDataOfLength:totalBytesWritten tag:theCurrentWrite->tag];
+				}
+			}
+			break;
 		}
 	}
+	
+	theFlags &= ~kSendingBytes;
 }
 
 // Ends current write and calls delegate.
@@ -4180,4 +4479,13 @@ static void MyCFWriteStreamCallback (CFWriteStreamRef stream, CFStreamEventType
 	return [NSData dataWithBytes:"" length:1];
 }
 
++ (void)getReadPoolReused:(NSUInteger *)reused allocated:(NSUInteger *)allocated oversized:(NSUInteger *)oversized
+{
+	pthread_mutex_lock(&readPoolLock);
+	if (reused) *reused = readPoolReused;
+	if (allocated) *allocated = readPoolAllocated;
+	if (oversized) *oversized = readPoolOversized;
+	pthread_mutex_unlock(&readPoolLock);
+}
+
 @end
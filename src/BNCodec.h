@@ -0,0 +1,45 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import <Foundation/Foundation.h>
+
+// Turns dictionaries into BSON and back. A BNConnection encodes and decodes
+// with exactly one codec (see BNConnection.codec), so what runs on the wire
+// never depends on which categories happened to load last.
+// Codecs are stateless and safe to share between connections and threads.
+// Decoded binary values may reference the data they came from (see
+// NuBSONDataSlice), so data passed to decodeData: must not be mutated after.
+@protocol BNCodec <NSObject>
+- (NSData *) encodeDictionary:(NSDictionary *)dict;
+- (NSMutableDictionary *) decodeData:(NSData *)data;
+@end
+
+
+// Martin Kou's bson-objc (BSONRepresentation / BSONValue).
+@interface BNBSONObjCCodec : NSObject <BNCodec> {}
++ (BNBSONObjCCodec *) codec;
+@end
+
+
+// lib/NuBSON. Keys in enumeration order unless canonical is set.
+@interface BNNuBSONCodec : NSObject <BNCodec> {
+  BOOL canonical;
+}
+@property (readonly) BOOL canonical;
+- (id) initCanonical:(BOOL)canonical;
++ (BNNuBSONCodec *) codec;
+@end
+
+
+// C-level codec over bson.c: encodes via CoreFoundation accessors (no
+// per-value objCType parsing or UTF-8 conversion when a C string pointer is
+// available), and decodes straight into CF containers with interned keys.
+// Values it has no fast path for go through NuBSON, so output decodes to the
+// same dictionaries as the other codecs.
+@interface BNFastCodec : NSObject <BNCodec> {}
++ (BNFastCodec *) codec;
+@end
@@ -0,0 +1,292 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import "BNCodec.h"
+#import "NuBSON.h"
+#import <bson-objc/BSONCodec.h>
+
+@implementation BNBSONObjCCodec
+
++ (BNBSONObjCCodec *) codec {
+  return [[[BNBSONObjCCodec alloc] init] autorelease];
+}
+
+- (NSData *) encodeDictionary:(NSDictionary *)dict {
+  return [dict BSONRepresentation];
+}
+
+- (NSMutableDictionary *) decodeData:(NSData *)data {
+  return [NSMutableDictionary dictionaryWithDictionary:[data BSONValue]];
+}
+
+@end
+
+//------------------------------------------------------------------------------
+
+@implementation BNNuBSONCodec
+
+@synthesize canonical;
+
+- (id) init {
+  return [self initCanonical:NO];
+}
+
+- (id) initCanonical:(BOOL)_canonical {
+  if ((self = [super init])) {
+    canonical = _canonical;
+  }
+  return self;
+}
+
++ (BNNuBSONCodec *) codec {
+  return [[[BNNuBSONCodec alloc] init] autorelease];
+}
+
+- (NSData *) encodeDictionary:(NSDictionary *)dict {
+  if (canonical)
+    return [dict NuBSONCanonicalRepresentation];
+  return [dict NuBSONRepresentation];
+}
+
+- (NSMutableDictionary *) decodeData:(NSData *)data {
+  return [data NuBSONValueNoCopy];
+}
+
+@end
+
+//------------------------------------------------------------------------------
+#pragma mark Fast codec
+
+enum {
+  kFAST_INITIAL_SIZE = 512,
+  kFAST_STACK_ITEMS = 32,   // containers up to this size need no malloc.
+  kFAST_STACK_STRING = 256, // nor do strings converted to UTF-8.
+};
+
+static Class StringClass, NumberClass, DictionaryClass, ArrayClass;
+static Class DataClass, DateClass, NullClass;
+
+static void fast_append(bson_buffer *bb, const char *name, id object);
+
+// A C string for str, without converting when CF already holds one.
+static const char *fast_cstring(CFStringRef str, char *buffer, CFIndex size) {
+  const char *cstr = CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+  if (cstr)
+    return cstr;
+  if (CFStringGetCString(str, buffer, size, kCFStringEncodingUTF8))
+    return buffer;
+  return [(NSString *)str UTF8String];
+}
+
+static void fast_append_dictionary(bson_buffer *bb, CFDictionaryRef dict) {
+  CFIndex count = CFDictionaryGetCount(dict);
+  const void *stackKeys[kFAST_STACK_ITEMS], *stackValues[kFAST_STACK_ITEMS];
+  const void **keys = stackKeys, **values = stackValues;
+  if (count > kFAST_STACK_ITEMS) {
+    keys = malloc(sizeof(void *) * count);
+    values = malloc(sizeof(void *) * count);
+  }
+
+  CFDictionaryGetKeysAndValues(dict, keys, values);
+  for (CFIndex i = 0; i < count; i++) {
+    char buffer[kFAST_STACK_STRING];
+    const char *name = fast_cstring(keys[i], buffer, sizeof(buffer));
+    fast_append(bb, name, (id)values[i]);
+  }
+
+  if (keys != stackKeys) {
+    free(keys);
+    free(values);
+  }
+}
+
+static void fast_append_array(bson_buffer *bb, CFArrayRef array) {
+  CFIndex count = CFArrayGetCount(array);
+  const void *stackValues[kFAST_STACK_ITEMS];
+  const void **values = stackValues;
+  if (count > kFAST_STACK_ITEMS)
+    values = malloc(sizeof(void *) * count);
+
+  CFArrayGetValues(array, CFRangeMake(0, count), values);
+  for (CFIndex i = 0; i < count; i++) {
+    char name[24];
+    snprintf(name, sizeof(name), "%ld", (long)i);
+    fast_append(bb, name, (id)values[i]);
+  }
+
+  if (values != stackValues)
+    free(values);
+}
+
+static void fast_append(bson_buffer *bb, const char *name, id object) {
+  if ([object isKindOfClass:StringClass]) {
+    char buffer[kFAST_STACK_STRING];
+    bson_append_string(bb, name,
+      fast_cstring((CFStringRef)object, buffer, sizeof(buffer)));
+  }
+  else if ([object isKindOfClass:NumberClass]) {
+    CFNumberRef number = (CFNumberRef)object;
+    if (CFGetTypeID(number) == CFBooleanGetTypeID()) {
+      bson_append_bool(bb, name, CFBooleanGetValue((CFBooleanRef)number));
+    }
+    else if (CFNumberIsFloatType(number)) {
+      double d;
+      CFNumberGetValue(number, kCFNumberDoubleType, &d);
+      bson_append_double(bb, name, d);
+    }
+    else if (CFNumberGetByteSize(number) > 4) {
+      int64_t l;
+      CFNumberGetValue(number, kCFNumberSInt64Type, &l);
+      bson_append_long(bb, name, l);
+    }
+    else {
+      int32_t i;
+      CFNumberGetValue(number, kCFNumberSInt32Type, &i);
+      bson_append_int(bb, name, i);
+    }
+  }
+  else if ([object isKindOfClass:DictionaryClass]) {
+    bson_append_start_object(bb, name);
+    fast_append_dictionary(bb, (CFDictionaryRef)object);
+    bson_append_finish_object(bb);
+  }
+  else if ([object isKindOfClass:ArrayClass]) {
+    bson_append_start_array(bb, name);
+    fast_append_array(bb, (CFArrayRef)object);
+    bson_append_finish_object(bb);
+  }
+  else if ([object isKindOfClass:DataClass]) {
+    bson_append_binary(bb, name, 0,
+      (const char *)CFDataGetBytePtr((CFDataRef)object),
+      (int)CFDataGetLength((CFDataRef)object));
+  }
+  else if ([object isKindOfClass:NullClass]) {
+    bson_append_null(bb, name);
+  }
+  else if ([object isKindOfClass:DateClass]) {
+    CFAbsoluteTime t = CFDateGetAbsoluteTime((CFDateRef)object);
+    bson_date_t millis = (bson_date_t)
+      ((t + kCFAbsoluteTimeIntervalSince1970) * 1000.0);
+    bson_append_date(bb, name, millis);
+  }
+  else { // object ids and the like: whatever NuBSON does with them.
+    add_object_to_bson_buffer(bb, [NSString stringWithUTF8String:name], object);
+  }
+}
+
+// Returns a +1 reference, or NULL for types that are skipped.
+static CFTypeRef fast_decode(const bson_iterator *it, NSData *frame);
+
+static void fast_decode_fields(bson_iterator *it, CFMutableDictionaryRef dict,
+  CFMutableArrayRef array, NSData *frame) {
+  while (bson_iterator_next(it)) {
+    CFTypeRef value = fast_decode(it, frame);
+    if (!value)
+      continue;
+
+    if (dict) {
+      NSString *key = retained_string_for_key(bson_iterator_key(it));
+      if (key)
+        CFDictionarySetValue(dict, key, value);
+      [key release];
+    } else {
+      CFArrayAppendValue(array, value);
+    }
+    CFRelease(value);
+  }
+}
+
+static CFTypeRef fast_decode(const bson_iterator *it, NSData *frame) {
+  bson_iterator sub;
+  switch (bson_iterator_type(it)) {
+    case bson_double: {
+      double d = bson_iterator_double_raw(it);
+      return CFNumberCreate(NULL, kCFNumberDoubleType, &d);
+    }
+    case bson_int: {
+      int32_t i = bson_iterator_int_raw(it);
+      return CFNumberCreate(NULL, kCFNumberSInt32Type, &i);
+    }
+    case bson_long: {
+      int64_t l = bson_iterator_long_raw(it);
+      return CFNumberCreate(NULL, kCFNumberSInt64Type, &l);
+    }
+    case bson_bool:
+      return CFRetain(bson_iterator_bool_raw(it) ? kCFBooleanTrue
+        : kCFBooleanFalse);
+    case bson_null:
+      return CFRetain(kCFNull);
+    case bson_string:
+      // string_len counts the trailing NUL.
+      return CFStringCreateWithBytes(NULL,
+        (const UInt8 *)bson_iterator_string(it),
+        bson_iterator_string_len(it) - 1, kCFStringEncodingUTF8, false);
+    case bson_date:
+      return CFDateCreate(NULL, 0.001 * bson_iterator_date(it)
+        - kCFAbsoluteTimeIntervalSince1970);
+    case bson_object: {
+      CFMutableDictionaryRef dict = CFDictionaryCreateMutable(NULL, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+      bson_iterator_subiterator(it, &sub);
+      fast_decode_fields(&sub, dict, NULL, frame);
+      return dict;
+    }
+    case bson_array: {
+      CFMutableArrayRef array = CFArrayCreateMutable(NULL, 0,
+        &kCFTypeArrayCallBacks);
+      bson_iterator_subiterator(it, &sub);
+      fast_decode_fields(&sub, NULL, array, frame);
+      return array;
+    }
+    default: { // bindata (sliced), object ids: whatever NuBSON does.
+      id value = object_for_bson_iterator_in_data(it, frame);
+      return value ? CFRetain(value) : NULL;
+    }
+  }
+}
+
+@implementation BNFastCodec
+
++ (void) initialize {
+  if (self != [BNFastCodec class])
+    return;
+  StringClass = [NSString class];
+  NumberClass = [NSNumber class];
+  DictionaryClass = [NSDictionary class];
+  ArrayClass = [NSArray class];
+  DataClass = [NSData class];
+  DateClass = [NSDate class];
+  NullClass = [NSNull class];
+}
+
++ (BNFastCodec *) codec {
+  return [[[BNFastCodec alloc] init] autorelease];
+}
+
+- (NSData *) encodeDictionary:(NSDictionary *)dict {
+  bson_buffer bb;
+  bson_buffer_init_size(&bb, kFAST_INITIAL_SIZE);
+  fast_append_dictionary(&bb, (CFDictionaryRef)dict);
+
+  char *data = bson_buffer_finish(&bb);
+  int length;
+  bson_little_endian32(&length, data);
+  return [NSData dataWithBytesNoCopy:data length:length freeWhenDone:YES];
+}
+
+- (NSMutableDictionary *) decodeData:(NSData *)data {
+  CFMutableDictionaryRef dict = CFDictionaryCreateMutable(NULL, 0,
+    &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  if ([data length] >= 5) {
+    bson_iterator it;
+    bson_iterator_init(&it, [data bytes]);
+    fast_decode_fields(&it, dict, NULL, data);
+  }
+  return [(NSMutableDictionary *)dict autorelease];
+}
+
+@end
@@ -6,8 +6,12 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <pthread.h>
 #import "AsyncSocket.h"
 #import <bson-objc/BSONCodec.h>
+#import "BNDocument.h"
+#import "BNDocumentBuilder.h"
+#import "BNCodec.h"
 
 typedef enum {
   BNConnectionDisconnected = 0,
@@ -21,10 +25,63 @@ typedef enum {
 extern NSString * const BNConnectionDisconnectedNotification;
 extern NSString * const BNConnectionConnectedNotification;
 
+// Errors passed to connection:error:
+extern NSString * const BNConnectionErrorDomain;
+typedef enum {
+  BNConnectionErrorInvalidFrame = 1, // malformed BSON. peer is disconnected.
+  BNConnectionErrorFrameTooLarge,    // over maxFrameSize. peer is disconnected.
+} BNConnectionErrorCode;
+
 typedef UInt16 BNMessageId;
 
+// Read sizes: bucket i counts reads of up to 64 << i bytes; the last, the rest.
+#define BNConnectionReadSizeBuckets 12
+
+typedef struct {
+  uint64_t framesIn;
+  uint64_t bytesIn;
+  uint64_t framesOut;    // handed to the socket.
+  uint64_t bytesOut;     // written.
+  NSUInteger queuedBytes; // accepted, not yet written (see highWatermark).
+  NSUInteger largestFrameIn;
+  NSUInteger largestFrameOut;
+  NSTimeInterval decodeTime;   // in codec, for receivedDictionary.
+  NSTimeInterval dispatchTime; // in delegate receive methods, less decoding.
+  uint64_t readSizes[BNConnectionReadSizeBuckets];
+} BNConnectionStats;
+
+// What a send does when highWatermark bytes are already queued.
+typedef enum {
+  BNBackpressureFail = 0, // returns 0.
+  BNBackpressureBlock,    // waits for lowWatermark (or for the connection
+                          // to fail, when connecting). fails on conn's thread.
+} BNBackpressurePolicy;
+
 @class BNConnection;
 
+// Cuts the byte stream into frames. Frames are handed out as slices of the
+// chunk they arrived in, so bytes in a chunk never move or get overwritten:
+// the read cursor just advances past each frame, and the only copying is of
+// a trailing partial frame, once, when the next read doesn't fit behind it.
+// When nothing is pending, a read is sliced up in place without any copy.
+@interface BNFrameReassembler : NSObject {
+  NSData *chunk_;
+  char *base_;          // writable bytes of chunk_, or NULL if adopted.
+  NSUInteger capacity_;
+  NSUInteger start_;    // first byte of the next frame.
+  NSUInteger end_;      // end of the bytes received.
+  NSUInteger maxFrameSize;
+}
+@property (nonatomic, assign) NSUInteger maxFrameSize; // 0 for none.
+- (void) appendData:(NSData *)data;
+// nil when incomplete, or with *error set (to a BNConnectionErrorCode).
+- (NSData *) nextFrame:(BNConnectionErrorCode *)error;
+- (NSUInteger) nextFrameLength; // after BNConnectionErrorFrameTooLarge.
+- (NSData *) takeBytes:(NSUInteger)max; // up to max pending bytes, as is.
+- (void) reset;
+- (NSUInteger) capacity; // of the chunk pending bytes are in.
+@end
+
 @protocol BNConnectionDelegate <NSObject>
 - (void) connection:(BNConnection *)conn error:(NSError *)error;
 - (void) connectionStateDidChange:(BNConnection *)conn;
@@ -36,19 +93,80 @@ typedef UInt16 BNMessageId;
 - (void) connection:(BNConnection *)conn receivedBSONData:(NSData *)bson;
 - (void) connection:(BNConnection *)conn
   receivedDictionary:(NSDictionary *)dict;
+
+// Lazy alternative to receivedDictionary: fields decode only when asked for.
+- (void) connection:(BNConnection *)conn receivedDocument:(BNDocument *)doc;
+
+// Every frame (NSData) that arrived in one read, in order, in one call.
+// Comes before the per-frame methods above, for delegates that have both.
+- (void) connection:(BNConnection *)conn receivedBatch:(NSArray *)frames;
+
+// Frames over maxFrameSize come here, part by part as they arrive, instead of
+// failing with BNConnectionErrorFrameTooLarge; none of it is buffered. Parts
+// are raw bytes, starting with the 4 byte length, and NOT validated (there is
+// no validating BSON without all of it). The last part ends at offset+length.
+- (void) connection:(BNConnection *)conn
+  receivedPartOfLargeFrame:(NSData *)part offset:(NSUInteger)offset
+  ofLength:(NSUInteger)length;
+
+// msgId was handed to the socket in full (not necessarily seen by the peer).
+// Called on the connection's thread, for blocking and enqueued sends alike.
+- (void) connection:(BNConnection *)conn didSendMessage:(BNMessageId)msgId;
+
+// Sends ran into highWatermark, and queued bytes are now down to lowWatermark.
+- (void) connectionDidDrain:(BNConnection *)conn;
 @end
 
 @interface BNConnection : NSObject <AsyncSocketDelegate> {
 
-  UInt16 lastIdUsed;
+  volatile UInt16 lastIdUsed;
+  void * volatile sendQueue_; // pushed by any thread, drained on thread_.
   NSString *address;
   AsyncSocket *socket_;
   NSThread *thread_; // for socket thread safety
-  NSMutableData *buffer_;
+  BNFrameReassembler *frames_;
+  NSMutableData *frame_; // the frame being read, when readsWholeFrames.
+  NSUInteger maxFrameSize;
+  NSUInteger compressionThreshold;
+  volatile BOOL peerInflates_; // peer said it takes compressed frames.
+  BOOL helloSent_; // the compression handshake, on this connection,
+  BOOL helloReceived_; // both ways.
+  NSUInteger streamLength_; // of the large frame being streamed, if any.
+  NSUInteger streamRemaining_;
+  BNBufferPool *pool_; // chunks for documentBuilder.
+  id<BNCodec> codec;
+  BOOL readsWholeFrames;
+
+  NSUInteger coalesceBytes;
+  NSTimeInterval coalesceDelay;
+  NSMutableData *coalesced_; // small frames waiting to go out together.
+  BNMessageId coalescedLast_;
+  NSMutableArray *unreported_; // written message ids, when coalescing.
+  BOOL flushScheduled_;
+
+  volatile NSInteger queuedBytes_; // accepted by a send, not yet written.
+  NSUInteger highWatermark;
+  NSUInteger lowWatermark;
+  BNBackpressurePolicy backpressurePolicy;
+  volatile BOOL overHigh_;
+  NSCondition *drained_;
+  NSMutableArray *writeLengths_; // of each socket write in flight.
+
+  BNConnectionStats stats_;
+  pthread_mutex_t statsLock_;
 
   NSTimeInterval timeout;
   BNConnectionState state;
   id<BNConnectionDelegate> delegate;
+  struct { // which optional methods delegate has, looked up once.
+    unsigned int receivedBSONData:1;
+    unsigned int receivedDictionary:1;
+    unsigned int receivedDocument:1;
+    unsigned int receivedBatch:1;
+    unsigned int receivedPartOfLargeFrame:1;
+    unsigned int didSendMessage:1;
+    unsigned int didDrain:1;
+  } delegateHas_;
 }
 
 @property (nonatomic, readonly) BNConnectionState state;
@@ -62,20 +180,92 @@ typedef UInt16 BNMessageId;
 @property (nonatomic, readonly) NSString *connectedAddress;
 @property (nonatomic, readonly) NSString *connectedHost;
 
+// Which optional methods it implements is looked up when it is set.
 @property (nonatomic, assign) id<BNConnectionDelegate> delegate;
 @property (nonatomic, assign) NSTimeInterval timeout;
 
+// Encodes sendDictionary: and decodes receivedDictionary:. BNBSONObjCCodec
+// by default; set it before connecting. Peers need not use the same codec.
+@property (nonatomic, retain) id<BNCodec> codec;
+
+// Larger frames disconnect the peer with BNConnectionErrorFrameTooLarge
+// (see receivedPartOfLargeFrame: for taking them anyway). 16MB by default;
+// 0 means no limit, so a peer can have a frame's advertised length (up to
+// 2GB) allocated. Compressed frames are still held to 64MB inflated then.
+@property (nonatomic, assign) NSUInteger maxFrameSize;
+
+// When non-zero, frames at least this large go out deflated, once the peer
+// has said (in a handshake) that it takes them; whatever doesn't shrink goes
+// out as is. The end that has this set when connecting starts the handshake,
+// and the other answers it if it has this set too, so a connection BNServer
+// accepts must set it in server:didConnect:. Until the handshake completes,
+// documents whose first key is $deflate or $bsonnetwork are delivered like
+// any other; after it, $deflate ones are inflated. 0 by default, which
+// leaves the peer's handshake (if any) to the delegate as a document.
+@property (nonatomic, assign) NSUInteger compressionThreshold;
+
+// Reads each frame's length first, then exactly that frame, straight into a
+// buffer of its size (no reassembly copies). Costs an extra read per frame,
+// so it pays off for large frames. NO by default; set it before connecting.
+@property (nonatomic, assign) BOOL readsWholeFrames;
+
+// When non-zero, frames smaller than coalesceBytes are gathered and written
+// together, once coalesceBytes are pending or coalesceDelay has passed (0,
+// the default, means the next run loop turn). Many small sends then cost one
+// socket write instead of one each. Set both before connecting.
+@property (nonatomic, assign) NSUInteger coalesceBytes;
+@property (nonatomic, assign) NSTimeInterval coalesceDelay;
+
+// Bounds the bytes waiting to be written to a slow peer. A send that would
+// take queuedBytes past highWatermark fails or blocks (backpressurePolicy)
+// until the peer catches up to lowWatermark; connectionDidDrain: tells when.
+// A frame larger than highWatermark still goes out once nothing is queued.
+// highWatermark 0 (the default) means unbounded. Set before connecting.
+@property (nonatomic, readonly) NSUInteger queuedBytes;
+@property (nonatomic, assign) NSUInteger highWatermark;
+@property (nonatomic, assign) NSUInteger lowWatermark;
+@property (nonatomic, assign) BNBackpressurePolicy backpressurePolicy;
+
 @property (nonatomic, readonly) BOOL isConnected;
 
 - (id) initWithAddress:(NSString *)address;
 - (id) initWithSocket:(AsyncSocket *)socket;
+// For a socket still being accepted, that its listener is about to move to
+// thread's run loop (see onSocket:wantsRunLoopForNewSocket:). The connection
+// lives on thread from then on.
+- (id) initWithSocket:(AsyncSocket *)socket thread:(NSThread *)thread;
 
 - (BOOL) connect; // returns whether connection is attempted. (AsyncSocket-like)
+// Returns at once, from any thread, without waiting on the connection's.
+// How it went comes through connectionStateDidChange:, on the connection's
+// thread: Connecting, then Connected, or back to Disconnected (after
+// connection:error: saying why, when known). Calls while not disconnected
+// do nothing.
+- (void) beginConnecting;
 - (void) disconnect;
 
+// Block until the connection's thread has the data; 0 if disconnected (or
+// over highWatermark, see backpressurePolicy).
 - (BNMessageId) sendDictionary:(NSDictionary *)dictionary;
 - (BNMessageId) sendBSONData:(NSData *)data;
 
+// Return immediately, from any thread: the data is queued and written on the
+// connection's thread soon after (see connection:didSendMessage:). Enqueued
+// data goes out in order, and before anything sent after it from the same
+// thread. 0 if disconnected (or over highWatermark, see backpressurePolicy);
+// data still queued at disconnection is dropped.
+- (BNMessageId) enqueueDictionary:(NSDictionary *)dictionary;
+- (BNMessageId) enqueueBSONData:(NSData *)data;
+
+// Builds directly into a chunk from this connection's pool; the chunk goes to
+// the socket as is and comes back to the pool once written.
+- (BNDocumentBuilder *) documentBuilder;
+- (BNMessageId) sendDocumentBuilder:(BNDocumentBuilder *)builder;
+
+// Counters since init. A consistent copy; safe to call from any thread.
+- (BNConnectionStats) stats;
+- (NSString *) statsString;
+
 + (NSString *) addressWithHost:(NSString *)host andPort:(UInt16)port;
 + (void) extractHost:(NSString **)host andPort:(UInt16 *)port
   fromAddress:(NSString *)address;
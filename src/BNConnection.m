@@ -6,39 +6,256 @@
 //
 #import <arpa/inet.h>  // for IPPROTO_TCP
 #import <netinet/tcp.h> // for TCP_NODELAY
+#import <zlib.h>
 
 #import "BNConnection.h"
 #import "AsyncSocket.h"
-#import "platform_hacks.h"
+#import "BNEpollSocket.h"
+#import "NuBSON.h"
 
 static NSTimeInterval kDEFAULT_TIMEOUT = -1;
+static const NSUInteger kDEFAULT_MAX_FRAME_SIZE = 16 << 20;
+
+enum { // read tags
+  kREAD_STREAM = 1, // whatever is available, cut up by BNFrameReassembler.
+  kREAD_LENGTH,     // readsWholeFrames: the 4 byte frame length,
+  kREAD_FRAME,      // then the rest of that frame.
+  kREAD_PART,       // part of a frame over maxFrameSize, being streamed.
+};
 
 NSString * const BNConnectionDisconnectedNotification =
   @"BNConnectionDisconnected";
 NSString * const BNConnectionConnectedNotification =
   @"BNConnectionConnected";
 
-#pragma mark BSON Utils
+NSString * const BNConnectionErrorDomain = @"BNConnectionErrorDomain";
+
+//------------------------------------------------------------------------------
+#pragma mark Frame Reassembly
+
+static const NSUInteger kCHUNK_SIZE = 16384;
+
+@implementation BNFrameReassembler
+
+@synthesize maxFrameSize;
+
+- (void) dealloc {
+  [chunk_ release];
+  [super dealloc];
+}
+
+- (void) reset {
+  [chunk_ release];
+  chunk_ = nil;
+  base_ = NULL;
+  capacity_ = start_ = end_ = 0;
+}
+
+- (void) appendData:(NSData *)data {
+  NSUInteger length = [data length];
+  NSUInteger pending = end_ - start_;
+  if (length == 0)
+    return;
+
+  if (pending == 0) {
+    // Adopt the read as is. AsyncSocket is done with it once it's handed
+    // to us, so it is as immutable as any other chunk.
+    [self reset];
+    chunk_ = [data retain];
+    capacity_ = end_ = length;
+    return;
+  }
+
+  if (base_ == NULL || capacity_ - end_ < length) {
+    // Doesn't fit behind what's pending: move just the partial frame into a
+    // new chunk. Growing at least 2x keeps a frame that spans many reads at
+    // O(frame) copying. The (unvalidated) length only ever trims that, unless
+    // maxFrameSize bounds it.
+    NSUInteger needed = pending + length;
+    NSUInteger size = MAX(kCHUNK_SIZE, 2 * needed);
+    if (pending >= 4) {
+      NSUInteger frameLength = [self nextFrameLength];
+      if (frameLength >= needed) {
+        if (maxFrameSize > 0 && frameLength <= maxFrameSize)
+          size = MAX(kCHUNK_SIZE, frameLength); // bounded; all of it at once.
+        else
+          size = MAX(kCHUNK_SIZE, MIN(size, frameLength));
+      }
+    }
+
+    char *base = malloc(size);
+    memcpy(base, (const char *)[chunk_ bytes] + start_, pending);
+    [chunk_ release];
+    chunk_ = [[NSData alloc] initWithBytesNoCopy:base length:size
+      freeWhenDone:YES];
+    base_ = base;
+    capacity_ = size;
+    start_ = 0;
+    end_ = pending;
+  }
+
+  memcpy(base_ + end_, [data bytes], length);
+  end_ += length;
+}
+
+- (NSUInteger) capacity {
+  return capacity_;
+}
+
+- (NSUInteger) nextFrameLength {
+  int frameLength;
+  bson_little_endian32(&frameLength, (const char *)[chunk_ bytes] + start_);
+  return frameLength < 0 ? 0 : (NSUInteger)frameLength;
+}
+
+- (NSData *) nextFrame:(BNConnectionErrorCode *)error {
+  *error = 0;
+  if (end_ - start_ < 4)
+    return nil;
+
+  const char *bytes = (const char *)[chunk_ bytes] + start_;
+  int frameLength;
+  bson_little_endian32(&frameLength, bytes);
+  if (maxFrameSize > 0 && frameLength > 0
+      && (NSUInteger)frameLength > maxFrameSize) {
+    *error = BNConnectionErrorFrameTooLarge;
+    return nil;
+  }
+  if (frameLength >= 0 && (NSUInteger)frameLength > end_ - start_)
+    return nil; // not all here yet.
+
+  // Peers are untrusted: nothing may reach a decoder (nor a negative length
+  // reach the cursors) before the whole frame is bounds-checked.
+  if (!bson_validate(bytes, frameLength)) {
+    *error = BNConnectionErrorInvalidFrame;
+    return nil;
+  }
+
+  NSData *frame = [NuBSONDataSlice sliceOfData:chunk_ bytes:bytes
+    length:frameLength];
+  start_ += frameLength;
+  if (start_ == end_ && base_ == NULL)
+    [self reset]; // adopted read fully consumed; let the slices have it.
+  return frame;
+}
+
+- (NSData *) takeBytes:(NSUInteger)max {
+  NSUInteger length = MIN(max, end_ - start_);
+  if (length == 0)
+    return nil;
+
+  NSData *bytes = [NuBSONDataSlice sliceOfData:chunk_
+    bytes:(const char *)[chunk_ bytes] + start_ length:length];
+  start_ += length;
+  if (start_ == end_ && base_ == NULL)
+    [self reset];
+  return bytes;
+}
+
+@end
+
+//------------------------------------------------------------------------------
+#pragma mark Send Queue
+
+// Lock-free: producers push onto a stack with compare-and-swap; the
+// connection's thread swaps out the whole stack at once and reverses it.
+// Nothing but the consumer ever dereferences a queued node, so pushes are
+// safe from ABA.
+typedef struct BNSendNode {
+  struct BNSendNode *next;
+  NSData *data;
+  BNMessageId msgId;
+} BNSendNode;
+
+//------------------------------------------------------------------------------
+#pragma mark Compression
+
+// Compressed and plain frames mix freely: a compressed frame is a document
+// whose first field is the deflated frame, so it still frames (and
+// validates) like any other. The handshake is a document of its own.
+//   { "$deflate": <binary, zlib>, "$length": <int, inflated> }
+//   { "$bsonnetwork": { "deflate": true } }
+// Until both ends have sent theirs, such documents are just documents.
+static const char *kDEFLATE_KEY = "$deflate";
+static const char *kLENGTH_KEY = "$length";
+static const char *kHELLO_KEY = "$bsonnetwork";
+
+// What a compressed frame may inflate to when maxFrameSize doesn't say.
+static const NSUInteger kMAX_INFLATED_SIZE = 64 << 20;
+
+// frame must be valid: a first field's key is then NUL-terminated in bounds.
+static BOOL frame_starts_with(NSData *frame, bson_type type, const char *key) {
+  const char *bytes = [frame bytes];
+  return [frame length] > 5 && bytes[4] == type && strcmp(bytes + 5, key) == 0;
+}
 
-static inline int __lengthOfFirstBSONDocument(NSData *data) {
+static NSData *data_for_bson_buffer(bson_buffer *bb) {
+  char *data = bson_buffer_finish(bb);
   int length;
-  const void *bytes = [data bytes];
-  bson_little_endian32(&length, bytes);
-  return length;
+  bson_little_endian32(&length, data);
+  return [NSData dataWithBytesNoCopy:data length:length freeWhenDone:YES];
 }
 
-static inline BOOL __dataContainsWholeDocument(NSData *data) {
-  if ([data length] < 4)
-    return NO;
-  return __lengthOfFirstBSONDocument(data) <= [data length];
+// nil unless it came out smaller.
+static NSData *deflate_frame(NSData *frame) {
+  uLongf length = compressBound([frame length]);
+  Bytef *deflated = malloc(length);
+  if (compress2(deflated, &length, [frame bytes], [frame length],
+      Z_BEST_SPEED) != Z_OK || length + 32 >= [frame length]) {
+    free(deflated);
+    return nil;
+  }
+
+  bson_buffer bb;
+  bson_buffer_init_size(&bb, length + 32); // + keys, lengths, types.
+  bson_append_binary(&bb, kDEFLATE_KEY, 0, (const char *)deflated, length);
+  bson_append_int(&bb, kLENGTH_KEY, [frame length]);
+  free(deflated);
+  return data_for_bson_buffer(&bb);
 }
 
+//------------------------------------------------------------------------------
+
+@interface BNConnection (Private)
+- (BNMessageId) __nextMessageId;
+- (void) __drainSendQueue;
+- (void) __writeData:(NSData *)data msgId:(BNMessageId)msgId;
+- (void) __scheduledFlush;
+- (void) __writeToSocket:(NSData *)data tag:(long)tag;
+- (BOOL) __overHighWatermark:(NSInteger)queued adding:(NSUInteger)length;
+- (BOOL) __admitBytes:(NSUInteger)length;
+- (BOOL) __acceptsSends;
+- (void) __releaseBytes:(NSUInteger)length;
+- (void) __flushWrites;
+- (void) __readNext;
+- (void) __didReadLength:(NSData *)data;
+- (void) __didReadFrame;
+- (BOOL) __deliverFrames:(NSArray *)frames;
+- (void) __readPart;
+- (void) __streamPart:(NSData *)part;
+- (void) __rejectFrame:(BNConnectionErrorCode)errorCode;
+- (NSData *) __compressed:(NSData *)data;
+- (NSData *) __inflated:(NSData *)frame error:(BNConnectionErrorCode *)error;
+- (NSArray *) __unwrapFrames:(NSArray *)frames
+  error:(BNConnectionErrorCode *)error;
+- (void) __sendHello;
+- (void) __asyncConnect;
+- (void) __receivedHello:(NSData *)frame;
++ (NSError *) error:(BNConnectionErrorCode)errorCode info:(NSString *)info;
+@end
+
 @implementation BNConnection
 
 @synthesize delegate;
 @synthesize timeout;
 @synthesize address;
 @synthesize state;
+@synthesize codec;
+@synthesize readsWholeFrames;
+@synthesize maxFrameSize;
+@synthesize compressionThreshold;
+@synthesize coalesceBytes, coalesceDelay;
+@synthesize highWatermark, lowWatermark, backpressurePolicy;
 
 #pragma mark Initialization
 
@@ -49,21 +266,37 @@ static inline BOOL __dataContainsWholeDocument(NSData *data) {
 }
 
 - (id) initWithSocket:(AsyncSocket *)_socket {
+  return [self initWithSocket:_socket thread:[NSThread currentThread]];
+}
+
+- (id) initWithSocket:(AsyncSocket *)_socket thread:(NSThread *)thread {
   if ((self = [super init])) {
     NSAssert(_socket != nil, @"Given socket must not be nil.");
     socket_ = [_socket retain];
 
     address = nil; // will get set by connection.
-    thread_ = [NSThread currentThread];
+    thread_ = thread;
 
     NSAssert([socket_ canSafelySetDelegate], @"Ensure delegate is ok.");
     socket_.delegate = self;
-    [socket_ moveToRunLoop:[NSRunLoop currentRunLoop]]; // idempotent + asserts.
+    if (thread_ == [NSThread currentThread]) // else the listener moves it.
+      [socket_ moveToRunLoop:[NSRunLoop currentRunLoop]]; // idempotent.
 
     timeout = kDEFAULT_TIMEOUT;
     state = socket_.isConnected ? BNConnectionConnected :BNConnectionConnecting;
-    buffer_ = [[NSMutableData alloc] init];
+    frames_ = [[BNFrameReassembler alloc] init];
+    self.maxFrameSize = kDEFAULT_MAX_FRAME_SIZE;
+    pool_ = [[BNBufferPool alloc] init];
+    codec = [[BNBSONObjCCodec alloc] init];
     lastIdUsed = 0;
+    sendQueue_ = NULL;
+    streamLength_ = streamRemaining_ = 0;
+    unreported_ = [[NSMutableArray alloc] init];
+    writeLengths_ = [[NSMutableArray alloc] init];
+    drained_ = [[NSCondition alloc] init];
+    queuedBytes_ = 0;
+    memset(&stats_, 0, sizeof(stats_));
+    pthread_mutex_init(&statsLock_, NULL);
   }
   return self;
 }
@@ -72,11 +305,22 @@ static inline BOOL __dataContainsWholeDocument(NSData *data) {
   if ((self = [super init])) {
     address = [_address copy];
     thread_ = [NSThread currentThread];
-    socket_ = [[AsyncSocket alloc] initWithDelegate:self];
+    socket_ = (AsyncSocket *)[[BNSocketClass alloc] initWithDelegate:self];
     timeout = kDEFAULT_TIMEOUT;
     state = BNConnectionDisconnected;
-    buffer_ = [[NSMutableData alloc] init];
+    frames_ = [[BNFrameReassembler alloc] init];
+    self.maxFrameSize = kDEFAULT_MAX_FRAME_SIZE;
+    pool_ = [[BNBufferPool alloc] init];
+    codec = [[BNBSONObjCCodec alloc] init];
     lastIdUsed = 0;
+    sendQueue_ = NULL;
+    streamLength_ = streamRemaining_ = 0;
+    unreported_ = [[NSMutableArray alloc] init];
+    writeLengths_ = [[NSMutableArray alloc] init];
+    drained_ = [[NSCondition alloc] init];
+    queuedBytes_ = 0;
+    memset(&stats_, 0, sizeof(stats_));
+    pthread_mutex_init(&statsLock_, NULL);
   }
   return self;
 }
@@ -87,11 +331,51 @@ static inline BOOL __dataContainsWholeDocument(NSData *data) {
   [socket_ release];
 
   [address release];
-  [buffer_ release];
-  buffer_ = nil;
+  [frames_ release];
+  frames_ = nil;
+  [frame_ release];
+  [coalesced_ release];
+  [unreported_ release];
+  [writeLengths_ release];
+  [drained_ release];
+  pthread_mutex_destroy(&statsLock_);
+  [pool_ release];
+
+  BNSendNode *node = sendQueue_;
+  while (node) {
+    BNSendNode *next = node->next;
+    [node->data release];
+    free(node);
+    node = next;
+  }
+
+  [codec release];
   [super dealloc];
 }
 
+- (void) setDelegate:(id<BNConnectionDelegate>)_delegate {
+  delegate = _delegate;
+  delegateHas_.receivedBSONData =
+    [delegate respondsToSelector:@selector(connection:receivedBSONData:)];
+  delegateHas_.receivedDictionary =
+    [delegate respondsToSelector:@selector(connection:receivedDictionary:)];
+  delegateHas_.receivedDocument =
+    [delegate respondsToSelector:@selector(connection:receivedDocument:)];
+  delegateHas_.receivedBatch =
+    [delegate respondsToSelector:@selector(connection:receivedBatch:)];
+  delegateHas_.receivedPartOfLargeFrame = [delegate respondsToSelector:
+    @selector(connection:receivedPartOfLargeFrame:offset:ofLength:)];
+  delegateHas_.didSendMessage =
+    [delegate respondsToSelector:@selector(connection:didSendMessage:)];
+  delegateHas_.didDrain =
+    [delegate respondsToSelector:@selector(connectionDidDrain:)];
+}
+
+- (void) setMaxFrameSize:(NSUInteger)size {
+  maxFrameSize = size;
+  frames_.maxFrameSize = size;
+}
+
 //------------------------------------------------------------------------------
 #pragma mark BNConnection connect
 
@@ -134,6 +418,40 @@ static inline BOOL __dataContainsWholeDocument(NSData *data) {
   return success;
 }
 
+- (void) beginConnecting {
+  // Only one caller, on whichever thread, gets to start connecting. Taking
+  // Connecting here, not on thread_, lets a disconnect before __asyncConnect
+  // runs call it off.
+  if (!__sync_bool_compare_and_swap(&state, BNConnectionDisconnected,
+      BNConnectionConnecting))
+    return;
+
+  [self performSelector:@selector(__asyncConnect) onThread:thread_
+    withObject:nil waitUntilDone:NO];
+}
+
+- (void) __asyncConnect {
+  if (state == BNConnectionConnecting) {
+    // On thread_, as every other state change is reported.
+    [delegate connectionStateDidChange:self];
+
+    NSMutableArray *array = [NSMutableArray array];
+    [self __safeConnect:array];
+    if ([[array objectAtIndex:0] boolValue])
+      return; // the socket reports from here on.
+  }
+
+  // Refused outright, or disconnected before we got to it: the socket will
+  // never call back, so finish up as it would have.
+  state = BNConnectionDisconnected;
+  [drained_ lock];
+  [drained_ broadcast]; // sends blocked while connecting fail now.
+  [drained_ unlock];
+  [delegate connectionStateDidChange:self];
+  NSNotificationCenter *nc = [NSNotificationCenter defaultCenter];
+  [nc postNotificationName:BNConnectionDisconnectedNotification object:self];
+}
+
 - (void) disconnect {
   if (state == BNConnectionDisconnected)
     return;
@@ -152,19 +470,35 @@ static inline BOOL __dataContainsWholeDocument(NSData *data) {
 //------------------------------------------------------------------------------
 #pragma mark BNConnection Sending
 
+- (BNMessageId) __nextMessageId {
+  BNMessageId msgId;
+  do { // 0 means nothing was sent.
+    msgId = __sync_add_and_fetch(&lastIdUsed, 1);
+  } while (msgId == 0);
+  return msgId;
+}
+
 - (void) __safeSendBSONData:(NSMutableArray *)array {
+  [self __drainSendQueue]; // earlier enqueued data goes first.
+
+  NSData *data = [array objectAtIndex:0];
   if (state == BNConnectionDisconnected || state == BNConnectionDisconnecting) {
+    [self __releaseBytes:[data length]];
     [array addObject:[NSNumber numberWithLong:0]];
     return; // cannot send. disconnected.
   }
 
-  NSData *data = [array objectAtIndex:0];
+  BNMessageId msgId = [self __nextMessageId];
   // NSLog(@"Sending: %@", data);
-  [socket_ writeData:data withTimeout:timeout tag:1];
-  [array addObject:[NSNumber numberWithLong:++lastIdUsed]];
+  [self __writeData:data msgId:msgId];
+  [array addObject:[NSNumber numberWithLong:msgId]];
 }
 
 - (BNMessageId) sendBSONData:(NSData *)data {
+  data = [self __compressed:data];
+  if (![self __admitBytes:[data length]])
+    return 0;
+
   NSMutableArray *array = [NSMutableArray arrayWithObject:data];
 
   if ([NSThread currentThread] != thread_)
@@ -177,7 +511,193 @@ static inline BOOL __dataContainsWholeDocument(NSData *data) {
 }
 
 - (BNMessageId) sendDictionary:(NSDictionary *)dictionary {
-  return [self sendBSONData:[dictionary BSONRepresentation]];
+  return [self sendBSONData:[codec encodeDictionary:dictionary]];
+}
+
+- (BNMessageId) enqueueBSONData:(NSData *)data {
+  if (state == BNConnectionDisconnected || state == BNConnectionDisconnecting)
+    return 0; // cannot send. disconnected.
+  data = [self __compressed:data];
+  if (![self __admitBytes:[data length]])
+    return 0;
+
+  BNMessageId msgId = [self __nextMessageId];
+  BNSendNode *node = malloc(sizeof(BNSendNode));
+  node->data = [data retain];
+  node->msgId = msgId;
+
+  BNSendNode *head;
+  do {
+    head = sendQueue_;
+    node->next = head;
+  } while (!__sync_bool_compare_and_swap(&sendQueue_, head, node));
+
+  // Only the push onto an empty queue needs to wake the socket thread; the
+  // drain it schedules picks up everything pushed until it runs.
+  if (head == NULL)
+    [self performSelector:@selector(__drainSendQueue) onThread:thread_
+      withObject:nil waitUntilDone:NO];
+  return msgId; // node may already be gone.
+}
+
+- (BNMessageId) enqueueDictionary:(NSDictionary *)dictionary {
+  return [self enqueueBSONData:[codec encodeDictionary:dictionary]];
+}
+
+- (void) __drainSendQueue {
+  BNSendNode *node = __sync_lock_test_and_set(&sendQueue_, NULL);
+
+  BNSendNode *fifo = NULL;
+  while (node) {
+    BNSendNode *next = node->next;
+    node->next = fifo;
+    fifo = node;
+    node = next;
+  }
+
+  BOOL disconnected = (state == BNConnectionDisconnected
+    || state == BNConnectionDisconnecting);
+  while (fifo) {
+    BNSendNode *next = fifo->next;
+    if (!disconnected)
+      [self __writeData:fifo->data msgId:fifo->msgId];
+    else
+      [self __releaseBytes:[fifo->data length]];
+    [fifo->data release];
+    free(fifo);
+    fifo = next;
+  }
+}
+
+- (void) __writeData:(NSData *)data msgId:(BNMessageId)msgId {
+  pthread_mutex_lock(&statsLock_);
+  stats_.framesOut++;
+  stats_.largestFrameOut = MAX(stats_.largestFrameOut, [data length]);
+  pthread_mutex_unlock(&statsLock_);
+
+  if (coalesceBytes == 0) {
+    [self __writeToSocket:data tag:msgId];
+    return;
+  }
+
+  // One write can carry many messages; didWriteDataWithTag: reports them all.
+  [unreported_ addObject:[NSNumber numberWithUnsignedShort:msgId]];
+
+  if ([data length] >= coalesceBytes) { // not worth copying.
+    [self __flushWrites];
+    [self __writeToSocket:data tag:msgId];
+    return;
+  }
+
+  if (!coalesced_)
+    coalesced_ = [[NSMutableData alloc] initWithCapacity:coalesceBytes];
+  [coalesced_ appendData:data];
+  coalescedLast_ = msgId;
+
+  if ([coalesced_ length] >= coalesceBytes) {
+    [self __flushWrites];
+  } else if (!flushScheduled_) {
+    flushScheduled_ = YES;
+    [self performSelector:@selector(__scheduledFlush) withObject:nil
+      afterDelay:coalesceDelay];
+  }
+}
+
+- (void) __scheduledFlush {
+  flushScheduled_ = NO;
+  [self __flushWrites];
+}
+
+- (void) __flushWrites {
+  if (!coalesced_)
+    return;
+
+  // AsyncSocket holds on to what it writes, so start a new buffer.
+  [self __writeToSocket:coalesced_ tag:coalescedLast_];
+  [coalesced_ release];
+  coalesced_ = nil;
+}
+
+- (void) __writeToSocket:(NSData *)data tag:(long)tag {
+  [writeLengths_ addObject:[NSNumber numberWithUnsignedInteger:[data length]]];
+  [socket_ writeData:data withTimeout:timeout tag:tag];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Backpressure
+
+- (NSUInteger) queuedBytes {
+  return queuedBytes_;
+}
+
+- (BOOL) __overHighWatermark:(NSInteger)queued adding:(NSUInteger)length {
+  // Anything fits into an empty queue, or a large frame could never go out.
+  return highWatermark > 0 && queued > 0
+    && (NSUInteger)queued + length > highWatermark;
+}
+
+// Any thread. Counts length as queued, unless over the high watermark.
+- (BOOL) __admitBytes:(NSUInteger)length {
+  for (;;) {
+    NSInteger queued = queuedBytes_;
+    if (![self __overHighWatermark:queued adding:length]) {
+      if (__sync_bool_compare_and_swap(&queuedBytes_, queued,
+          queued + (NSInteger)length))
+        return YES;
+      continue; // raced another send.
+    }
+
+    if (backpressurePolicy == BNBackpressureFail
+        || [NSThread currentThread] == thread_) { // would never drain.
+      overHigh_ = YES;
+      return NO;
+    }
+
+    // Flag first, then look: __releaseBytes lowers the count first, then
+    // looks at the flag, so at least one of the two sees the other. The wait
+    // happens under the lock it broadcasts with.
+    // A connection still connecting has its queue written once connected.
+    [drained_ lock];
+    for (;;) {
+      overHigh_ = YES;
+      __sync_synchronize();
+      if (![self __overHighWatermark:queuedBytes_ adding:length]
+          || ![self __acceptsSends])
+        break;
+      [drained_ wait];
+    }
+    [drained_ unlock];
+
+    if (![self __acceptsSends])
+      return NO;
+  }
+}
+
+- (BOOL) __acceptsSends {
+  return state == BNConnectionConnecting || state == BNConnectionConnected;
+}
+
+// Connection's thread. Bytes written (or dropped).
+- (void) __releaseBytes:(NSUInteger)length {
+  NSInteger queued = __sync_sub_and_fetch(&queuedBytes_, (NSInteger)length);
+  if (!overHigh_ || queued > (NSInteger)lowWatermark)
+    return;
+
+  [drained_ lock];
+  overHigh_ = NO;
+  [drained_ broadcast];
+  [drained_ unlock];
+
+  if (delegateHas_.didDrain)
+    [delegate connectionDidDrain:self];
+}
+
+- (BNDocumentBuilder *) documentBuilder {
+  return [BNDocumentBuilder builderWithPool:pool_];
+}
+
+- (BNMessageId) sendDocumentBuilder:(BNDocumentBuilder *)builder {
+  return [self sendBSONData:[builder finish]];
 }
 
 
@@ -212,12 +732,32 @@ static inline BOOL __dataContainsWholeDocument(NSData *data) {
 #pragma mark AsyncSocket Delegate
 
 - (void)onSocket:(AsyncSocket *)sock willDisconnectWithError:(NSError *)err {
+  if (state == BNConnectionConnecting && err != nil)
+    [delegate connection:self error:err]; // why connecting failed.
   state = BNConnectionDisconnecting;
   [delegate connectionStateDidChange:self];
 }
 
 - (void)onSocketDidDisconnect:(AsyncSocket *)sock {
   state = BNConnectionDisconnected;
+
+  // AsyncSocket dropped its writes; so are the ones still being gathered.
+  NSUInteger dropped = [coalesced_ length];
+  for (NSNumber *length in writeLengths_)
+    dropped += [length unsignedIntegerValue];
+  [writeLengths_ removeAllObjects];
+  [coalesced_ release];
+  coalesced_ = nil;
+  [unreported_ removeAllObjects];
+  [self __releaseBytes:dropped];
+
+  [frames_ reset]; // a new connection starts a new stream.
+  streamLength_ = streamRemaining_ = 0;
+  peerInflates_ = helloSent_ = helloReceived_ = NO;
+
+  [drained_ lock];
+  [drained_ broadcast]; // blocked sends fail now.
+  [drained_ unlock];
   [delegate connectionStateDidChange:self];
 
   NSNotificationCenter *nc = [NSNotificationCenter defaultCenter];
@@ -226,6 +766,38 @@ static inline BOOL __dataContainsWholeDocument(NSData *data) {
     sock.delegate = nil;
 }
 
+- (void)onSocket:(AsyncSocket *)sock didWriteDataWithTag:(long)tag {
+  if ([writeLengths_ count] > 0) {
+    NSUInteger length = [[writeLengths_ objectAtIndex:0] unsignedIntegerValue];
+    [writeLengths_ removeObjectAtIndex:0];
+    [self __releaseBytes:length];
+
+    pthread_mutex_lock(&statsLock_);
+    stats_.bytesOut += length;
+    pthread_mutex_unlock(&statsLock_);
+  }
+
+  if (tag == 0)
+    return; // the handshake: no message of anyone's.
+
+  BOOL report = delegateHas_.didSendMessage;
+  if ([unreported_ count] == 0) {
+    if (report)
+      [delegate connection:self didSendMessage:(BNMessageId)tag];
+    return;
+  }
+
+  // Writes complete in order; tag is the last message the write carried.
+  while ([unreported_ count] > 0) {
+    BNMessageId msgId = [[unreported_ objectAtIndex:0] unsignedShortValue];
+    [unreported_ removeObjectAtIndex:0];
+    if (report)
+      [delegate connection:self didSendMessage:msgId];
+    if (msgId == (BNMessageId)tag)
+      break;
+  }
+}
+
 - (void) onSocket:(AsyncSocket *)lstn didAcceptNewSocket:(AsyncSocket *)sock {
   [NSException raise:@"BNConnectionSocketMisuse"
     format:@"Connection accepted a new socket. This should not happen."];
@@ -255,50 +827,383 @@ static inline BOOL __dataContainsWholeDocument(NSData *data) {
     address = [[[self class] addressWithHost:host andPort:port] retain];
 
   CFSocketRef cfsock = [sock getCFSocket];
-  CFSocketNativeHandle rawsock = CFSocketGetNative(cfsock);
-  int flag = 1;
-  setsockopt(rawsock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+  if (cfsock) { // BNEpollSocket has none, and sets TCP_NODELAY itself.
+    CFSocketNativeHandle rawsock = CFSocketGetNative(cfsock);
+    int flag = 1;
+    setsockopt(rawsock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+  }
+
+  if (compressionThreshold != 0)
+    [self __sendHello]; // before anything the delegate sends.
 
   state = BNConnectionConnected;
   [delegate connectionStateDidChange:self];
   NSNotificationCenter *nc = [NSNotificationCenter defaultCenter];
   [nc postNotificationName:BNConnectionConnectedNotification object:self];
 
-  [socket_ readDataWithTimeout:timeout tag:1];
+  [self __readNext];
 }
 
 - (void)onSocket:(AsyncSocket *)sock didReadData:(NSData *)data
   withTag:(long)tag {
-  if (!buffer_) {
+  if (!frames_) {
     // NSLog(@"ERROR: Connection without a buffer received data.");
     return;
   }
 
-  [buffer_ appendData:data];
+  NSUInteger length = [data length];
+  int bucket = 0;
+  while (bucket < BNConnectionReadSizeBuckets - 1 && length > (64u << bucket))
+    bucket++;
+  pthread_mutex_lock(&statsLock_);
+  stats_.bytesIn += length;
+  stats_.readSizes[bucket]++;
+  pthread_mutex_unlock(&statsLock_);
+
+  if (tag == kREAD_LENGTH) {
+    [self __didReadLength:data];
+    return;
+  }
+  if (tag == kREAD_FRAME) {
+    [self __didReadFrame];
+    return;
+  }
+  if (tag == kREAD_PART) {
+    [self __streamPart:data];
+    if (streamRemaining_ > 0)
+      [self __readPart];
+    else
+      [self __readNext];
+    return;
+  }
+
+  if (streamRemaining_ > 0) { // the rest of a large frame goes straight out.
+    NSUInteger part = MIN(streamRemaining_, length);
+    [self __streamPart:[NuBSONDataSlice sliceOfData:data bytes:[data bytes]
+      length:part]];
+    if (part == length) {
+      [self __readNext];
+      return;
+    }
+    data = [NuBSONDataSlice sliceOfData:data
+      bytes:(const char *)[data bytes] + part length:length - part];
+  }
+
+  [frames_ appendData:data];
+
+  // Collect every complete frame before calling out to the delegate, in case
+  // that happens to trigger another read (this can happen if the delegates
+  // explicitly let the runLoop run without returning).
+  NSMutableArray *frames = nil;
+  NSData *frame;
+  BNConnectionErrorCode error;
+  for (;;) {
+    while ((frame = [frames_ nextFrame:&error])) {
+      if (!frames)
+        frames = [NSMutableArray array];
+      [frames addObject:frame];
+    }
+
+    if (error != BNConnectionErrorFrameTooLarge
+        || !delegateHas_.receivedPartOfLargeFrame)
+      break;
+
+    // Frames before the large one go first; then it streams as it comes.
+    if (![self __deliverFrames:frames])
+      return;
+    frames = nil;
+    streamLength_ = streamRemaining_ = [frames_ nextFrameLength];
+    [self __streamPart:[frames_ takeBytes:streamRemaining_]];
+    if (streamRemaining_ > 0) {
+      error = 0;
+      break; // nothing else pending.
+    }
+  }
+
+  if (error) {
+    [self __rejectFrame:error];
+    return;
+  }
+
+  if (![self __deliverFrames:frames])
+    return;
+
+  // [socket_ readDataToData:[AsyncSocket ZeroData] withTimeout:timeout tag:0];
+  [self __readNext];
+}
+
+- (void) __readNext {
+  if (readsWholeFrames)
+    [socket_ readDataToLength:4 withTimeout:timeout tag:kREAD_LENGTH];
+  else
+    [socket_ readDataWithTimeout:timeout tag:kREAD_STREAM];
+}
+
+- (void) __didReadLength:(NSData *)data {
+  int length;
+  bson_little_endian32(&length, [data bytes]);
+  if (length < 5) { // length + eoo, at least. (negative, too.)
+    [self __rejectFrame:BNConnectionErrorInvalidFrame];
+    return;
+  }
+
+  if (maxFrameSize > 0 && (NSUInteger)length > maxFrameSize) {
+    if (!delegateHas_.receivedPartOfLargeFrame) {
+      [self __rejectFrame:BNConnectionErrorFrameTooLarge];
+      return;
+    }
 
-  while (__dataContainsWholeDocument(buffer_)) {
-    // NSLog(@"Received: %@", data);
-    NSRange docRange = NSMakeRange(0, __lengthOfFirstBSONDocument(buffer_));
+    streamLength_ = streamRemaining_ = length;
+    [self __streamPart:data];
+    [self __readPart];
+    return;
+  }
 
-    // these should happen back to back in case calling out to a delegate
-    // happens to trigger another read (this can happen if the delegates
-    // explicitly let the runLoop run without returning):
-    NSData *doc = [NSData dataWithBytes:[buffer_ bytes] length:docRange.length];
-    [doc retain];
+  // The frame lands in place behind its length: AsyncSocket reads into
+  // the buffer it is given, and never has to grow one that is big enough.
+  [frame_ release];
+  frame_ = [[NSMutableData alloc] initWithLength:length];
+  memcpy([frame_ mutableBytes], [data bytes], 4);
+  [socket_ readDataToLength:length - 4 withTimeout:timeout buffer:frame_
+    bufferOffset:4 tag:kREAD_FRAME];
+}
 
-    [buffer_ replaceBytesInRange:docRange withBytes:NULL length:0];
+- (void) __didReadFrame {
+  NSMutableData *buffer = frame_;
+  frame_ = nil;
 
-    if ([delegate respondsToSelector:@selector(connection:receivedBSONData:)])
+  if (!bson_validate([buffer bytes], [buffer length])) {
+    [buffer release];
+    [self __rejectFrame:BNConnectionErrorInvalidFrame];
+    return;
+  }
+
+  // Nothing writes to buffer anymore; hand it out as immutable data.
+  NSData *frame = [NuBSONDataSlice sliceOfData:buffer bytes:[buffer bytes]
+    length:[buffer length]];
+  [buffer release];
+
+  if ([self __deliverFrames:[NSArray arrayWithObject:frame]])
+    [self __readNext];
+}
+
+// NO when the peer is gone (a bad frame, or a delegate disconnecting): the
+// reassembler may have been reset, and there is nothing more to read.
+- (BOOL) __deliverFrames:(NSArray *)frames {
+  BNConnectionErrorCode error;
+  frames = [self __unwrapFrames:frames error:&error];
+  if (error) {
+    [self __rejectFrame:error];
+    return NO;
+  }
+
+  NSUInteger count = [frames count];
+  if (count == 0)
+    return state == BNConnectionConnected;
+
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  NSTimeInterval decoding = 0;
+
+  if (delegateHas_.receivedBatch)
+    [delegate connection:self receivedBatch:frames];
+
+  NSUInteger largest = 0;
+  for (NSData *doc in frames) {
+    largest = MAX(largest, [doc length]);
+    // NSLog(@"Received: %@", doc);
+    if (delegateHas_.receivedBSONData)
       [delegate connection:self receivedBSONData:doc];
-    if ([delegate respondsToSelector:@selector(connection:receivedDictionary:)])
-      [delegate connection:self receivedDictionary:[doc BSONValue]];
+    if (delegateHas_.receivedDictionary) {
+      CFAbsoluteTime decodeStart = CFAbsoluteTimeGetCurrent();
+      NSDictionary *dict = [codec decodeData:doc];
+      decoding += CFAbsoluteTimeGetCurrent() - decodeStart;
+      [delegate connection:self receivedDictionary:dict];
+    }
+    if (delegateHas_.receivedDocument)
+      [delegate connection:self
+        receivedDocument:[BNDocument documentWithData:doc]];
+  }
+
+  NSTimeInterval total = CFAbsoluteTimeGetCurrent() - start;
+  pthread_mutex_lock(&statsLock_);
+  stats_.framesIn += count;
+  stats_.largestFrameIn = MAX(stats_.largestFrameIn, largest);
+  stats_.decodeTime += decoding;
+  stats_.dispatchTime += total - decoding;
+  pthread_mutex_unlock(&statsLock_);
+  return state == BNConnectionConnected;
+}
 
-    [doc release];
-    tag = 1;
+- (void) __readPart {
+  [socket_ readDataToLength:MIN(streamRemaining_, kCHUNK_SIZE)
+    withTimeout:timeout tag:kREAD_PART];
+}
+
+- (void) __streamPart:(NSData *)part {
+  NSUInteger offset = streamLength_ - streamRemaining_;
+  streamRemaining_ -= [part length];
+
+  if (streamRemaining_ == 0) {
+    pthread_mutex_lock(&statsLock_);
+    stats_.framesIn++;
+    stats_.largestFrameIn = MAX(stats_.largestFrameIn, streamLength_);
+    pthread_mutex_unlock(&statsLock_);
   }
 
-  // [socket_ readDataToData:[AsyncSocket ZeroData] withTimeout:timeout tag:0];
-  [socket_ readDataWithTimeout:timeout tag:tag];
+  [delegate connection:self receivedPartOfLargeFrame:part offset:offset
+    ofLength:streamLength_];
+}
+
+- (void) __rejectFrame:(BNConnectionErrorCode)errorCode {
+  // Framing can't be trusted past a bad frame, so drop the peer.
+  [frames_ reset];
+  [frame_ release];
+  frame_ = nil;
+  streamLength_ = streamRemaining_ = 0;
+  NSError *e = [BNConnection error:errorCode info:[self address]];
+  [delegate connection:self error:e];
+  [socket_ disconnect];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Compression
+
+- (NSData *) __compressed:(NSData *)data {
+  if (compressionThreshold == 0 || !peerInflates_
+      || [data length] < compressionThreshold)
+    return data;
+
+  NSData *deflated = deflate_frame(data);
+  return deflated ? deflated : data;
+}
+
+- (NSData *) __inflated:(NSData *)frame error:(BNConnectionErrorCode *)error {
+  bson b;
+  bson_iterator it;
+  bson_init(&b, (char *)[frame bytes], 0);
+  *error = BNConnectionErrorInvalidFrame;
+
+  if (bson_find(&it, &b, kLENGTH_KEY) != bson_int)
+    return nil;
+  int length = bson_iterator_int(&it);
+  if (length < 5)
+    return nil;
+  NSUInteger max = maxFrameSize > 0 ? maxFrameSize : kMAX_INFLATED_SIZE;
+  if ((NSUInteger)length > max) {
+    *error = BNConnectionErrorFrameTooLarge;
+    return nil;
+  }
+  if (bson_find(&it, &b, kDEFLATE_KEY) != bson_bindata)
+    return nil;
+
+  // uncompress stops at length, so a lying peer can't make it allocate more;
+  // and what comes out is as untrusted as any frame.
+  Bytef *bytes = malloc(length);
+  uLongf inflated = length;
+  if (uncompress(bytes, &inflated, (const Bytef *)bson_iterator_bin_data(&it),
+      bson_iterator_bin_len(&it)) != Z_OK || inflated != (uLongf)length
+      || !bson_validate((const char *)bytes, length)) {
+    free(bytes);
+    return nil;
+  }
+
+  *error = 0;
+  return [NSData dataWithBytesNoCopy:bytes length:length freeWhenDone:YES];
+}
+
+// Inflates compressed frames and takes out handshakes. Usually a no-op.
+// Only an end that compresses takes the peer's handshake, and only once;
+// the peer compresses only once it has this end's, so only then is a
+// $deflate frame anything but the peer's own document.
+- (NSArray *) __unwrapFrames:(NSArray *)frames
+  error:(BNConnectionErrorCode *)error {
+  *error = 0;
+  NSMutableArray *unwrapped = nil;
+  NSUInteger index = 0;
+  for (NSData *frame in frames) {
+    NSData *plain = frame;
+    if (helloSent_ && helloReceived_
+        && frame_starts_with(frame, bson_bindata, kDEFLATE_KEY)) {
+      plain = [self __inflated:frame error:error];
+      if (!plain)
+        return nil;
+    } else if (!helloReceived_ && (helloSent_ || compressionThreshold != 0)
+        && frame_starts_with(frame, bson_object, kHELLO_KEY)) {
+      [self __receivedHello:frame];
+      plain = nil;
+    }
+
+    if (plain != frame && !unwrapped) {
+      unwrapped = [NSMutableArray arrayWithCapacity:[frames count]];
+      [unwrapped addObjectsFromArray:
+        [frames subarrayWithRange:NSMakeRange(0, index)]];
+    }
+    if (unwrapped && plain)
+      [unwrapped addObject:plain];
+    index++;
+  }
+  return unwrapped ? unwrapped : frames;
+}
+
+// Says this end inflates. Sent once per connection, by an end that
+// compresses: on connecting, or else in answer to the peer's.
+- (void) __sendHello {
+  helloSent_ = YES;
+  bson_buffer bb;
+  bson_buffer_init(&bb);
+  bson_append_start_object(&bb, kHELLO_KEY);
+  bson_append_bool(&bb, "deflate", 1);
+  bson_append_finish_object(&bb);
+  NSData *hello = data_for_bson_buffer(&bb);
+
+  if ([self __admitBytes:[hello length]])
+    [self __writeToSocket:hello tag:0];
+}
+
+- (void) __receivedHello:(NSData *)frame {
+  bson b;
+  bson_iterator it, sub;
+  bson_init(&b, (char *)[frame bytes], 0);
+  if (bson_find(&it, &b, kHELLO_KEY) != bson_object)
+    return;
+
+  helloReceived_ = YES;
+  bson_iterator_subiterator(&it, &sub);
+  while (bson_iterator_next(&sub)) {
+    if (strcmp(bson_iterator_key(&sub), "deflate") == 0)
+      peerInflates_ = bson_iterator_bool(&sub);
+  }
+
+  if (!helloSent_) // so a peer that compresses learns that we inflate.
+    [self __sendHello];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Stats
+
+- (BNConnectionStats) stats {
+  pthread_mutex_lock(&statsLock_);
+  BNConnectionStats stats = stats_;
+  pthread_mutex_unlock(&statsLock_);
+  stats.queuedBytes = queuedBytes_;
+  return stats;
+}
+
+- (NSString *) statsString {
+  BNConnectionStats stats = [self stats];
+  NSMutableString *str = [NSMutableString string];
+  [str appendFormat:@"CSTATS %@: ", address];
+  [str appendFormat:@" In(%llu, %llu): ", stats.framesIn, stats.bytesIn];
+  [str appendFormat:@"max:%lu ", (unsigned long)stats.largestFrameIn];
+  [str appendFormat:@"dec:%.3fs ", stats.decodeTime];
+  [str appendFormat:@"dsp:%.3fs ", stats.dispatchTime];
+  [str appendFormat:@" Out(%llu, %llu): ", stats.framesOut, stats.bytesOut];
+  [str appendFormat:@"max:%lu ", (unsigned long)stats.largestFrameOut];
+  [str appendFormat:@"que:%lu ", (unsigned long)stats.queuedBytes];
+  [str appendString:@" Reads:"];
+  for (int i = 0; i < BNConnectionReadSizeBuckets; i++)
+    [str appendFormat:@" %llu", stats.readSizes[i]];
+  return str;
 }
 
 //------------------------------------------------------------------------------
@@ -321,6 +1226,31 @@ static inline BOOL __dataContainsWholeDocument(NSData *data) {
   *port = [[operands objectAtIndex:1] intValue];
 }
 
++ (NSError *) error:(BNConnectionErrorCode)errorCode info:(NSString *)info {
+  if (info == nil)
+    info = @"Unknown";
+
+  NSMutableString *infoFull = [NSMutableString string];
+  switch (errorCode) {
+    case BNConnectionErrorInvalidFrame:
+      [infoFull appendFormat:@"Received a malformed BSON frame from %@", info];
+      break;
+
+    case BNConnectionErrorFrameTooLarge:
+      [infoFull appendFormat:@"Received a frame over maxFrameSize from %@",
+        info];
+      break;
+
+    default: [infoFull appendFormat:@"%@", info]; break;
+  }
+
+  NSDictionary *dict = [NSDictionary dictionaryWithObject:infoFull
+    forKey:NSLocalizedDescriptionKey];
+
+  return [NSError errorWithDomain:BNConnectionErrorDomain code:errorCode
+    userInfo:dict];
+}
+
 - (NSString *) stateString {
   return [BNConnection stringForState:state];
 }
@@ -0,0 +1,36 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import <Foundation/Foundation.h>
+
+// A read-only view over the bytes of one BSON document (e.g. a received
+// frame). Nothing is decoded up front: each lookup walks the document with
+// bson_find and only converts the field that was asked for. The data is
+// retained, not copied, so it must not be mutated while the view is alive
+// (nor after: large binary values decode as slices that retain it).
+@interface BNDocument : NSObject {
+  NSData *data;
+}
+
+@property (readonly) NSData *data;
+
+- (id) initWithData:(NSData *)data;
++ (BNDocument *) documentWithData:(NSData *)data;
+
+- (BOOL) containsKey:(NSString *)key;
+- (id) objectForKey:(NSString *)key;        // nil if missing or unsupported.
+- (NSString *) stringForKey:(NSString *)key; // nil if missing or not a string.
+
+// Read straight from the bytes, no NSNumber in between. Ints, longs, doubles
+// and bools convert to each other; anything else (or missing) reads as 0/NO.
+- (int64_t) int64ForKey:(NSString *)key;
+- (double) doubleForKey:(NSString *)key;
+- (BOOL) boolForKey:(NSString *)key;
+
+- (NSMutableDictionary *) dictionaryValue;  // decodes the whole document.
+
+@end
@@ -0,0 +1,127 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import "BNDocument.h"
+#import "NuBSON.h"
+
+static const NSUInteger kMIN_DOCUMENT_LENGTH = 5; // int32 length + eoo byte.
+
+@interface BNDocument (Private)
+- (bson_type) __findKey:(NSString *)key iterator:(bson_iterator *)it;
+@end
+
+@implementation BNDocument
+
+@synthesize data;
+
+//------------------------------------------------------------------------------
+#pragma mark Init/Dealloc
+
+- (id) init {
+  [NSException raise:@"BNDocumentInitError"
+    format:@"Document initialized without data."];
+  return nil;
+}
+
+- (id) initWithData:(NSData *)_data {
+  if ((self = [super init])) {
+    NSAssert(_data != nil, @"Given data must not be nil.");
+    data = [_data retain];
+  }
+  return self;
+}
+
++ (BNDocument *) documentWithData:(NSData *)_data {
+  return [[[BNDocument alloc] initWithData:_data] autorelease];
+}
+
+- (void) dealloc {
+  [data release];
+  [super dealloc];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Lookup
+
+- (bson_type) __findKey:(NSString *)key iterator:(bson_iterator *)it {
+  if ([data length] < kMIN_DOCUMENT_LENGTH)
+    return bson_eoo;
+
+  bson b;
+  bson_init(&b, (char *)[data bytes], 0);
+  return bson_find(it, &b, [key UTF8String]);
+}
+
+- (BOOL) containsKey:(NSString *)key {
+  bson_iterator it;
+  return [self __findKey:key iterator:&it] != bson_eoo;
+}
+
+- (id) objectForKey:(NSString *)key {
+  bson_iterator it;
+  if ([self __findKey:key iterator:&it] == bson_eoo)
+    return nil;
+  return object_for_bson_iterator_in_data(&it, data);
+}
+
+- (NSString *) stringForKey:(NSString *)key {
+  bson_iterator it;
+  if ([self __findKey:key iterator:&it] != bson_string)
+    return nil;
+
+  // string_len counts the trailing NUL.
+  return [[[NSString alloc] initWithBytes:bson_iterator_string(&it)
+    length:bson_iterator_string_len(&it) - 1
+    encoding:NSUTF8StringEncoding] autorelease];
+}
+
+static inline BOOL __isNumeric(bson_type type) {
+  return type == bson_int || type == bson_long || type == bson_double
+    || type == bson_bool;
+}
+
+- (int64_t) int64ForKey:(NSString *)key {
+  bson_iterator it;
+  bson_type type = [self __findKey:key iterator:&it];
+  if (type == bson_bool)
+    return bson_iterator_bool_raw(&it);
+  return __isNumeric(type) ? bson_iterator_long(&it) : 0;
+}
+
+- (double) doubleForKey:(NSString *)key {
+  bson_iterator it;
+  bson_type type = [self __findKey:key iterator:&it];
+  if (type == bson_bool)
+    return bson_iterator_bool_raw(&it);
+  return __isNumeric(type) ? bson_iterator_double(&it) : 0;
+}
+
+- (BOOL) boolForKey:(NSString *)key {
+  bson_iterator it;
+  bson_type type = [self __findKey:key iterator:&it];
+  return __isNumeric(type) ? bson_iterator_bool(&it) : NO;
+}
+
+- (NSMutableDictionary *) dictionaryValue {
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  if ([data length] < kMIN_DOCUMENT_LENGTH)
+    return dict;
+
+  bson_iterator it;
+  bson_iterator_init(&it, [data bytes]);
+  add_bson_to_object_in_data(it, dict, data);
+  return dict;
+}
+
+//------------------------------------------------------------------------------
+
+- (NSString *) description {
+  return [NSString stringWithFormat:@"<BNDocument %lu bytes>",
+    (unsigned long)[data length]];
+}
+
+@end
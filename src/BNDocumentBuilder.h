@@ -0,0 +1,70 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import <Foundation/Foundation.h>
+
+// A thread-safe free list of malloc'd chunks for building documents in.
+// Chunks that grew past 4x chunkSize, or that would overflow the pool, are
+// freed instead of kept.
+@interface BNBufferPool : NSObject {
+  int chunkSize;
+  NSUInteger maxChunks;
+
+  char **chunks_;
+  int *capacities_;
+  NSUInteger count_;
+}
+
+@property (readonly) int chunkSize;
+@property (readonly) NSUInteger maxChunks;
+
+- (id) initWithChunkSize:(int)size maxChunks:(NSUInteger)max;
+
+- (char *) takeChunk:(int *)capacity; // malloc's a new one when empty.
+- (void) returnChunk:(char *)chunk capacity:(int)capacity;
+
+@end
+
+
+// Writes a BSON document field by field straight into a pooled chunk, with no
+// NSDictionary in between. -finish hands back the chunk wrapped (not copied)
+// in an NSData, which returns it to the pool once the socket has written it.
+//
+//   BNDocumentBuilder *b = [conn documentBuilder];
+//   [b appendString:@"temp" forKey:@"sensor"];
+//   [b appendDouble:21.5 forKey:@"value"];
+//   [conn sendDocumentBuilder:b];
+//
+// A builder is not thread-safe, and is spent once finished.
+@interface BNDocumentBuilder : NSObject {
+  void *bson_; // bson_buffer, kept out of this header.
+  BNBufferPool *pool_;
+  int depth_;
+}
+
+- (id) initWithPool:(BNBufferPool *)pool; // nil pool: plain malloc.
++ (BNDocumentBuilder *) builderWithPool:(BNBufferPool *)pool;
+
+// nil strings, dates, data and objects are appended as BSON null.
+- (void) appendString:(NSString *)value forKey:(NSString *)key;
+- (void) appendInt:(int)value forKey:(NSString *)key;
+- (void) appendLongLong:(long long)value forKey:(NSString *)key;
+- (void) appendDouble:(double)value forKey:(NSString *)key;
+- (void) appendBool:(BOOL)value forKey:(NSString *)key;
+- (void) appendDate:(NSDate *)value forKey:(NSString *)key;
+- (void) appendData:(NSData *)value forKey:(NSString *)key;
+- (void) appendNullForKey:(NSString *)key;
+- (void) appendObject:(id)value forKey:(NSString *)key; // as sendDictionary:
+
+// Nest up to 32 levels. Array keys are "0", "1", ... as in BSON.
+- (void) beginDocumentForKey:(NSString *)key;
+- (void) beginArrayForKey:(NSString *)key;
+- (void) endDocument; // closes the innermost document or array.
+
+- (NSData *) finish;
+
+@end
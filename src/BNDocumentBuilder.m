@@ -0,0 +1,274 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import "BNDocumentBuilder.h"
+#import "NuBSON.h"
+
+static const int kMAX_DEPTH = 32; // bson_buffer's nesting stack.
+static const int kMAX_GROWTH = 4; // chunks grown past this many x are freed.
+
+// Read-only NSData over a finished chunk. Gives the chunk back on dealloc.
+@interface BNPooledData : NSData {
+  char *chunk_;
+  NSUInteger length_;
+  int capacity_;
+  BNBufferPool *pool_;
+}
+- (id) initWithChunk:(char *)chunk length:(NSUInteger)length
+  capacity:(int)capacity pool:(BNBufferPool *)pool;
+@end
+
+@implementation BNPooledData
+
+- (id) initWithChunk:(char *)chunk length:(NSUInteger)length
+  capacity:(int)capacity pool:(BNBufferPool *)pool {
+  if ((self = [super init])) {
+    chunk_ = chunk;
+    length_ = length;
+    capacity_ = capacity;
+    pool_ = [pool retain];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  if (pool_)
+    [pool_ returnChunk:chunk_ capacity:capacity_];
+  else
+    free(chunk_);
+  [pool_ release];
+  [super dealloc];
+}
+
+- (NSUInteger) length {
+  return length_;
+}
+
+- (const void *) bytes {
+  return chunk_;
+}
+
+@end
+
+//------------------------------------------------------------------------------
+
+@implementation BNBufferPool
+
+@synthesize chunkSize, maxChunks;
+
+- (id) init {
+  return [self initWithChunkSize:4096 maxChunks:16];
+}
+
+- (id) initWithChunkSize:(int)size maxChunks:(NSUInteger)max {
+  if ((self = [super init])) {
+    chunkSize = MAX(size, 5); // length + eoo
+    maxChunks = max;
+    chunks_ = malloc(sizeof(char *) * MAX(max, 1));
+    capacities_ = malloc(sizeof(int) * MAX(max, 1));
+    count_ = 0;
+  }
+  return self;
+}
+
+- (void) dealloc {
+  for (NSUInteger i = 0; i < count_; i++)
+    free(chunks_[i]);
+  free(chunks_);
+  free(capacities_);
+  [super dealloc];
+}
+
+- (char *) takeChunk:(int *)capacity {
+  @synchronized(self) {
+    if (count_ > 0) {
+      count_--;
+      *capacity = capacities_[count_];
+      return chunks_[count_];
+    }
+  }
+
+  *capacity = chunkSize;
+  return malloc(chunkSize);
+}
+
+- (void) returnChunk:(char *)chunk capacity:(int)capacity {
+  if (capacity <= chunkSize * kMAX_GROWTH) {
+    @synchronized(self) {
+      if (count_ < maxChunks) {
+        chunks_[count_] = chunk;
+        capacities_[count_] = capacity;
+        count_++;
+        return;
+      }
+    }
+  }
+  free(chunk);
+}
+
+@end
+
+//------------------------------------------------------------------------------
+
+@interface BNDocumentBuilder (Private)
+- (bson_buffer *) __buffer;
+@end
+
+@implementation BNDocumentBuilder
+
+#pragma mark Init/Dealloc
+
+- (id) init {
+  return [self initWithPool:nil];
+}
+
+- (id) initWithPool:(BNBufferPool *)pool {
+  if ((self = [super init])) {
+    pool_ = [pool retain];
+    bson_ = malloc(sizeof(bson_buffer));
+
+    if (pool_) {
+      int capacity;
+      char *chunk = [pool_ takeChunk:&capacity];
+      bson_buffer_init_with(bson_, chunk, capacity);
+    } else {
+      bson_buffer_init(bson_);
+    }
+    depth_ = 0;
+  }
+  return self;
+}
+
++ (BNDocumentBuilder *) builderWithPool:(BNBufferPool *)pool {
+  return [[[BNDocumentBuilder alloc] initWithPool:pool] autorelease];
+}
+
+- (void) dealloc {
+  bson_buffer *bb = bson_;
+  if (bb->buf) { // never finished.
+    if (pool_)
+      [pool_ returnChunk:bb->buf capacity:bb->bufSize];
+    else
+      free(bb->buf);
+  }
+  free(bson_);
+  [pool_ release];
+  [super dealloc];
+}
+
+- (bson_buffer *) __buffer {
+  bson_buffer *bb = bson_;
+  if (!bb->buf)
+    [NSException raise:@"BNDocumentBuilderFinished"
+      format:@"Appending to a builder that was already finished."];
+  return bb;
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Appending
+
+- (void) appendString:(NSString *)value forKey:(NSString *)key {
+  if (!value) {
+    [self appendNullForKey:key];
+    return;
+  }
+  bson_append_string([self __buffer], [key UTF8String], [value UTF8String]);
+}
+
+- (void) appendInt:(int)value forKey:(NSString *)key {
+  bson_append_int([self __buffer], [key UTF8String], value);
+}
+
+- (void) appendLongLong:(long long)value forKey:(NSString *)key {
+  bson_append_long([self __buffer], [key UTF8String], value);
+}
+
+- (void) appendDouble:(double)value forKey:(NSString *)key {
+  bson_append_double([self __buffer], [key UTF8String], value);
+}
+
+- (void) appendBool:(BOOL)value forKey:(NSString *)key {
+  bson_append_bool([self __buffer], [key UTF8String], value);
+}
+
+- (void) appendDate:(NSDate *)value forKey:(NSString *)key {
+  if (!value) {
+    [self appendNullForKey:key];
+    return;
+  }
+  bson_date_t millis = (bson_date_t)([value timeIntervalSince1970] * 1000.0);
+  bson_append_date([self __buffer], [key UTF8String], millis);
+}
+
+- (void) appendData:(NSData *)value forKey:(NSString *)key {
+  if (!value) {
+    [self appendNullForKey:key];
+    return;
+  }
+  bson_append_binary([self __buffer], [key UTF8String], 0, [value bytes],
+    [value length]);
+}
+
+- (void) appendNullForKey:(NSString *)key {
+  bson_append_null([self __buffer], [key UTF8String]);
+}
+
+- (void) appendObject:(id)value forKey:(NSString *)key {
+  if (!value) {
+    [self appendNullForKey:key];
+    return;
+  }
+  add_object_to_bson_buffer([self __buffer], key, value);
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Nesting
+
+- (void) beginDocumentForKey:(NSString *)key {
+  if (depth_ >= kMAX_DEPTH)
+    [NSException raise:@"BNDocumentBuilderTooDeep"
+      format:@"Documents nest at most %d levels.", kMAX_DEPTH];
+  bson_append_start_object([self __buffer], [key UTF8String]);
+  depth_++;
+}
+
+- (void) beginArrayForKey:(NSString *)key {
+  if (depth_ >= kMAX_DEPTH)
+    [NSException raise:@"BNDocumentBuilderTooDeep"
+      format:@"Documents nest at most %d levels.", kMAX_DEPTH];
+  bson_append_start_array([self __buffer], [key UTF8String]);
+  depth_++;
+}
+
+- (void) endDocument {
+  if (depth_ == 0)
+    [NSException raise:@"BNDocumentBuilderUnbalanced"
+      format:@"endDocument without a matching begin."];
+  bson_append_finish_object([self __buffer]);
+  depth_--;
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Finishing
+
+- (NSData *) finish {
+  bson_buffer *bb = [self __buffer];
+  if (depth_ != 0)
+    [NSException raise:@"BNDocumentBuilderUnbalanced"
+      format:@"Finished with %d documents still open.", depth_];
+
+  char *chunk = bson_buffer_finish(bb);
+  int length;
+  bson_little_endian32(&length, chunk);
+
+  NSData *data = [[BNPooledData alloc] initWithChunk:chunk length:length
+    capacity:bb->bufSize pool:pool_];
+  bb->buf = NULL; // the data owns it now.
+  return [data autorelease];
+}
+
+@end
@@ -0,0 +1,106 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import <Foundation/Foundation.h>
+#import "AsyncSocket.h"
+
+// The socket class BNConnection and BNServer create: AsyncSocket, unless the
+// build defines BN_EPOLL_SOCKET. The GNUstep build (GNUmakefile) does, as it
+// has no CFNetwork for AsyncSocket. test/test_epoll.m covers BNEpollSocket
+// itself; it is not the default for any build AsyncSocket can be part of.
+#if defined(__linux__) && defined(BN_EPOLL_SOCKET)
+#define BNSocketClass BNEpollSocket
+#else
+#define BNSocketClass AsyncSocket
+#endif
+
+#ifdef __linux__
+
+// One edge-triggered epoll set per run loop. The epoll descriptor itself is
+// watched by the run loop, so sockets keep calling their delegates on the
+// thread that runs it, just as AsyncSocket does, and performSelector:onThread:
+// keeps working for the objects that sit on top of them. A thread's loop is
+// made by its first socket, or by calling currentLoop on it.
+@interface BNEpollLoop : NSObject {
+  int epfd_;
+  NSMapTable *sockets_; // fd -> BNEpollSocket, not retained.
+  NSRunLoop *runLoop_;
+  NSThread *thread_;
+  char *scratch_;
+}
++ (BNEpollLoop *) currentLoop;
+@end
+
+
+// A TCP socket over a non-blocking descriptor in a BNEpollLoop, answering the
+// part of AsyncSocket's interface BsonNetwork uses, and calling the same
+// AsyncSocketDelegate methods in the same order. Sockets are registered
+// once for both directions with EPOLLET; readable_ and writable_ remember
+// the last edge until a read or write hits EAGAIN, so there is no interest
+// list to modify as reads and writes come and go.
+//
+// Differences from AsyncSocket:
+//  - Host names resolve synchronously in connectToHost:..., and only the
+//    first address is tried (BNServer races addresses itself).
+//  - Accepted sockets can move (onSocket:wantsRunLoopForNewSocket:) only to
+//    a run loop whose thread already has a BNEpollLoop. Other sockets stay
+//    where they were made.
+//  - TCP_NODELAY is always set, and getCFSocket returns NULL.
+//  - Queued writes go out together with one sendmsg.
+@interface BNEpollSocket : NSObject {
+  id delegate;
+  BNEpollLoop *loop_;
+  int fd_;
+  uint32_t generation_;
+
+  BOOL listening_;
+  BOOL connecting_;
+  BOOL connected_;
+  BOOL readable_;
+  BOOL writable_;
+  BOOL peerClosed_;
+  BOOL reading_;
+  BOOL writing_;
+  BOOL closing_;
+  BOOL reusePort_;
+
+  NSMutableArray *reads_;
+  NSMutableArray *writes_;
+}
+
+@property (nonatomic, assign) id delegate;
+
+- (id) initWithDelegate:(id)delegate;
+
+- (BOOL) canSafelySetDelegate;
+- (BOOL) moveToRunLoop:(NSRunLoop *)runLoop;
+- (BOOL) setRunLoopModes:(NSArray *)modes;
+- (CFSocketRef) getCFSocket;
+- (void) enableReusePort;
+
+- (BOOL) acceptOnPort:(UInt16)port error:(NSError **)errPtr;
+- (BOOL) connectToHost:(NSString *)host onPort:(UInt16)port
+  withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr;
+- (void) disconnect;
+
+- (BOOL) isConnected;
+- (NSString *) connectedHost;
+- (UInt16) connectedPort;
+- (NSString *) localHost;
+- (UInt16) localPort;
+
+- (void) readDataWithTimeout:(NSTimeInterval)timeout tag:(long)tag;
+- (void) readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout
+  tag:(long)tag;
+- (void) readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout
+  buffer:(NSMutableData *)buffer bufferOffset:(NSUInteger)offset tag:(long)tag;
+- (void) writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout
+  tag:(long)tag;
+
+@end
+
+#endif // __linux__
@@ -0,0 +1,903 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import "BNEpollSocket.h"
+
+#ifdef __linux__
+
+#import <sys/epoll.h>
+#import <sys/socket.h>
+#import <sys/uio.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <arpa/inet.h>
+#import <netdb.h>
+#import <errno.h>
+#import <fcntl.h>
+#import <unistd.h>
+
+#ifdef BN_EPOLL_SOCKET
+// Builds using BNEpollSocket leave out AsyncSocket.m, which defines these.
+NSString *const AsyncSocketException = @"AsyncSocketException";
+NSString *const AsyncSocketErrorDomain = @"AsyncSocketErrorDomain";
+#endif
+
+static NSString *const kLOOP_KEY = @"BNEpollLoop";
+
+enum {
+  kMAX_EVENTS = 256,      // per epoll_wait.
+  kMAX_IOV = 64,          // queued writes per sendmsg.
+  kREAD_CHUNK = 64 << 10, // bytes per read when reading what is available.
+};
+
+static uint32_t nextGeneration = 0;
+static NSMapTable *loopsByRunLoop = NULL; // NSRunLoop -> BNEpollLoop.
+
+
+//------------------------------------------------------------------------------
+
+@interface BNEpollRead : NSObject {
+@public
+  NSMutableData *buffer;
+  NSUInteger offset;
+  NSUInteger length; // 0 reads whatever is available.
+  NSUInteger done;
+  NSTimeInterval timeout;
+  long tag;
+  BOOL started;
+}
+@end
+
+@implementation BNEpollRead
+- (void) dealloc {
+  [buffer release];
+  [super dealloc];
+}
+@end
+
+@interface BNEpollWrite : NSObject {
+@public
+  NSData *data;
+  NSUInteger done;
+  NSTimeInterval timeout;
+  long tag;
+  BOOL started;
+}
+@end
+
+@implementation BNEpollWrite
+- (void) dealloc {
+  [data release];
+  [super dealloc];
+}
+@end
+
+//------------------------------------------------------------------------------
+
+@interface BNEpollLoop (Private) <RunLoopEvents>
++ (BNEpollLoop *) __loopForRunLoop:(NSRunLoop *)runLoop;
+- (NSRunLoop *) __runLoop;
+- (NSThread *) __thread;
+- (char *) __scratch;
+- (BOOL) __addSocket:(BNEpollSocket *)socket fd:(int)fd
+  generation:(uint32_t)generation;
+- (void) __removeFd:(int)fd;
+@end
+
+@interface BNEpollSocket (Private)
+- (uint32_t) __generation;
+- (void) __handleEvents:(uint32_t)events;
+- (BOOL) __attach:(int)fd error:(NSError **)errPtr;
+- (void) __attachAccepted;
+- (void) __acceptAll;
+- (void) __finishConnecting;
+- (void) __doReads;
+- (void) __doWrites;
+- (void) __closeWithError:(NSError *)err;
+- (void) __close;
+@end
+
+static NSError *posix_error(int code) {
+  NSString *desc = [NSString stringWithUTF8String:strerror(code)];
+  NSDictionary *info = [NSDictionary dictionaryWithObject:desc
+    forKey:NSLocalizedDescriptionKey];
+  return [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:info];
+}
+
+static NSError *socket_error(AsyncSocketError code, NSString *desc) {
+  NSDictionary *info = [NSDictionary dictionaryWithObject:desc
+    forKey:NSLocalizedDescriptionKey];
+  return [NSError errorWithDomain:AsyncSocketErrorDomain code:code
+    userInfo:info];
+}
+
+// IPv4 peers of a dual-stack listener show up as ::ffff:a.b.c.d.
+static NSString *host_for_address(struct sockaddr_storage *addr) {
+  char host[INET6_ADDRSTRLEN];
+  if (addr->ss_family == AF_INET) {
+    struct sockaddr_in *in4 = (struct sockaddr_in *)addr;
+    inet_ntop(AF_INET, &in4->sin_addr, host, sizeof(host));
+  } else if (addr->ss_family == AF_INET6) {
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+    if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+      inet_ntop(AF_INET, &in6->sin6_addr.s6_addr[12], host, sizeof(host));
+    else
+      inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+  } else {
+    return nil;
+  }
+  return [NSString stringWithUTF8String:host];
+}
+
+static UInt16 port_for_address(struct sockaddr_storage *addr) {
+  if (addr->ss_family == AF_INET)
+    return ntohs(((struct sockaddr_in *)addr)->sin_port);
+  if (addr->ss_family == AF_INET6)
+    return ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+
+@implementation BNEpollLoop
+
++ (BNEpollLoop *) currentLoop {
+  NSMutableDictionary *dict = [[NSThread currentThread] threadDictionary];
+  BNEpollLoop *loop = [dict objectForKey:kLOOP_KEY];
+  if (!loop) {
+    loop = [[BNEpollLoop alloc] init];
+    [dict setObject:loop forKey:kLOOP_KEY];
+    [loop release];
+  }
+  return loop;
+}
+
+- (id) init {
+  if ((self = [super init])) {
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ < 0)
+      [NSException raise:@"BNEpollLoopError"
+        format:@"epoll_create1 failed: %s", strerror(errno)];
+
+    scratch_ = malloc(kREAD_CHUNK);
+    sockets_ = NSCreateMapTable(NSIntegerMapKeyCallBacks,
+      NSNonOwnedPointerMapValueCallBacks, 64);
+    runLoop_ = [NSRunLoop currentRunLoop];
+    thread_ = [NSThread currentThread];
+    @synchronized([BNEpollLoop class]) {
+      if (!loopsByRunLoop)
+        loopsByRunLoop = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks,
+          NSNonOwnedPointerMapValueCallBacks, 8);
+      NSMapInsert(loopsByRunLoop, runLoop_, self);
+    }
+    [runLoop_ addEvent:(void *)(intptr_t)epfd_ type:ET_RDESC watcher:self
+      forMode:NSDefaultRunLoopMode];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  @synchronized([BNEpollLoop class]) {
+    NSMapRemove(loopsByRunLoop, runLoop_);
+  }
+  [runLoop_ removeEvent:(void *)(intptr_t)epfd_ type:ET_RDESC
+    forMode:NSDefaultRunLoopMode all:YES];
+  NSFreeMapTable(sockets_);
+  free(scratch_);
+  close(epfd_);
+  [super dealloc];
+}
+
++ (BNEpollLoop *) __loopForRunLoop:(NSRunLoop *)runLoop {
+  @synchronized([BNEpollLoop class]) {
+    return loopsByRunLoop ? NSMapGet(loopsByRunLoop, runLoop) : nil;
+  }
+}
+
+- (NSRunLoop *) __runLoop {
+  return runLoop_;
+}
+
+- (NSThread *) __thread {
+  return thread_;
+}
+
+// Reads that come with no buffer land here, and are copied out at their
+// real size, so an idle connection holds no read buffer at all.
+- (char *) __scratch {
+  return scratch_;
+}
+
+- (BOOL) __addSocket:(BNEpollSocket *)socket fd:(int)fd
+  generation:(uint32_t)generation {
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.u64 = ((uint64_t)generation << 32) | (uint32_t)fd;
+  if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+    return NO;
+  NSMapInsert(sockets_, (void *)(intptr_t)fd, socket);
+  return YES;
+}
+
+- (void) __removeFd:(int)fd {
+  epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, NULL);
+  NSMapRemove(sockets_, (void *)(intptr_t)fd);
+}
+
+// The epoll descriptor is readable: drain it. An fd closed (and maybe
+// reused) by an earlier callback in the same batch no longer matches its
+// generation, so its stale events are dropped.
+- (void) receivedEvent:(void *)data type:(RunLoopEventType)type
+  extra:(void *)extra forMode:(NSString *)mode {
+  struct epoll_event events[kMAX_EVENTS];
+  int count;
+  do {
+    count = epoll_wait(epfd_, events, kMAX_EVENTS, 0);
+
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    for (int i = 0; i < count; i++) {
+      int fd = (int)(uint32_t)events[i].data.u64;
+      uint32_t generation = (uint32_t)(events[i].data.u64 >> 32);
+      BNEpollSocket *socket = NSMapGet(sockets_, (void *)(intptr_t)fd);
+      if (!socket || [socket __generation] != generation)
+        continue;
+
+      [socket retain];
+      [socket __handleEvents:events[i].events];
+      [socket release];
+    }
+    [pool drain];
+  } while (count == kMAX_EVENTS);
+}
+
+@end
+
+//------------------------------------------------------------------------------
+
+@implementation BNEpollSocket
+
+@synthesize delegate;
+
+#pragma mark Init/Dealloc
+
+- (id) init {
+  return [self initWithDelegate:nil];
+}
+
+- (id) initWithDelegate:(id)_delegate {
+  if ((self = [super init])) {
+    delegate = _delegate;
+    loop_ = [[BNEpollLoop currentLoop] retain];
+    fd_ = -1;
+    reads_ = [[NSMutableArray alloc] init];
+    writes_ = [[NSMutableArray alloc] init];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  delegate = nil;
+  [self __close];
+  [reads_ release];
+  [writes_ release];
+  [loop_ release];
+  [super dealloc];
+}
+
+- (uint32_t) __generation {
+  return generation_;
+}
+
+//------------------------------------------------------------------------------
+#pragma mark AsyncSocket compatibility
+
+- (BOOL) canSafelySetDelegate {
+  return [reads_ count] == 0 && [writes_ count] == 0;
+}
+
+// Only accepted sockets, before they are attached, can move.
+- (BOOL) moveToRunLoop:(NSRunLoop *)runLoop {
+  if (runLoop == [loop_ __runLoop])
+    return YES;
+
+  BNEpollLoop *loop = [BNEpollLoop __loopForRunLoop:runLoop];
+  if (!loop || generation_ != 0)
+    return NO;
+  [loop_ release];
+  loop_ = [loop retain];
+  return YES;
+}
+
+- (BOOL) setRunLoopModes:(NSArray *)modes {
+  return YES; // the epoll descriptor is watched in the default mode.
+}
+
+- (CFSocketRef) getCFSocket {
+  return NULL;
+}
+
+// As AsyncSocket's: the kernel spreads connections over every socket
+// accepting on the port.
+- (void) enableReusePort {
+  reusePort_ = YES;
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Accepting / Connecting
+
+- (BOOL) __attach:(int)fd error:(NSError **)errPtr {
+  if (!listening_) {
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  }
+
+  uint32_t generation;
+  do { // 0 means not attached.
+    generation = __sync_add_and_fetch(&nextGeneration, 1);
+  } while (generation == 0);
+
+  if (![loop_ __addSocket:self fd:fd generation:generation]) {
+    if (errPtr)
+      *errPtr = posix_error(errno);
+    return NO;
+  }
+  fd_ = fd;
+  generation_ = generation;
+  return YES;
+}
+
+// On the thread of the loop the socket ended up in; the connection
+// completes on the first EPOLLOUT, as an outgoing one does.
+- (void) __attachAccepted {
+  NSThread *thread = [loop_ __thread];
+  if (thread != [NSThread currentThread]) {
+    [self performSelector:@selector(__attachAccepted) onThread:thread
+      withObject:nil waitUntilDone:NO];
+    return;
+  }
+  if (fd_ < 0) // disconnected before it got here.
+    return;
+
+  NSError *err = nil;
+  if (![self __attach:fd_ error:&err]) {
+    [self __closeWithError:err];
+    return;
+  }
+  connecting_ = YES;
+
+  if ([delegate respondsToSelector:@selector(onSocketWillConnect:)]
+      && ![delegate onSocketWillConnect:(AsyncSocket *)self])
+    [self __closeWithError:socket_error(AsyncSocketCanceledError,
+      @"onSocketWillConnect: returned NO.")];
+}
+
+- (BOOL) acceptOnPort:(UInt16)port error:(NSError **)errPtr {
+  if (fd_ >= 0)
+    [NSException raise:AsyncSocketException
+      format:@"Attempting to accept while connected or accepting."];
+
+  // Dual-stack where there is IPv6, plain IPv4 where there isn't.
+  int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  memset(&addr, 0, sizeof(addr));
+  if (fd >= 0) {
+    int off = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_addr = in6addr_any;
+    in6->sin6_port = htons(port);
+    addrlen = sizeof(*in6);
+  } else {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in *in4 = (struct sockaddr_in *)&addr;
+    in4->sin_family = AF_INET;
+    in4->sin_addr.s_addr = htonl(INADDR_ANY);
+    in4->sin_port = htons(port);
+    addrlen = sizeof(*in4);
+  }
+
+  int reuse = 1;
+  if (fd < 0
+      || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0
+      || (reusePort_ && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+        sizeof(reuse)) < 0)
+      || bind(fd, (struct sockaddr *)&addr, addrlen) < 0
+      || listen(fd, SOMAXCONN) < 0) {
+    if (errPtr)
+      *errPtr = posix_error(errno);
+    if (fd >= 0)
+      close(fd);
+    return NO;
+  }
+
+  listening_ = YES;
+  if (![self __attach:fd error:errPtr]) {
+    listening_ = NO;
+    close(fd);
+    return NO;
+  }
+  return YES;
+}
+
+- (void) __acceptAll {
+  while (fd_ >= 0) {
+    int fd = accept4(fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        NSLog(@"[%@] accept failed: %s", self, strerror(errno));
+      return;
+    }
+
+    BNEpollSocket *socket = [[BNEpollSocket alloc] initWithDelegate:delegate];
+    socket->fd_ = fd; // attached once it knows its loop.
+
+    if ([delegate respondsToSelector:@selector(onSocket:didAcceptNewSocket:)])
+      [delegate onSocket:(AsyncSocket *)self
+        didAcceptNewSocket:(AsyncSocket *)socket];
+
+    SEL wants = @selector(onSocket:wantsRunLoopForNewSocket:);
+    if ([delegate respondsToSelector:wants]) {
+      NSRunLoop *runLoop = [delegate onSocket:(AsyncSocket *)self
+        wantsRunLoopForNewSocket:(AsyncSocket *)socket];
+      if (![socket moveToRunLoop:runLoop])
+        NSLog(@"[%@] no epoll loop in %@; staying here.", self, runLoop);
+    }
+
+    [socket __attachAccepted];
+    [socket release];
+  }
+}
+
+- (BOOL) connectToHost:(NSString *)host onPort:(UInt16)port
+  withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr {
+  if (fd_ >= 0)
+    [NSException raise:AsyncSocketException
+      format:@"Attempting to connect while connected or accepting."];
+
+  if ([delegate respondsToSelector:@selector(onSocketWillConnect:)]
+      && ![delegate onSocketWillConnect:(AsyncSocket *)self]) {
+    if (errPtr)
+      *errPtr = socket_error(AsyncSocketCanceledError,
+        @"onSocketWillConnect: returned NO.");
+    return NO;
+  }
+
+  struct addrinfo hints, *res = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+
+  int gai = getaddrinfo([host UTF8String], service, &hints, &res);
+  if (gai != 0) {
+    if (errPtr) {
+      NSString *desc = [NSString stringWithUTF8String:gai_strerror(gai)];
+      NSDictionary *info = [NSDictionary dictionaryWithObject:desc
+        forKey:NSLocalizedDescriptionKey];
+      *errPtr = [NSError errorWithDomain:@"kCFStreamErrorDomainNetDB"
+        code:gai userInfo:info];
+    }
+    return NO;
+  }
+
+  int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+    0);
+  if (fd < 0 || (connect(fd, res->ai_addr, res->ai_addrlen) < 0
+      && errno != EINPROGRESS)) {
+    if (errPtr)
+      *errPtr = posix_error(errno);
+    if (fd >= 0)
+      close(fd);
+    freeaddrinfo(res);
+    return NO;
+  }
+  freeaddrinfo(res);
+
+  if (![self __attach:fd error:errPtr]) {
+    close(fd);
+    return NO;
+  }
+
+  connecting_ = YES; // done on its first EPOLLOUT.
+  if (timeout >= 0.0)
+    [self performSelector:@selector(__connectTimedOut) withObject:nil
+      afterDelay:timeout];
+  return YES;
+}
+
+- (void) __connectTimedOut {
+  [self __closeWithError:socket_error(AsyncSocketConnectTimeoutError,
+    @"Attempt to connect to host timed out")];
+}
+
+- (void) __finishConnecting {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    err = errno;
+  if (err != 0) {
+    [self __closeWithError:posix_error(err)];
+    return;
+  }
+
+  [NSObject cancelPreviousPerformRequestsWithTarget:self
+    selector:@selector(__connectTimedOut) object:nil];
+  connecting_ = NO;
+  connected_ = YES;
+  if ([delegate respondsToSelector:@selector(onSocket:didConnectToHost:port:)])
+    [delegate onSocket:(AsyncSocket *)self didConnectToHost:[self connectedHost]
+      port:[self connectedPort]];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Events
+
+- (void) __handleEvents:(uint32_t)events {
+  if (listening_) {
+    if (events & EPOLLIN)
+      [self __acceptAll];
+    return;
+  }
+
+  if (connecting_) {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+      return;
+    [self __finishConnecting];
+    if (!connected_)
+      return;
+  }
+
+  // Hangups and errors surface through read(), after any data still queued.
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    readable_ = YES;
+  if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    peerClosed_ = YES;
+  if (events & EPOLLOUT)
+    writable_ = YES;
+
+  [self __doReads];
+  [self __doWrites];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Reading
+
+- (void) __queueRead:(BNEpollRead *)packet {
+  if (fd_ < 0 || closing_)
+    return;
+  [reads_ addObject:packet];
+  [self __doReads];
+}
+
+- (void) readDataWithTimeout:(NSTimeInterval)timeout tag:(long)tag {
+  BNEpollRead *packet = [[BNEpollRead alloc] init];
+  packet->timeout = timeout;
+  packet->tag = tag;
+  [self __queueRead:packet];
+  [packet release];
+}
+
+- (void) readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout
+  tag:(long)tag {
+  [self readDataToLength:length withTimeout:timeout buffer:nil bufferOffset:0
+    tag:tag];
+}
+
+- (void) readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout
+  buffer:(NSMutableData *)buffer bufferOffset:(NSUInteger)offset tag:(long)tag {
+  if (length == 0)
+    return;
+  if (offset > [buffer length])
+    return;
+
+  BNEpollRead *packet = [[BNEpollRead alloc] init];
+  packet->buffer = [buffer retain];
+  packet->offset = offset;
+  packet->length = length;
+  packet->timeout = timeout;
+  packet->tag = tag;
+  [self __queueRead:packet];
+  [packet release];
+}
+
+- (void) __readTimedOut {
+  [self __closeWithError:socket_error(AsyncSocketReadTimeoutError,
+    @"Read operation timed out")];
+}
+
+- (void) __completeRead:(BNEpollRead *)packet data:(NSData *)data {
+  [packet retain];
+  [reads_ removeObjectAtIndex:0];
+  [NSObject cancelPreviousPerformRequestsWithTarget:self
+    selector:@selector(__readTimedOut) object:nil];
+  if ([delegate respondsToSelector:@selector(onSocket:didReadData:withTag:)])
+    [delegate onSocket:(AsyncSocket *)self didReadData:data
+      withTag:packet->tag];
+  [packet release];
+}
+
+// Reads until the socket runs dry or nobody wants more. Reads queued by the
+// delegate while this runs are picked up by the same loop.
+- (void) __doReads {
+  if (reading_ || !connected_)
+    return;
+  reading_ = YES;
+  [self retain];
+
+  while (fd_ >= 0 && [reads_ count] > 0) {
+    BNEpollRead *packet = [reads_ objectAtIndex:0];
+    if (!packet->started) {
+      packet->started = YES;
+      if (packet->timeout >= 0.0)
+        [self performSelector:@selector(__readTimedOut) withObject:nil
+          afterDelay:packet->timeout];
+    }
+    if (!readable_)
+      break;
+
+    NSUInteger want = kREAD_CHUNK;
+    char *scratch = [loop_ __scratch];
+    char *into = scratch;
+    if (packet->length) {
+      want = packet->length - packet->done;
+      if (!packet->buffer)
+        packet->buffer = [[NSMutableData alloc] initWithLength:packet->length];
+      NSUInteger needed = packet->offset + packet->length;
+      if ([packet->buffer length] < needed)
+        [packet->buffer setLength:needed];
+      into = (char *)[packet->buffer mutableBytes] + packet->offset
+        + packet->done;
+    }
+
+    ssize_t got = read(fd_, into, want);
+    if (got < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        readable_ = NO;
+      else
+        [self __closeWithError:posix_error(errno)];
+      continue;
+    }
+    if (got == 0) { // orderly shutdown by the peer.
+      [self __closeWithError:nil];
+      continue;
+    }
+
+    // A short read off a stream socket drained it (see epoll(7)), unless a
+    // hangup is pending: then only read() returning 0 says so.
+    if ((NSUInteger)got < want && !peerClosed_)
+      readable_ = NO;
+
+    if (!packet->length) {
+      NSData *data = [NSMutableData dataWithBytes:scratch length:got];
+      [self __completeRead:packet data:data];
+      continue;
+    }
+
+    packet->done += got;
+    if (packet->done < packet->length) {
+      SEL partial = @selector(onSocket:didReadPartialDataOfLength:tag:);
+      if ([delegate respondsToSelector:partial])
+        [delegate onSocket:(AsyncSocket *)self
+          didReadPartialDataOfLength:got tag:packet->tag];
+      continue;
+    }
+
+    // Same contract as AsyncSocket: into a caller's buffer, the data is a
+    // view of the bytes read; otherwise, the buffer itself.
+    NSData *data = packet->buffer;
+    if (packet->offset != 0 || [packet->buffer length] != packet->length)
+      data = [NSData dataWithBytesNoCopy:(char *)[packet->buffer mutableBytes]
+        + packet->offset length:packet->length freeWhenDone:NO];
+    [self __completeRead:packet data:data];
+  }
+
+  reading_ = NO;
+  [self release];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Writing
+
+- (void) writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout
+  tag:(long)tag {
+  if ([data length] == 0 || fd_ < 0 || closing_)
+    return;
+
+  BNEpollWrite *packet = [[BNEpollWrite alloc] init];
+  packet->data = [data retain];
+  packet->timeout = timeout;
+  packet->tag = tag;
+  [writes_ addObject:packet];
+  [packet release];
+  [self __doWrites];
+}
+
+- (void) __writeTimedOut {
+  [self __closeWithError:socket_error(AsyncSocketWriteTimeoutError,
+    @"Write operation timed out")];
+}
+
+// Hands as many queued writes as fit in one sendmsg to the kernel, then
+// reports the ones that made it, in order.
+- (void) __doWrites {
+  if (writing_ || !connected_)
+    return;
+  writing_ = YES;
+  [self retain];
+
+  while (fd_ >= 0 && [writes_ count] > 0) {
+    BNEpollWrite *head = [writes_ objectAtIndex:0];
+    if (!head->started) {
+      head->started = YES;
+      if (head->timeout >= 0.0)
+        [self performSelector:@selector(__writeTimedOut) withObject:nil
+          afterDelay:head->timeout];
+    }
+    if (!writable_)
+      break;
+
+    struct iovec iov[kMAX_IOV];
+    int count = 0;
+    size_t total = 0;
+    for (BNEpollWrite *packet in writes_) {
+      if (count == kMAX_IOV)
+        break;
+      iov[count].iov_base = (char *)[packet->data bytes] + packet->done;
+      iov[count].iov_len = [packet->data length] - packet->done;
+      total += iov[count].iov_len;
+      count++;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t sent = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        writable_ = NO;
+      else
+        [self __closeWithError:posix_error(errno)];
+      continue;
+    }
+    if ((size_t)sent < total)
+      writable_ = NO; // short write: the send buffer is full.
+
+    while (sent > 0 && fd_ >= 0 && [writes_ count] > 0) {
+      BNEpollWrite *packet = [writes_ objectAtIndex:0];
+      NSUInteger left = [packet->data length] - packet->done;
+      if ((NSUInteger)sent < left) {
+        packet->done += sent;
+        SEL partial = @selector(onSocket:didWritePartialDataOfLength:tag:);
+        if ([delegate respondsToSelector:partial])
+          [delegate onSocket:(AsyncSocket *)self
+            didWritePartialDataOfLength:packet->done tag:packet->tag];
+        break;
+      }
+
+      sent -= left;
+      [packet retain];
+      [writes_ removeObjectAtIndex:0];
+      [NSObject cancelPreviousPerformRequestsWithTarget:self
+        selector:@selector(__writeTimedOut) object:nil];
+      SEL wrote = @selector(onSocket:didWriteDataWithTag:);
+      if ([delegate respondsToSelector:wrote])
+        [delegate onSocket:(AsyncSocket *)self didWriteDataWithTag:packet->tag];
+      [packet release];
+    }
+  }
+
+  writing_ = NO;
+  [self release];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Disconnecting
+
+- (void) disconnect {
+  [self retain];
+  [self __close];
+  [self release];
+}
+
+// Like AsyncSocket's closeWithError:, the delegate hears why (err may be nil
+// for an orderly shutdown) before the socket goes away.
+- (void) __closeWithError:(NSError *)err {
+  if (fd_ < 0 || closing_)
+    return;
+
+  [self retain];
+  closing_ = YES;
+  SEL will = @selector(onSocket:willDisconnectWithError:);
+  if ([delegate respondsToSelector:will])
+    [delegate onSocket:(AsyncSocket *)self willDisconnectWithError:err];
+  closing_ = NO;
+  [self __close];
+  [self release];
+}
+
+- (void) __close {
+  if (fd_ < 0)
+    return;
+
+  [NSObject cancelPreviousPerformRequestsWithTarget:self
+    selector:@selector(__connectTimedOut) object:nil];
+  [NSObject cancelPreviousPerformRequestsWithTarget:self
+    selector:@selector(__readTimedOut) object:nil];
+  [NSObject cancelPreviousPerformRequestsWithTarget:self
+    selector:@selector(__writeTimedOut) object:nil];
+
+  if (generation_ != 0)
+    [loop_ __removeFd:fd_];
+  close(fd_);
+  fd_ = -1;
+  generation_ = 0;
+  listening_ = connecting_ = connected_ = NO;
+  readable_ = writable_ = peerClosed_ = NO;
+  [reads_ removeAllObjects];
+  [writes_ removeAllObjects];
+
+  if ([delegate respondsToSelector:@selector(onSocketDidDisconnect:)])
+    [delegate onSocketDidDisconnect:(AsyncSocket *)self];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Addresses
+
+- (BOOL) isConnected {
+  return connected_;
+}
+
+- (NSString *) connectedHost {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (fd_ < 0 || getpeername(fd_, (struct sockaddr *)&addr, &len) < 0)
+    return nil;
+  return host_for_address(&addr);
+}
+
+- (UInt16) connectedPort {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (fd_ < 0 || getpeername(fd_, (struct sockaddr *)&addr, &len) < 0)
+    return 0;
+  return port_for_address(&addr);
+}
+
+- (NSString *) localHost {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (fd_ < 0 || getsockname(fd_, (struct sockaddr *)&addr, &len) < 0)
+    return nil;
+  return host_for_address(&addr);
+}
+
+- (UInt16) localPort {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (fd_ < 0 || getsockname(fd_, (struct sockaddr *)&addr, &len) < 0)
+    return 0;
+  return port_for_address(&addr);
+}
+
+- (NSString *) description {
+  return [NSString stringWithFormat:@"<BNEpollSocket %p fd %d>", self, fd_];
+}
+
+@end
+
+#endif // __linux__
@@ -6,6 +6,7 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "BNDocument.h"
 
 extern NSString * const BNMessageSource;
 extern NSString * const BNMessageDestination;
@@ -16,16 +17,27 @@ extern NSString * const BNMessageToken;
 
 @interface BNMessage : NSObject {
   NSMutableDictionary *contents;
+  BNDocument *document; // received bytes, until contents are first needed.
 }
 
 @property (nonatomic, retain) NSString *source;
 @property (nonatomic, retain) NSString *destination;
-@property (readonly) NSMutableDictionary *contents;
+@property (readonly) NSMutableDictionary *contents; // decodes on first use.
 
 - (BOOL) isAddressed;
 - (BOOL) containsKey:(NSString *)key;
 + (BNMessage *) messageWithContents:(NSDictionary *)dictionary;
 
+// Keeps the document; contents are decoded only if someone asks for them.
+- (id) initWithDocument:(BNDocument *)document;
++ (BNMessage *) messageWithDocument:(BNDocument *)document;
+
+// Unboxed scalars: read from the document bytes while the message is still
+// undecoded, from contents after. Non-numbers (or missing keys) read as 0/NO.
+- (int64_t) int64ForKey:(NSString *)key;
+- (double) doubleForKey:(NSString *)key;
+- (BOOL) boolForKey:(NSString *)key;
+
 @end
 
 @protocol BNMessageSender <NSObject>
@@ -21,52 +21,102 @@ NSString * const BNMessageToken = @"_tok";
 
 @implementation BNMessage
 
-@synthesize contents;
-
 - (id) init {
   if ((self = [super init])) {
     contents = [[NSMutableDictionary alloc] init];
+    document = nil;
+  }
+  return self;
+}
+
+- (id) initWithDocument:(BNDocument *)_document {
+  if ((self = [super init])) {
+    contents = nil;
+    document = [_document retain];
   }
   return self;
 }
 
 - (void) dealloc {
   [contents release];
+  [document release];
   [super dealloc];
 }
 
+- (NSMutableDictionary *) contents {
+  if (contents == nil) {
+    contents = [[document dictionaryValue] retain];
+    [document release];
+    document = nil; // contents are authoritative from here on.
+  }
+  return contents;
+}
+
 - (BOOL) isAddressed {
   return [self containsKey:BNMessageSource] &&
          [self containsKey:BNMessageDestination];
 }
 
 - (NSString *) source {
+  if (document)
+    return [document stringForKey:BNMessageSource];
   return [contents valueForKey:BNMessageSource];
 }
 
 - (void) setSource:(NSString *)source {
-  [contents setValue:source forKey:BNMessageSource];
+  [self.contents setValue:source forKey:BNMessageSource];
 }
 
 
 - (NSString *) destination {
+  if (document)
+    return [document stringForKey:BNMessageDestination];
   return [contents valueForKey:BNMessageDestination];
 }
 
 - (void) setDestination:(NSString *)destination {
-  [contents setValue:destination forKey:BNMessageDestination];
+  [self.contents setValue:destination forKey:BNMessageDestination];
 }
 
 - (BOOL) containsKey:(NSString *)key {
+  if (document)
+    return [document containsKey:key];
   return [contents valueForKey:key] != nil;
 }
 
+- (NSNumber *) __numberForKey:(NSString *)key {
+  id value = [contents valueForKey:key];
+  return [value isKindOfClass:[NSNumber class]] ? value : nil;
+}
+
+- (int64_t) int64ForKey:(NSString *)key {
+  if (document)
+    return [document int64ForKey:key];
+  return [[self __numberForKey:key] longLongValue];
+}
+
+- (double) doubleForKey:(NSString *)key {
+  if (document)
+    return [document doubleForKey:key];
+  return [[self __numberForKey:key] doubleValue];
+}
+
+- (BOOL) boolForKey:(NSString *)key {
+  if (document)
+    return [document boolForKey:key];
+  return [[self __numberForKey:key] boolValue];
+}
+
 + (BNMessage *) messageWithContents:(NSDictionary *)dictionary {
   BNMessage *msg = [[BNMessage alloc] init];
   [msg.contents addEntriesFromDictionary:dictionary];
   return [msg autorelease];
 }
 
++ (BNMessage *) messageWithDocument:(BNDocument *)document {
+  return [[[BNMessage alloc] initWithDocument:document] autorelease];
+}
+
 @end
 
 //------------------------------------------------------------------------------
@@ -74,19 +124,21 @@ NSString * const BNMessageToken = @"_tok";
 
 @implementation BNMessage (Reliable)
 - (NSUInteger) ackNo {
-  return [[contents valueForKey:BNMessageAckNo] intValue];
+  return (NSUInteger)[self int64ForKey:BNMessageAckNo];
 }
 
 - (void) setAckNo:(NSUInteger)ackNo {
-  [contents setValue:[NSNumber numberWithLong:ackNo] forKey:BNMessageAckNo];
+  [self.contents setValue:[NSNumber numberWithLong:ackNo]
+    forKey:BNMessageAckNo];
 }
 
 - (NSUInteger) seqNo {
-  return [[contents valueForKey:BNMessageSeqNo] intValue];
+  return (NSUInteger)[self int64ForKey:BNMessageSeqNo];
 }
 
 - (void) setSeqNo:(NSUInteger)seqNo {
-  [contents setValue:[NSNumber numberWithLong:seqNo] forKey:BNMessageSeqNo];
+  [self.contents setValue:[NSNumber numberWithLong:seqNo]
+    forKey:BNMessageSeqNo];
 }
 
 - (BOOL) isReliableMessage {
@@ -99,11 +151,12 @@ NSString * const BNMessageToken = @"_tok";
 
 @implementation BNMessage (Token)
 - (NSUInteger) token {
-  return [[contents valueForKey:BNMessageToken] intValue];
+  return (NSUInteger)[self int64ForKey:BNMessageToken];
 }
 
 - (void) setToken:(NSUInteger)token {
-  [contents setValue:[NSNumber numberWithLong:token] forKey:BNMessageToken];
+  [self.contents setValue:[NSNumber numberWithLong:token]
+    forKey:BNMessageToken];
 }
 
 @end
@@ -27,6 +27,12 @@ extern NSString * const BNNodeIdentifiedLinkNotification;
 extern NSString * const BNNodeReceivedMessageNotification;
 extern NSString * const BNNodeSentMessageNotification;
 
+// Errors passed to node:error: (besides those of the node's connections)
+extern NSString * const BNNodeErrorDomain;
+typedef enum {
+  BNNodeErrorBadHeader = 1, // _src or _dst not a string. message dropped.
+} BNNodeErrorCode;
+
 
 
 @interface BNNode : NSObject
@@ -37,6 +43,7 @@ extern NSString * const BNNodeSentMessageNotification;
   BNServer * server;
   BNLink * defaultLink;
   id<BNNodeDelegate> delegate;
+  BOOL forwardsMessages;
 }
 
 @property (nonatomic, copy) NSString * name;
@@ -45,6 +52,11 @@ extern NSString * const BNNodeSentMessageNotification;
 
 @property (assign) BNLink * defaultLink;
 
+// Relay mode. When set, messages addressed to another node are sent on to the
+// link with that name as raw BSON (or dropped if there is none), instead of
+// being decoded and delivered here.
+@property (assign) BOOL forwardsMessages;
+
 - (id) initWithName:(NSString *)name;
 - (id) initWithName:(NSString *)name andThread:(NSThread *)thread;
 
@@ -20,6 +20,8 @@ NSString * const BNNodeReceivedMessageNotification =
 NSString * const BNNodeSentMessageNotification =
   @"BNNodeSentMessageNotification";
 
+NSString * const BNNodeErrorDomain = @"BNNodeErrorDomain";
+
 
 
 
@@ -27,7 +29,7 @@ NSString * const BNNodeSentMessageNotification =
 
 @implementation BNNode
 
-@synthesize name, server, delegate, defaultLink;
+@synthesize name, server, delegate, defaultLink, forwardsMessages;
 
 //------------------------------------------------------------------------------
 #pragma mark Init/Dealloc
@@ -49,6 +51,7 @@ NSString * const BNNodeSentMessageNotification =
 
     links_ = [[NSMutableDictionary alloc] initWithCapacity:10];
     defaultLink = nil;
+    forwardsMessages = NO;
 
   }
   return self;
@@ -201,16 +204,29 @@ NSString * const BNNodeSentMessageNotification =
 }
 
 
-- (void) connection:(BNConnection *)conn
-  receivedDictionary:(NSDictionary *)dict {
-  DebugLog(@"[%@] conn %@ received %@", self, conn, dict);
+// Routing only needs the _src and _dst headers, which are read straight out of
+// the frame. The rest of the document is decoded only if it is delivered here.
+// Headers that are there but aren't strings are an error, not missing.
+- (void) connection:(BNConnection *)conn receivedDocument:(BNDocument *)doc {
+  DebugLog(@"[%@] conn %@ received %@", self, conn, doc);
 
   BNLink *link = [self linkForConnection:conn];
-  NSString *source = [dict valueForKey:BNMessageSource];
-  NSString *destination = [dict valueForKey:BNMessageDestination];
+  NSString *source = [doc stringForKey:BNMessageSource];
+  NSString *destination = [doc stringForKey:BNMessageDestination];
   NSNotificationCenter *nc = [NSNotificationCenter defaultCenter];
 
-  if (source == nil) {
+  if ((source == nil && [doc containsKey:BNMessageSource])
+      || (destination == nil && [doc containsKey:BNMessageDestination])) {
+    DebugLog(@"[%@] message headers are not strings", self);
+    NSString *info = [NSString stringWithFormat:
+      @"Received a message whose _src or _dst is not a string from %@",
+      conn.address];
+    [delegate node:self error:[NSError errorWithDomain:BNNodeErrorDomain
+      code:BNNodeErrorBadHeader userInfo:[NSDictionary
+      dictionaryWithObject:info forKey:NSLocalizedDescriptionKey]]];
+    // DROP!
+  }
+  else if (source == nil) {
     DebugLog(@"[%@] malformed message", self);
     // DROP!
   }
@@ -251,9 +267,20 @@ NSString * const BNNodeSentMessageNotification =
     DebugLog(@"[%@] unidentified link sent message", self);
     // DROP!
   }
+  else if (forwardsMessages && ![destination isEqualToString:name]) {
+    // Not for us. Pass the frame along as is, without decoding it.
+    BNLink *next = [links_ valueForKey:destination];
+    if (next && next != link && next.connection.isConnected) {
+      DebugLog(@"[%@] forwarding message to %@", self, next);
+      [next.connection sendBSONData:doc.data];
+    } else {
+      DebugLog(@"[%@] no route to %@", self, destination);
+      // DROP!
+    }
+  }
   else {
     // Got a message and have a link for it. notify!
-    BNMessage *message = [BNMessage messageWithContents:dict];
+    BNMessage *message = [BNMessage messageWithDocument:doc];
     [nc postNotification:[NSNotification
       notificationWithName:BNNodeReceivedMessageNotification object:self
       userInfo: [NSDictionary dictionaryWithObjectsAndKeys:link, @"link",
@@ -11,6 +11,7 @@
 #import "PortMapper.h"
 
 @class BNServer;
+@class BNServerWorker;
 
 @protocol BNServerDelegate <NSObject>
 - (void) server:(BNServer *)server error:(NSError *)error;
@@ -28,6 +29,13 @@
 
   NSThread *thread_; // for socket thread safety and not blocking main thread.
   NSMutableArray *connections_;
+  NSMutableArray *races_; // connectToFirstOfAddresses: still under way.
+
+  NSUInteger workerCount;
+  BOOL listensOnWorkers;
+  NSArray *workers_; // BNServerWorker, made when listening starts.
+  NSUInteger nextWorker_;
+  BNServerWorker *placing_; // between didAccept and wantsRunLoopForNewSocket.
 
   id<BNServerDelegate> delegate;
   BOOL portMappingEnabled;
@@ -41,6 +49,21 @@
 @property (nonatomic, readonly) UInt16 listenPort;
 @property (nonatomic, readonly) BOOL isListening;
 
+// Threads, each with its own run loop, that accepted connections are spread
+// over (to the least loaded; round robin among equals). Each connection then
+// lives on its worker: its reads, decoding and delegate calls, as well as
+// server:didConnect: for it, happen there. 0, the default, keeps everything
+// on the server's thread. Set before listening starts; it can't change after.
+// Connections made with connectTo... stay on the server's thread.
+@property (nonatomic) NSUInteger workerCount;
+
+// With workers, have each open its own listening socket on the port, with
+// SO_REUSEPORT, instead of one thread accepting for all of them. The kernel
+// then spreads incoming connections over the workers (on Linux; BSD-derived
+// systems hand them all to the last socket bound), and accepted ones stay on
+// the worker that took them. Set while not listening.
+@property (nonatomic) BOOL listensOnWorkers;
+
 @property (assign) id<BNServerDelegate> delegate;
 @property (readonly) NSArray *connections;  // connected ones, that is.
 
@@ -52,9 +75,16 @@
 - (BOOL) startListeningOnPort:(UInt16)_listenPorr;
 - (void) stopListening;
 
+// These return at once; the delegate hears how it went.
 - (void) connectToAddress:(NSString *)address;
 - (void) connectToAddresses:(NSArray *)addresses; // to all of them!
 
+// To the first of them to answer ("happy eyeballs"): attempts start in order,
+// each one 250ms after the last (or as soon as it fails), and the first to
+// connect wins; the rest are dropped. One didConnect: for the winner, or one
+// failedToConnect: once every address has failed.
+- (void) connectToFirstOfAddresses:(NSArray *)addresses;
+
 // To disconnect any one connection, simply call [connection disconnect].
 // BNServer listens for BNConnectionDisconnectedNotifications.
 - (void) disconnectAllConnections;
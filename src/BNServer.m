@@ -7,6 +7,7 @@
 
 #import "BsonNetwork.h"
 #import "PortMapper.h"
+#import "BNEpollSocket.h"
 
 static UInt16 kDEFAULT_PORT = 31688;
 
@@ -17,14 +18,289 @@ typedef enum {
   BNErrorUnknown,
 } BNError;
 
+static NSTimeInterval kRACE_STAGGER = 0.25; // between attempts in a race.
+
+@class BNConnectionRace;
+
 @interface BNServer (Private)
 - (void) __portMappingOpen;
+- (void) __startWorkers;
+- (BOOL) __listenOnWorkers;
+- (BNServerWorker *) __pickWorker;
+- (void) __race:(BNConnectionRace *)race wonBy:(BNConnection *)conn;
+- (void) __race:(BNConnectionRace *)race lostWith:(BNConnection *)conn;
 + (NSError *) error:(BNError)errorCode info:(NSString *)info;
 @end
 
+//------------------------------------------------------------------------------
+#pragma mark Connection Race
+
+// Connects to the first of several addresses to answer. Delegate of its
+// attempts until one wins; runs on the server's thread.
+@interface BNConnectionRace : NSObject <BNConnectionDelegate> {
+  BNServer *server_; // owns us.
+  NSArray *addresses_;
+  NSUInteger next_;
+  NSMutableArray *attempts_;
+  BNConnection *lastFailed_;
+  BOOL finished_;
+}
+- (id) initWithAddresses:(NSArray *)addresses server:(BNServer *)server;
+- (void) start;
+@end
+
+@implementation BNConnectionRace
+
+- (id) initWithAddresses:(NSArray *)addresses server:(BNServer *)server {
+  if ((self = [super init])) {
+    server_ = server;
+    addresses_ = [addresses copy];
+    attempts_ = [[NSMutableArray alloc] initWithCapacity:[addresses count]];
+    next_ = 0;
+    finished_ = NO;
+  }
+  return self;
+}
+
+- (void) dealloc {
+  for (BNConnection *conn in attempts_) { // server went away mid-race.
+    conn.delegate = nil;
+    [conn disconnect];
+  }
+  [addresses_ release];
+  [attempts_ release];
+  [lastFailed_ release];
+  [super dealloc];
+}
+
+- (void) __attemptNext {
+  [NSObject cancelPreviousPerformRequestsWithTarget:self
+    selector:@selector(__attemptNext) object:nil];
+  if (finished_ || next_ >= [addresses_ count])
+    return;
+
+  NSString *address = [addresses_ objectAtIndex:next_++];
+  BNConnection *conn = [[BNConnection alloc] initWithAddress:address];
+  conn.delegate = self;
+  [attempts_ addObject:conn];
+  [conn release];
+  [conn beginConnecting];
+
+  if (next_ < [addresses_ count])
+    [self performSelector:@selector(__attemptNext) withObject:nil
+      afterDelay:kRACE_STAGGER];
+}
+
+- (void) start {
+  [self __attemptNext];
+}
+
+- (void) __finish {
+  finished_ = YES;
+  [NSObject cancelPreviousPerformRequestsWithTarget:self
+    selector:@selector(__attemptNext) object:nil];
+
+  for (BNConnection *conn in attempts_) {
+    conn.delegate = nil;
+    [conn disconnect];
+  }
+  [attempts_ removeAllObjects];
+}
+
+- (void) connectionStateDidChange:(BNConnection *)conn {
+  switch (conn.state) {
+    case BNConnectionConnected:
+      [[self retain] autorelease]; // the server lets go of finished races.
+      [conn retain];
+      [attempts_ removeObject:conn];
+      conn.delegate = nil; // no longer us.
+      [self __finish];
+      [server_ __race:self wonBy:conn];
+      [conn release];
+      break;
+
+    case BNConnectionDisconnected:
+      [lastFailed_ release];
+      lastFailed_ = [conn retain];
+      conn.delegate = nil;
+      [attempts_ removeObject:conn];
+
+      if (next_ < [addresses_ count]) {
+        [self __attemptNext]; // don't wait out the stagger.
+      } else if ([attempts_ count] == 0) {
+        [[self retain] autorelease];
+        [self __finish];
+        [server_ __race:self lostWith:lastFailed_];
+      }
+      break;
+
+    default: break; // don't care...
+  }
+}
+
+- (void) connection:(BNConnection *)conn error:(NSError *)error {
+  DebugLog(@"[%@] conn %@ error %@", self, conn, [error localizedDescription]);
+}
+
+@end
+
+//------------------------------------------------------------------------------
+#pragma mark Worker
+
+// A thread running its own run loop, and the accepted connections living on
+// it; with listensOnWorkers, also the socket accepting them. Stays up until
+// stopped.
+@interface BNServerWorker : NSObject {
+  NSThread *thread_;
+  NSRunLoop *runLoop_;
+  NSCondition *started_;
+  NSMutableSet *connections_;
+  volatile BOOL stopped_;
+
+  AsyncSocket *listenSocket_;
+  UInt16 listenPort_;
+  id listenDelegate_;
+}
+@property (readonly) NSThread *thread;
+@property (readonly) NSRunLoop *runLoop;
+@property (readonly) AsyncSocket *listenSocket;
+- (id) initWithName:(NSString *)name;
+// Both wait for the worker's thread. Returns the port bound, or 0.
+- (UInt16) listenOnPort:(UInt16)port delegate:(id)delegate;
+- (void) stopListening;
+- (NSUInteger) load;
+- (void) addConnection:(BNConnection *)conn;
+- (void) removeConnection:(BNConnection *)conn;
+- (void) stop;
+@end
+
+@implementation BNServerWorker
+
+@synthesize thread = thread_, runLoop = runLoop_, listenSocket = listenSocket_;
+
+- (id) initWithName:(NSString *)name {
+  if ((self = [super init])) {
+    connections_ = [[NSMutableSet alloc] init];
+    started_ = [[NSCondition alloc] init];
+    stopped_ = NO;
+
+    thread_ = [[NSThread alloc] initWithTarget:self
+      selector:@selector(__main) object:nil];
+    [thread_ setName:name];
+    [thread_ start];
+
+    [started_ lock];
+    while (runLoop_ == nil)
+      [started_ wait];
+    [started_ unlock];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [listenSocket_ release];
+  [thread_ release];
+  [started_ release];
+  [connections_ release];
+  [super dealloc];
+}
+
+- (void) __main {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+  // Without a source, runMode:beforeDate: would return at once.
+  [runLoop addPort:[NSPort port] forMode:NSDefaultRunLoopMode];
+#ifdef BN_EPOLL_SOCKET
+  [BNEpollLoop currentLoop]; // so accepted sockets can move here.
+#endif
+
+  [started_ lock];
+  runLoop_ = runLoop;
+  [started_ signal];
+  [started_ unlock];
+
+  while (!stopped_) {
+    NSAutoreleasePool *inner = [[NSAutoreleasePool alloc] init];
+    [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
+    [inner drain];
+  }
+  [pool drain];
+}
+
+- (void) __stop {
+  stopped_ = YES;
+}
+
+- (void) __listen {
+  listenSocket_ = (AsyncSocket *)[[BNSocketClass alloc]
+    initWithDelegate:listenDelegate_];
+  [listenSocket_ enableReusePort];
+
+  NSError *error = nil;
+  if ([listenSocket_ acceptOnPort:listenPort_ error:&error]) {
+    listenPort_ = [listenSocket_ localPort];
+    return;
+  }
+
+  DebugLog(@"[%@] failed to listen: %@", self, error);
+  listenPort_ = 0;
+  [listenSocket_ setDelegate:nil];
+  [listenSocket_ release];
+  listenSocket_ = nil;
+}
+
+- (UInt16) listenOnPort:(UInt16)port delegate:(id)delegate {
+  listenPort_ = port;
+  listenDelegate_ = delegate;
+  [self performSelector:@selector(__listen) onThread:thread_ withObject:nil
+    waitUntilDone:YES];
+  return listenPort_;
+}
+
+- (void) __stopListening {
+  [listenSocket_ setDelegate:nil];
+  [listenSocket_ disconnect];
+  [listenSocket_ release];
+  listenSocket_ = nil;
+}
+
+- (void) stopListening {
+  [self performSelector:@selector(__stopListening) onThread:thread_
+    withObject:nil waitUntilDone:YES];
+}
+
+- (void) stop {
+  // Queued behind whatever was sent to the thread before, like disconnects.
+  [self performSelector:@selector(__stop) onThread:thread_ withObject:nil
+    waitUntilDone:NO];
+}
+
+- (NSUInteger) load {
+  @synchronized(connections_) {
+    return [connections_ count];
+  }
+}
+
+- (void) addConnection:(BNConnection *)conn {
+  @synchronized(connections_) {
+    [connections_ addObject:conn];
+  }
+}
+
+- (void) removeConnection:(BNConnection *)conn {
+  @synchronized(connections_) {
+    [connections_ removeObject:conn];
+  }
+}
+
+@end
+
+//------------------------------------------------------------------------------
+
 @implementation BNServer
 
-@synthesize delegate, listenPort, isListening, portMappingEnabled;
+@synthesize delegate, listenPort, isListening, portMappingEnabled, workerCount;
+@synthesize listensOnWorkers;
 
 //------------------------------------------------------------------------------
 #pragma mark Init/Dealloc
@@ -39,8 +315,10 @@ typedef enum {
     thread_ = _thread;
 
     connections_ = [[NSMutableArray alloc] initWithCapacity:10];
+    races_ = [[NSMutableArray alloc] init];
 
-    listenSocket_ = [[AsyncSocket alloc] initWithDelegate:self];
+    listenSocket_ = (AsyncSocket *)[[BNSocketClass alloc]
+      initWithDelegate:self];
     [listenSocket_ setRunLoopModes:
       [NSArray arrayWithObject:NSRunLoopCommonModes]];
 
@@ -77,10 +355,17 @@ typedef enum {
   [listenSocket_ setDelegate:nil];
   [listenSocket_ disconnect];
   [listenSocket_ release];
+  for (BNServerWorker *worker in workers_)
+    [worker stopListening];
 
   // kill current connections.
   [self disconnectAllConnections];
   [connections_ release];
+  [races_ release];
+
+  for (BNServerWorker *worker in workers_)
+    [worker stop];
+  [workers_ release];
 
   [super dealloc];
 }
@@ -109,10 +394,17 @@ typedef enum {
     return isListening;
   }
 
-  NSError *error = nil;
-  isListening = [listenSocket_ acceptOnPort:listenPort error:&error];
-  if (isListening)
-    listenPort = [listenSocket_ localPort]; // in case we used 0
+  if (workers_ == nil)
+    [self __startWorkers];
+
+  if (listensOnWorkers && [workers_ count] > 0) {
+    isListening = [self __listenOnWorkers];
+  } else {
+    NSError *error = nil;
+    isListening = [listenSocket_ acceptOnPort:listenPort error:&error];
+    if (isListening)
+      listenPort = [listenSocket_ localPort]; // in case we used 0
+  }
 
   DebugLog(@"[%@] listening on port %d -- %d", self, listenPort, isListening);
   //TODO notifications? delegate calls?
@@ -134,6 +426,8 @@ typedef enum {
   isListening = NO;
   [mapper_ close]; //TODO(jbenet) perhaps dont close, to avoid others using it?
   [listenSocket_ disconnect];
+  for (BNServerWorker *worker in workers_)
+    [worker stopListening];
 }
 
 - (BOOL) onSocketWillConnect:(AsyncSocket *)sock {
@@ -145,7 +439,24 @@ typedef enum {
   if (socket == nil)
     return;
 
-  BNConnection *conn = [[BNConnection alloc] initWithSocket:socket];
+  BNServerWorker *worker = nil;
+  if (listn == listenSocket_) {
+    worker = [self __pickWorker];
+  } else { // accepted on a worker, so this is its thread.
+    for (BNServerWorker *w in workers_)
+      if (w.listenSocket == listn)
+        worker = w;
+  }
+
+  BNConnection *conn;
+  if (worker) {
+    conn = [[BNConnection alloc] initWithSocket:socket thread:worker.thread];
+    [worker addConnection:conn];
+    if (listn == listenSocket_)
+      placing_ = worker; // the socket asks where to go next.
+  } else {
+    conn = [[BNConnection alloc] initWithSocket:socket];
+  }
 
   if (conn == nil) { // Odd. Conn is nil? are we thrashing around, or what?
     NSError *error = [BNServer error:BNErrorUnknown info:@"connection is nil"];
@@ -169,6 +480,89 @@ typedef enum {
   [conn release];
 }
 
+- (NSRunLoop *)onSocket:(AsyncSocket *)listn
+  wantsRunLoopForNewSocket:(AsyncSocket *)socket {
+  if (listn != listenSocket_) // a worker's own: the socket stays there.
+    return [NSRunLoop currentRunLoop];
+
+  BNServerWorker *worker = placing_;
+  placing_ = nil;
+  return worker ? worker.runLoop : [NSRunLoop currentRunLoop];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark Workers
+
+- (void) setWorkerCount:(NSUInteger)count {
+  @synchronized(self) {
+    if (workers_ != nil)
+      [NSException raise:@"BNServerWorkersError"
+        format:@"workerCount must be set before listening starts."];
+    workerCount = count;
+  }
+}
+
+- (void) setListensOnWorkers:(BOOL)listens {
+  @synchronized(self) {
+    if (isListening)
+      [NSException raise:@"BNServerWorkersError"
+        format:@"listensOnWorkers must be set while not listening."];
+    listensOnWorkers = listens;
+  }
+}
+
+- (void) __startWorkers {
+  @synchronized(self) {
+    NSMutableArray *workers = [NSMutableArray arrayWithCapacity:workerCount];
+    for (NSUInteger i = 0; i < workerCount; i++) {
+      NSString *name = [NSString stringWithFormat:@"BNServer:%d worker %lu",
+        listenPort, (unsigned long)i];
+      BNServerWorker *worker = [[BNServerWorker alloc] initWithName:name];
+      [workers addObject:worker];
+      [worker release];
+    }
+    workers_ = [workers copy];
+    nextWorker_ = 0;
+  }
+}
+
+// Every worker accepts on the port itself (SO_REUSEPORT), the first one
+// picking it if listenPort is 0.
+- (BOOL) __listenOnWorkers {
+  UInt16 port = listenPort;
+  for (BNServerWorker *worker in workers_) {
+    port = [worker listenOnPort:port delegate:self];
+    if (port == 0) {
+      for (BNServerWorker *w in workers_)
+        [w stopListening];
+      return NO;
+    }
+  }
+  listenPort = port;
+  return YES;
+}
+
+// The least loaded worker, starting the search one further each time so
+// equally loaded ones take turns. nil without workers.
+- (BNServerWorker *) __pickWorker {
+  NSUInteger count = [workers_ count];
+  if (count == 0)
+    return nil;
+
+  BNServerWorker *best = nil;
+  NSUInteger bestLoad = NSUIntegerMax;
+  for (NSUInteger i = 0; i < count; i++) {
+    BNServerWorker *worker = [workers_ objectAtIndex:(nextWorker_ + i) % count];
+    NSUInteger load = [worker load];
+    if (load < bestLoad) {
+      best = worker;
+      bestLoad = load;
+    }
+  }
+  nextWorker_ = (nextWorker_ + 1) % count;
+  return best;
+}
+
 //------------------------------------------------------------------------------
 #pragma mark Port Mapping
 
@@ -239,24 +633,17 @@ typedef enum {
   if (address == nil || ![address isKindOfClass:[NSString class]])
     return;
 
-  // Ensure we initialize connections in our designated thread.
+  // Ensure we initialize connections in our designated thread. Nothing to
+  // wait for: the delegate hears how it went.
   if ([NSThread currentThread] != thread_) {
     [self performSelector:@selector(connectToAddress:) onThread:thread_
-      withObject:address waitUntilDone:YES];
+      withObject:address waitUntilDone:NO];
     return;
   }
 
   BNConnection *conn = [[BNConnection alloc] initWithAddress:address];
   conn.delegate = self; // for now, until connection is established.
 
-  if (![conn connect]) { // could not even connect... AsyncSocket failed.
-    DebugLog(@"[%@] failed to connect %@", self, conn);
-    NSError *error = [BNServer error:BNErrorAsyncSocketFailed info:address];
-    [self.delegate server:self failedToConnect:conn withError:error];
-    [conn release];
-    return;
-  }
-
   if (conn == nil) { // Odd. Conn is nil? are we thrashing around, or what?
     DebugLog(@"[%@] failed to connect %@", self, conn);
     NSError *error = [BNServer error:BNErrorUnknown info:@"connection is nil"];
@@ -269,7 +656,10 @@ typedef enum {
     [connections_ addObject:conn];
   }
 
-  DebugLog(@"[%@] connected %@", self, conn);
+  // If AsyncSocket refuses, conn goes back to disconnected, and
+  // connectionStateDidChange: reports the failure.
+  [conn beginConnecting];
+  DebugLog(@"[%@] connecting %@", self, conn);
 
   [conn release];
 }
@@ -282,6 +672,39 @@ typedef enum {
     [self connectToAddress:address];
 }
 
+- (void) connectToFirstOfAddresses:(NSArray *)addresses {
+  if (addresses == nil || ![addresses isKindOfClass:[NSArray class]]
+      || [addresses count] == 0)
+    return;
+
+  if ([NSThread currentThread] != thread_) {
+    [self performSelector:@selector(connectToFirstOfAddresses:)
+      onThread:thread_ withObject:addresses waitUntilDone:NO];
+    return;
+  }
+
+  BNConnectionRace *race = [[BNConnectionRace alloc] initWithAddresses:addresses
+    server:self];
+  [races_ addObject:race];
+  [race release];
+  [race start];
+}
+
+- (void) __race:(BNConnectionRace *)race wonBy:(BNConnection *)conn {
+  @synchronized(connections_) {
+    [connections_ addObject:conn];
+  }
+  DebugLog(@"[%@] connected %@", self, conn);
+  [self.delegate server:self didConnect:conn];
+  [races_ removeObject:race];
+}
+
+- (void) __race:(BNConnectionRace *)race lostWith:(BNConnection *)conn {
+  NSError *err = [BNServer error:BNErrorConnectionFailed info:conn.address];
+  [self.delegate server:self failedToConnect:conn withError:err];
+  [races_ removeObject:race];
+}
+
 //------------------------------------------------------------------------------
 #pragma mark Disconnect
 
@@ -304,6 +727,8 @@ typedef enum {
   @synchronized(connections_) {
     [connections_ removeObject:[notification object]];
   }
+  for (BNServerWorker *worker in workers_)
+    [worker removeConnection:[notification object]];
 }
 
 //------------------------------------------------------------------------------
@@ -10,6 +10,9 @@
 #import "BNNode.h"
 #import "BNRemoteService.h"
 #import "BNMessage.h"
+#import "BNDocument.h"
+#import "BNDocumentBuilder.h"
+#import "BNCodec.h"
 
 #ifdef DEBUG
 #define BSONNETWORK_DEBUG
@@ -26,6 +26,10 @@ def outputBSON(data):
     return
 
   length = struct.unpack('<i', running_data[:4])[0]
+  if length < 5: # some tests send bad lengths on purpose.
+    print 'bad length', length
+    running_data = ''
+    return
   if len(running_data) < length:
     return;
 
@@ -37,6 +41,8 @@ def outputBSON(data):
 
 
 def bounceConnection(conn):
+  global running_data
+  running_data = ''
   while 1:
     data = conn.recv(1024)
     if not data: break
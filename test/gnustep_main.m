@@ -0,0 +1,19 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import <Foundation/Foundation.h>
+#import <GHUnit/GHUnit.h>
+
+// Command line runner for the GNUstep build (see GNUmakefile). The Mac test
+// app is a GHUnit GUI; here we just run everything linked in, or whatever
+// TEST names (e.g. TEST=BNConnectionTest), and exit with the failure count.
+int main(int argc, char *argv[]) {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  int failures = [GHTestRunner run];
+  [pool release];
+  return failures;
+}
@@ -0,0 +1,454 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import "AsyncSocket.h"
+
+// AsyncSocket needs CFNetwork; the GNUstep build uses BNEpollSocket instead.
+#ifndef BN_EPOLL_SOCKET
+
+#import <sys/socket.h>
+#import <sys/time.h>
+#import <netinet/in.h>
+#import <arpa/inet.h>
+#import <unistd.h>
+
+#ifndef WAIT_WHILE
+#define WAIT_WHILE(condition) \
+  for (int i = 0; (condition) && i < 10000; i++) \
+    [NSThread sleepForTimeInterval:0.5]; // main thread apparently.
+#endif
+
+static UInt16 kPORT = 1383; // AsyncSocket listening.
+
+// Private, but its adapting is what testB_ManyMixedWrites looks at.
+@interface AsyncSocket (WriteChunkSize)
+- (NSUInteger) writeChunkSize;
+@end
+
+// A thread running a run loop, for the sockets. A socket must only be used
+// from the thread of the loop it is in.
+@interface AsyncSocketTestThread : NSObject {
+  NSThread *thread;
+  NSRunLoop *runLoop;
+  NSCondition *started;
+  volatile BOOL stopped;
+  volatile NSUInteger passes; // through the run loop, so far.
+}
+@property (readonly) NSThread *thread;
+@property (readonly) NSUInteger passes;
+- (void) stop;
+@end
+
+static void CountPass(CFRunLoopObserverRef observer,
+  CFRunLoopActivity activity, void *info) {
+  AsyncSocketTestThread *thread = info;
+  thread->passes++;
+}
+
+@implementation AsyncSocketTestThread
+
+@synthesize thread, passes;
+
+- (id) init {
+  if ((self = [super init])) {
+    started = [[NSCondition alloc] init];
+    thread = [[NSThread alloc] initWithTarget:self selector:@selector(main)
+      object:nil];
+    [thread start];
+
+    [started lock];
+    while (runLoop == nil)
+      [started wait];
+    [started unlock];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [thread release];
+  [started release];
+  [super dealloc];
+}
+
+- (void) main {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSRunLoop *loop = [NSRunLoop currentRunLoop];
+  [loop addPort:[NSPort port] forMode:NSDefaultRunLoopMode];
+
+  CFRunLoopObserverContext context = { 0, self, NULL, NULL, NULL };
+  CFRunLoopObserverRef observer = CFRunLoopObserverCreate(NULL,
+    kCFRunLoopBeforeSources, true, 0, CountPass, &context);
+  CFRunLoopAddObserver([loop getCFRunLoop], observer, kCFRunLoopDefaultMode);
+
+  [started lock];
+  runLoop = loop;
+  [started signal];
+  [started unlock];
+
+  while (!stopped) {
+    NSAutoreleasePool *inner = [[NSAutoreleasePool alloc] init];
+    [loop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
+    [inner drain];
+  }
+  CFRunLoopObserverInvalidate(observer);
+  CFRelease(observer);
+  [pool drain];
+}
+
+- (void) __stop {
+  stopped = YES;
+}
+
+- (void) stop {
+  [self performSelector:@selector(__stop) onThread:thread withObject:nil
+    waitUntilDone:YES];
+}
+
+@end
+
+//------------------------------------------------------------------------------
+
+// The other end is a plain blocking socket, so the test decides exactly when
+// bytes are written and read.
+static int peer_connect(UInt16 port, int rcvbuf) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (rcvbuf) // before connect, so the window is small from the start.
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  struct timeval tv = { 5, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static BOOL peer_write(int fd, NSData *data) {
+  const char *bytes = [data bytes];
+  size_t done = 0;
+  while (done < [data length]) {
+    ssize_t sent = write(fd, bytes + done, [data length] - done);
+    if (sent <= 0)
+      return NO;
+    done += sent;
+  }
+  return YES;
+}
+
+static NSData *pattern(NSUInteger length, unsigned char seed) {
+  NSMutableData *data = [NSMutableData dataWithLength:length];
+  unsigned char *bytes = [data mutableBytes];
+  for (NSUInteger i = 0; i < length; i++)
+    bytes[i] = (unsigned char)(seed + i * 7 + (i >> 11));
+  return data;
+}
+
+// Whatever arrived before length bytes, EOF, or the 5s receive timeout.
+static NSData *peer_read(int fd, size_t length) {
+  NSMutableData *data = [NSMutableData dataWithLength:length];
+  size_t done = 0;
+  while (done < length) {
+    ssize_t got = read(fd, (char *)[data mutableBytes] + done, length - done);
+    if (got <= 0)
+      break;
+    done += got;
+  }
+  [data setLength:done];
+  return data;
+}
+
+//------------------------------------------------------------------------------
+
+@interface AsyncSocketTest : GHTestCase {
+  AsyncSocketTestThread *socketThread;
+  AsyncSocket *listener;
+  AsyncSocket *accepted;
+  BOOL acceptedConnected;
+
+  NSMutableArray *reads; // the NSData each read delivered, as delivered.
+  NSMutableArray *wroteTags;
+  NSMutableSet *wrotePasses; // run loop passes writes completed in.
+  NSUInteger partialWrites;
+  NSUInteger chunkSize; // what __getWriteChunkSize found.
+}
+@end
+
+@implementation AsyncSocketTest
+
+//------------------------------------------------------------------------------
+#pragma mark setup
+
+- (BOOL) shouldRunOnMainThread {
+  return NO;
+}
+
+- (void) setUpClass {
+  socketThread = [[AsyncSocketTestThread alloc] init];
+  reads = [[NSMutableArray alloc] init];
+  wroteTags = [[NSMutableArray alloc] init];
+  wrotePasses = [[NSMutableSet alloc] init];
+}
+
+- (void) tearDownClass {
+  [socketThread stop];
+  [socketThread release];
+  [reads release];
+  [wroteTags release];
+  [wrotePasses release];
+}
+
+- (void) setUp {
+  [self performSelector:@selector(__listen) onThread:socketThread.thread
+    withObject:nil waitUntilDone:YES];
+  GHAssertNotNil(listener, @"Should be listening on %d.", kPORT);
+}
+
+- (void) tearDown {
+  [self performSelector:@selector(__close) onThread:socketThread.thread
+    withObject:nil waitUntilDone:YES];
+
+  @synchronized(self) {
+    [listener release];
+    [accepted release];
+    listener = accepted = nil;
+    acceptedConnected = NO;
+    [reads removeAllObjects];
+    [wroteTags removeAllObjects];
+    [wrotePasses removeAllObjects];
+    partialWrites = 0;
+  }
+}
+
+//------------------------------------------------------------------------------
+#pragma mark on the sockets' thread
+
+- (void) __listen {
+  listener = [[AsyncSocket alloc] initWithDelegate:self];
+  if (![listener acceptOnPort:kPORT error:nil]) {
+    [listener release];
+    listener = nil;
+  }
+}
+
+- (void) __close {
+  for (AsyncSocket *socket in [NSArray arrayWithObjects:listener, accepted,
+      nil]) {
+    [socket setDelegate:nil];
+    [socket disconnect];
+  }
+}
+
+// Room for reads far past the pool's largest chunk.
+- (void) __growReceiveBuffer {
+  int rcvbuf = 4 << 20;
+  CFSocketNativeHandle native = CFSocketGetNative([accepted getCFSocket]);
+  setsockopt(native, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+}
+
+- (void) __readAvailable {
+  [accepted readDataWithTimeout:-1 tag:[reads count] + 1];
+}
+
+// Tags count from 1.
+- (void) __write:(NSArray *)datas {
+  long tag = 1;
+  for (NSData *data in datas)
+    [accepted writeData:data withTimeout:-1 tag:tag++];
+}
+
+- (void) __getWriteChunkSize {
+  chunkSize = [accepted writeChunkSize];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark socket delegate
+
+- (void) onSocket:(AsyncSocket *)sock didAcceptNewSocket:(AsyncSocket *)sock2 {
+  @synchronized(self) {
+    accepted = [sock2 retain];
+  }
+}
+
+- (void) onSocket:(AsyncSocket *)sock didConnectToHost:(NSString *)host
+  port:(UInt16)port {
+  @synchronized(self) {
+    if (sock == accepted)
+      acceptedConnected = YES;
+  }
+}
+
+- (void) onSocket:(AsyncSocket *)sock didReadData:(NSData *)data
+  withTag:(long)tag {
+  @synchronized(self) {
+    [reads addObject:data];
+  }
+}
+
+- (void) onSocket:(AsyncSocket *)sock
+  didWritePartialDataOfLength:(NSUInteger)length tag:(long)tag {
+  @synchronized(self) {
+    partialWrites++;
+  }
+}
+
+- (void) onSocket:(AsyncSocket *)sock didWriteDataWithTag:(long)tag {
+  @synchronized(self) {
+    [wroteTags addObject:[NSNumber numberWithLong:tag]];
+    [wrotePasses addObject:[NSNumber numberWithUnsignedInteger:
+      socketThread.passes]];
+  }
+}
+
+//------------------------------------------------------------------------------
+#pragma mark tests
+
+- (void) waitForAccepted {
+  WAIT_WHILE(!acceptedConnected);
+  GHAssertTrue(acceptedConnected, @"Should have accepted.");
+}
+
+// Reads everything available once, and returns what was read.
+- (NSData *) readAvailable {
+  NSUInteger count = [reads count];
+  [self performSelector:@selector(__readAvailable)
+    onThread:socketThread.thread withObject:nil waitUntilDone:YES];
+  WAIT_WHILE([reads count] == count);
+  GHAssertTrue([reads count] == count + 1, @"Should have read.");
+  return [reads lastObject];
+}
+
+- (void) testA_MixedReads {
+  int peer = peer_connect(kPORT, 0);
+  GHAssertTrue(peer >= 0, @"Peer should connect.");
+  [self waitForAccepted];
+  [self performSelector:@selector(__growReceiveBuffer)
+    onThread:socketThread.thread withObject:nil waitUntilDone:YES];
+
+  NSUInteger reused, allocated, oversized;
+  [AsyncSocket getReadPoolReused:&reused allocated:&allocated
+    oversized:&oversized];
+
+  // Small writes read one by one, and large ones that all arrive before the
+  // read is queued, so FIONREAD sizes them past the pool's 256K chunks.
+  NSMutableData *sent = [NSMutableData data];
+  NSUInteger largeReads = 0;
+  for (int i = 0; i < 12; i++) {
+    BOOL large = (i % 3 == 2);
+    NSData *data = pattern(large ? (300 << 10) + i * 4099 : 10 + i * 97, i);
+    GHAssertTrue(peer_write(peer, data), @"Peer should write.");
+    [sent appendData:data];
+    if (large)
+      [NSThread sleepForTimeInterval:0.5];
+
+    // However the bytes came in, read until all of them are here.
+    NSUInteger got = 0;
+    for (NSData *read in reads)
+      got += [read length];
+    while (got < [sent length]) {
+      NSData *read = [self readAvailable];
+      if ([read length] > (256 << 10))
+        largeReads++;
+      got += [read length];
+    }
+  }
+
+  // Every read held on to, so no chunk went back to the pool while in use.
+  NSMutableData *received = [NSMutableData data];
+  for (NSData *read in reads)
+    [received appendData:read];
+  GHAssertEqualObjects(received, sent, @"Read every byte, in order.");
+  GHAssertTrue(largeReads > 0, @"Some reads should be past 256K.");
+
+  // Let the small reads' chunks go back, then read small again.
+  @synchronized(self) {
+    [reads removeAllObjects];
+  }
+  NSUInteger reusedBefore;
+  [AsyncSocket getReadPoolReused:&reusedBefore allocated:NULL oversized:NULL];
+  for (int i = 0; i < 4; i++) {
+    NSData *data = pattern(100, i);
+    GHAssertTrue(peer_write(peer, data), @"Peer should write.");
+    GHAssertEqualObjects([self readAvailable], data, @"Read it back.");
+  }
+
+  NSUInteger reusedAfter, allocatedAfter, oversizedAfter;
+  [AsyncSocket getReadPoolReused:&reusedAfter allocated:&allocatedAfter
+    oversized:&oversizedAfter];
+  GHAssertTrue(oversizedAfter > oversized,
+    @"Reads past 256K get an allocation of their own.");
+  GHAssertTrue(reusedAfter >= reusedBefore + 4,
+    @"Released chunks are reused (%lu -> %lu).",
+    (unsigned long)reusedBefore, (unsigned long)reusedAfter);
+  close(peer);
+}
+
+- (void) testB_ManyMixedWrites {
+  // A small receive window, and a peer that doesn't read yet, so the socket
+  // fills up and writes go out in parts.
+  int peer = peer_connect(kPORT, 4096);
+  GHAssertTrue(peer >= 0, @"Peer should connect.");
+  [self waitForAccepted];
+  [self performSelector:@selector(__getWriteChunkSize)
+    onThread:socketThread.thread withObject:nil waitUntilDone:YES];
+  NSUInteger startChunkSize = chunkSize;
+
+  // Runs of small writes (several of which go out per callback) around
+  // writes from a few K to past WRITE_CHUNKSIZE_MAX.
+  NSUInteger sizes[] = { 1, 13, 100, 4096, 5000, 70000, 13, 1, 2 << 20, 7,
+    300000, 64, 1 << 20, 3, 9000 };
+  NSUInteger count = sizeof(sizes) / sizeof(sizes[0]);
+  NSMutableArray *datas = [NSMutableArray array];
+  NSMutableArray *tags = [NSMutableArray array];
+  NSMutableData *all = [NSMutableData data];
+  for (NSUInteger i = 0; i < 10 * count; i++) {
+    NSData *data = pattern(sizes[i % count], i);
+    [datas addObject:data];
+    [tags addObject:[NSNumber numberWithLong:i + 1]];
+    [all appendData:data];
+  }
+
+  [self performSelector:@selector(__write:) onThread:socketThread.thread
+    withObject:datas waitUntilDone:YES];
+  WAIT_WHILE(partialWrites == 0);
+  GHAssertTrue(partialWrites > 0, @"Writes should go out in parts.");
+  GHAssertTrue([wroteTags count] < [datas count], @"Not all written yet.");
+
+  // The socket took less than a chunk, so the chunk shrank to what it took.
+  [self performSelector:@selector(__getWriteChunkSize)
+    onThread:socketThread.thread withObject:nil waitUntilDone:YES];
+  GHAssertTrue(chunkSize < startChunkSize, @"Chunk shrank from %lu to %lu.",
+    (unsigned long)startChunkSize, (unsigned long)chunkSize);
+  GHAssertTrue(chunkSize >= 4096, @"But not below WRITE_CHUNKSIZE.");
+
+  NSData *got = peer_read(peer, [all length]);
+  GHAssertTrue([got length] == [all length], @"Peer got every byte.");
+  GHAssertEqualObjects(got, all, @"Peer got the bytes in order.");
+
+  WAIT_WHILE([wroteTags count] < [datas count]);
+  GHAssertEqualObjects(wroteTags, tags, @"Each write reported, in order.");
+  GHAssertTrue([wrotePasses count] < [datas count],
+    @"Several writes should complete in one run loop pass.");
+
+  [self performSelector:@selector(__getWriteChunkSize)
+    onThread:socketThread.thread withObject:nil waitUntilDone:YES];
+  GHAssertTrue(chunkSize >= 4096 && chunkSize <= (1 << 20),
+    @"Chunk stays within WRITE_CHUNKSIZE and WRITE_CHUNKSIZE_MAX (%lu).",
+    (unsigned long)chunkSize);
+  close(peer);
+}
+
+@end
+
+#endif // BN_EPOLL_SOCKET
@@ -0,0 +1,268 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import "NuBSON.h"
+#import "RandomObjects.h"
+
+
+@interface BNBSONTest : GHTestCase {}
+@end
+
+@implementation BNBSONTest
+
+//------------------------------------------------------------------------------
+#pragma mark setup
+
+- (BOOL) shouldRunOnMainThread {
+  return NO;
+}
+
+- (void) setUpClass {}
+- (void) tearDownClass {}
+- (void) setUp {}
+- (void) tearDown {}
+
+- (NSDictionary *) hamletDictionary {
+  NSString *path;
+  path = [[NSBundle mainBundle] pathForResource:@"hamlet" ofType: @"txt"];
+  NSString *hamlet = [NSString stringWithContentsOfFile:path
+    encoding:NSUTF8StringEncoding error:NULL];
+
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:hamlet forKey:@"hamlet"];
+  [dict setValue:[NSDictionary randomDictionary] forKey:@"random"];
+  return dict;
+}
+
+//------------------------------------------------------------------------------
+#pragma mark encoding
+
+- (void) testA_SizeMatchesEncoding {
+  for (int i = 0; i < 100; i++) {
+    NSDictionary *dict = [NSDictionary randomDictionary];
+    NSData *data = [dict NuBSONRepresentation];
+    GHAssertTrue(bson_size_for_dictionary(dict) == [data length],
+      @"pre-computed size must match the encoding");
+  }
+
+  NSDictionary *dict = [self hamletDictionary];
+  GHAssertTrue(bson_size_for_dictionary(dict) ==
+    [[dict NuBSONRepresentation] length], @"hamlet size");
+}
+
+- (void) testB_RoundTrip {
+  for (int i = 0; i < 100; i++) {
+    NSDictionary *dict = [NSDictionary randomDictionary];
+    NSData *data = [dict NuBSONRepresentation];
+    GHAssertTrue([[data NuBSONValue] isEqualToDictionary:dict], @"round trip");
+  }
+
+  NSDictionary *dict = [self hamletDictionary];
+  NSData *data = [dict NuBSONRepresentation];
+  GHAssertTrue([[data NuBSONValue] isEqualToDictionary:dict], @"hamlet");
+}
+
+- (void) testC_Empty {
+  NSData *data = [[NSDictionary dictionary] NuBSONRepresentation];
+  GHAssertTrue([data length] == 5, @"empty document");
+  GHAssertTrue([[data NuBSONValue] count] == 0, @"empty document");
+}
+
+- (NSArray *) keysInEnumerationOrder:(NSDictionary *)dict {
+  NSMutableArray *keys = [NSMutableArray array];
+  for (NSString *key in dict)
+    [keys addObject:key];
+  return keys;
+}
+
+// Two dictionaries with the same contents that enumerate their keys in
+// different orders: built at very different capacities, in opposite orders.
+- (NSArray *) dictionariesOrderedDifferently {
+  for (int count = 2; count < 200; count++) {
+    NSMutableDictionary *a = [NSMutableDictionary dictionaryWithCapacity:1];
+    NSMutableDictionary *b =
+      [NSMutableDictionary dictionaryWithCapacity:count * 16];
+    for (int i = 0; i < count; i++) {
+      [a setValue:[NSNumber numberWithInt:i]
+        forKey:[NSString stringWithFormat:@"key%d", i]];
+      int j = count - 1 - i;
+      [b setValue:[NSNumber numberWithInt:j]
+        forKey:[NSString stringWithFormat:@"key%d", j]];
+    }
+    if (![[self keysInEnumerationOrder:a]
+        isEqualToArray:[self keysInEnumerationOrder:b]])
+      return [NSArray arrayWithObjects:a, b, nil];
+  }
+  return nil;
+}
+
+- (void) assertCanonical:(NSDictionary *)a matches:(NSDictionary *)b
+  level:(NSString *)level {
+  GHAssertEqualObjects(a, b, @"%@: same contents", level);
+  GHAssertFalse([[a NuBSONRepresentation]
+    isEqualToData:[b NuBSONRepresentation]],
+    @"%@: enumeration order shows in the plain encoding", level);
+  NSData *data = [a NuBSONCanonicalRepresentation];
+  GHAssertTrue([data isEqualToData:[b NuBSONCanonicalRepresentation]],
+    @"%@: canonical encoding must be byte-stable", level);
+  GHAssertTrue([data length] == [[a NuBSONRepresentation] length],
+    @"%@: key order must not change the size", level);
+  GHAssertTrue([[data NuBSONValue] isEqualToDictionary:a], @"%@: round trip",
+    level);
+}
+
+- (void) testD_Canonical {
+  NSArray *pair = [self dictionariesOrderedDifferently];
+  GHAssertNotNil(pair, @"Should find dictionaries enumerating differently.");
+  NSDictionary *a = [pair objectAtIndex:0];
+  NSDictionary *b = [pair objectAtIndex:1];
+
+  [self assertCanonical:a matches:b level:@"top level"];
+
+  // Only the nested dictionaries differ; the top level has one key.
+  [self assertCanonical:[NSDictionary dictionaryWithObject:a forKey:@"in"]
+    matches:[NSDictionary dictionaryWithObject:b forKey:@"in"]
+    level:@"nested"];
+  [self assertCanonical:[NSDictionary dictionaryWithObject:
+      [NSArray arrayWithObjects:@"x", a, nil] forKey:@"list"]
+    matches:[NSDictionary dictionaryWithObject:
+      [NSArray arrayWithObjects:@"x", b, nil] forKey:@"list"]
+    level:@"in an array"];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark benchmarks
+
+- (NSTimeInterval) timeEncoding:(NSArray *)dicts canonical:(BOOL)canonical {
+  NSDate *start = [NSDate date];
+  for (int round = 0; round < 10; round++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    for (NSDictionary *dict in dicts) {
+      if (canonical)
+        [dict NuBSONCanonicalRepresentation];
+      else
+        [dict NuBSONRepresentation];
+    }
+    [pool drain];
+  }
+  return -[start timeIntervalSinceNow];
+}
+
+- (void) benchmark:(NSString *)name dictionaries:(NSArray *)dicts {
+  NSTimeInterval plain = [self timeEncoding:dicts canonical:NO];
+  NSTimeInterval canonical = [self timeEncoding:dicts canonical:YES];
+  NSLog(@"BSON encode %@: %.3fs enumeration order, %.3fs canonical (%.2fx)",
+    name, plain, canonical, canonical / plain);
+}
+
+- (void) testE_BenchmarkKeyOrder {
+  NSMutableArray *dicts = [NSMutableArray array];
+  for (int i = 0; i < 1000; i++)
+    [dicts addObject:[NSDictionary randomDictionary]];
+  [self benchmark:@"random" dictionaries:dicts];
+
+  // Wide documents are where per-level sorting hurts the most.
+  NSMutableDictionary *wide = [NSMutableDictionary dictionary];
+  for (int i = 0; i < 1000; i++)
+    [wide setValue:[NSNumber numberWithInt:i]
+      forKey:[NSString stringWithFormat:@"key%d", rand()]];
+  [self benchmark:@"wide" dictionaries:[NSArray arrayWithObject:wide]];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark validation
+
+- (void) testF_Validate {
+  for (int i = 0; i < 100; i++) {
+    NSData *data = [[NSDictionary randomDictionary] NuBSONRepresentation];
+    GHAssertTrue(bson_validate([data bytes], [data length]), @"valid");
+  }
+
+  NSData *data = [[self hamletDictionary] NuBSONRepresentation];
+  GHAssertTrue(bson_validate([data bytes], [data length]), @"hamlet");
+  GHAssertFalse(bson_validate([data bytes], [data length] - 1), @"short");
+  GHAssertFalse(bson_validate(NULL, 0), @"null");
+  GHAssertFalse(bson_validate([data bytes], -1), @"negative");
+  GHAssertFalse(bson_validate([data bytes], 4), @"shorter than a document");
+}
+
+- (void) testG_ValidateRejects {
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:@"w\u00f6rld" forKey:@"s"];
+  [dict setValue:[NSDictionary dictionaryWithObject:@"b" forKey:@"a"]
+    forKey:@"sub"];
+  NSData *valid = [dict NuBSONRepresentation];
+  const char *bytes = [valid bytes];
+  int length = [valid length];
+  GHAssertTrue(bson_validate(bytes, length), @"valid");
+
+  for (int i = 0; i < length; i++)
+    GHAssertFalse(bson_validate(bytes, i), @"truncated at %d", i);
+
+  // Any single corrupted byte may be rejected, but must never crash.
+  NSMutableData *data = [NSMutableData dataWithData:valid];
+  char *mutable = [data mutableBytes];
+  for (int i = 0; i < length; i++) {
+    for (int v = 0; v < 256; v++) {
+      mutable[i] = v;
+      bson_validate(mutable, length);
+    }
+    mutable[i] = bytes[i];
+  }
+
+  // {"s": "\xc0\x80"} is an overlong NUL; {"k": <type 99>} is unknown.
+  const char overlong[] = "\x0f\0\0\0\x02s\0\x03\0\0\0\xc0\x80\0\0";
+  const char unknown[] = "\x08\0\0\0\x63k\0\0";
+  GHAssertFalse(bson_validate(overlong, 15), @"bad utf-8");
+  GHAssertFalse(bson_validate(unknown, 8), @"unknown type");
+}
+
+//------------------------------------------------------------------------------
+#pragma mark decoding
+
+- (void) testH_InternedKeys {
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:@"herp" forKey:@"_src"];
+  NSData *data = [dict NuBSONRepresentation];
+
+  NSString *first = [[[data NuBSONValue] allKeys] objectAtIndex:0];
+  NSString *second = [[[data NuBSONValue] allKeys] objectAtIndex:0];
+  GHAssertTrue([first isEqualToString:@"_src"], @"key");
+  GHAssertTrue(first == second, @"short keys must be shared");
+
+  // Too long to intern, but must still decode.
+  NSString *longKey = [@"" stringByPaddingToLength:100 withString:@"k"
+    startingAtIndex:0];
+  NSDictionary *longDict = [NSDictionary dictionaryWithObject:@"v"
+    forKey:longKey];
+  data = [longDict NuBSONRepresentation];
+  GHAssertTrue([[data NuBSONValue] isEqualToDictionary:longDict], @"long key");
+}
+
+//------------------------------------------------------------------------------
+#pragma mark NuBSONBuffer
+
+- (void) testI_BufferValue {
+  NuBSONBuffer *buffer = [[NuBSONBuffer alloc] init];
+  [buffer addObject:@"v" withKey:@"k"];
+  NSData *expected = [[NSDictionary dictionaryWithObject:@"v" forKey:@"k"]
+    NuBSONRepresentation];
+
+  // Each NuBSON frees its own bytes when the pool drains.
+  for (int i = 0; i < 2; i++) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    GHAssertEqualObjects([[buffer bsonValue] data], expected, @"value %d", i);
+    [pool drain];
+  }
+
+  GHAssertThrows([buffer addObject:@"w" withKey:@"l"],
+    @"A finished buffer can't grow.");
+  GHAssertEqualObjects([[buffer bsonValue] data], expected, @"unchanged");
+  [buffer release];
+}
+
+@end
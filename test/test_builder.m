@@ -0,0 +1,132 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import "BNDocumentBuilder.h"
+#import "NuBSON.h"
+#import "RandomObjects.h"
+
+
+@interface BNDocumentBuilderTest : GHTestCase {}
+@end
+
+@implementation BNDocumentBuilderTest
+
+//------------------------------------------------------------------------------
+#pragma mark setup
+
+- (BOOL) shouldRunOnMainThread {
+  return NO;
+}
+
+- (void) setUpClass {}
+- (void) tearDownClass {}
+- (void) setUp {}
+- (void) tearDown {}
+
+//------------------------------------------------------------------------------
+#pragma mark tests
+
+- (void) testA_Fields {
+  BNDocumentBuilder *b = [BNDocumentBuilder builderWithPool:nil];
+  [b appendString:@"temp" forKey:@"sensor"];
+  [b appendInt:42 forKey:@"int"];
+  [b appendLongLong:1LL << 40 forKey:@"long"];
+  [b appendDouble:21.5 forKey:@"value"];
+  [b appendBool:YES forKey:@"ok"];
+  [b appendNullForKey:@"none"];
+  NSData *data = [b finish];
+
+  GHAssertTrue(bson_validate([data bytes], [data length]), @"valid");
+  NSDictionary *dict = [data NuBSONValue];
+  GHAssertTrue([[dict valueForKey:@"sensor"] isEqualToString:@"temp"], @"str");
+  GHAssertTrue([[dict valueForKey:@"int"] intValue] == 42, @"int");
+  GHAssertTrue([[dict valueForKey:@"long"] longLongValue] == 1LL << 40, @"long");
+  GHAssertTrue([[dict valueForKey:@"value"] doubleValue] == 21.5, @"double");
+  GHAssertTrue([[dict valueForKey:@"ok"] boolValue], @"bool");
+  GHAssertTrue([dict valueForKey:@"none"] == [NSNull null], @"null");
+}
+
+- (void) testAB_NilValues {
+  BNDocumentBuilder *b = [BNDocumentBuilder builderWithPool:nil];
+  [b appendString:nil forKey:@"string"];
+  [b appendDate:nil forKey:@"date"];
+  [b appendData:nil forKey:@"data"];
+  [b appendObject:nil forKey:@"object"];
+  NSData *data = [b finish];
+
+  GHAssertTrue(bson_validate([data bytes], [data length]), @"valid");
+  NSDictionary *dict = [data NuBSONValue];
+  GHAssertTrue([dict count] == 4, @"all four keys");
+  for (NSString *key in dict)
+    GHAssertTrue([dict valueForKey:key] == [NSNull null], @"%@ null", key);
+}
+
+- (void) testB_Nested {
+  BNDocumentBuilder *b = [BNDocumentBuilder builderWithPool:nil];
+  [b beginDocumentForKey:@"sub"];
+  [b appendInt:1 forKey:@"a"];
+  [b beginArrayForKey:@"list"];
+  [b appendInt:2 forKey:@"0"];
+  [b appendInt:3 forKey:@"1"];
+  [b endDocument];
+  [b endDocument];
+  NSDictionary *dict = [[b finish] NuBSONValue];
+
+  NSArray *list = [dict valueForKeyPath:@"sub.list"];
+  GHAssertTrue([[dict valueForKeyPath:@"sub.a"] intValue] == 1, @"sub");
+  GHAssertTrue([list count] == 2, @"array");
+  GHAssertTrue([[list objectAtIndex:1] intValue] == 3, @"array");
+
+  b = [BNDocumentBuilder builderWithPool:nil];
+  GHAssertThrows([b endDocument], @"unbalanced");
+  [b beginDocumentForKey:@"open"];
+  GHAssertThrows([b finish], @"unbalanced");
+}
+
+- (void) testC_MatchesDictionary {
+  for (int i = 0; i < 100; i++) {
+    NSDictionary *dict = [NSDictionary randomDictionary];
+    BNDocumentBuilder *b = [BNDocumentBuilder builderWithPool:nil];
+    for (NSString *key in dict)
+      [b appendObject:[dict objectForKey:key] forKey:key];
+
+    NSData *data = [b finish];
+    GHAssertTrue([data isEqualToData:[dict NuBSONRepresentation]], @"bytes");
+  }
+}
+
+- (void) testD_Pool {
+  BNBufferPool *pool = [[BNBufferPool alloc] initWithChunkSize:256
+    maxChunks:1];
+
+  NSAutoreleasePool *arp = [[NSAutoreleasePool alloc] init];
+  BNDocumentBuilder *b = [BNDocumentBuilder builderWithPool:pool];
+  [b appendString:@"x" forKey:@"y"];
+  const void *first = [[b finish] bytes];
+  [arp drain]; // written, so the chunk goes back.
+
+  int capacity;
+  char *chunk = [pool takeChunk:&capacity];
+  GHAssertTrue(chunk == first, @"chunk must be reused");
+  GHAssertTrue(capacity == 256, @"capacity");
+  [pool returnChunk:chunk capacity:capacity];
+
+  // Grown far past the chunk size: not worth keeping.
+  arp = [[NSAutoreleasePool alloc] init];
+  b = [BNDocumentBuilder builderWithPool:pool];
+  [b appendString:[@"" stringByPaddingToLength:4096 withString:@"x"
+    startingAtIndex:0] forKey:@"big"];
+  [b finish];
+  [arp drain];
+
+  chunk = [pool takeChunk:&capacity];
+  GHAssertTrue(capacity == 256, @"grown chunk must be freed, not pooled");
+  free(chunk);
+  [pool release];
+}
+
+@end
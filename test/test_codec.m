@@ -0,0 +1,171 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import "BNCodec.h"
+#import "NuBSON.h"
+#import "RandomObjects.h"
+
+
+@interface BNCodecTest : GHTestCase {
+  NSArray *codecs;
+}
+@end
+
+@implementation BNCodecTest
+
+//------------------------------------------------------------------------------
+#pragma mark setup
+
+- (BOOL) shouldRunOnMainThread {
+  return NO;
+}
+
+- (void) setUpClass {
+  codecs = [[NSArray alloc] initWithObjects:
+    [BNBSONObjCCodec codec],
+    [BNNuBSONCodec codec],
+    [[[BNNuBSONCodec alloc] initCanonical:YES] autorelease],
+    [BNFastCodec codec],
+    nil];
+}
+
+- (void) tearDownClass {
+  [codecs release];
+}
+
+- (void) setUp {}
+- (void) tearDown {}
+
+- (NSString *) nameOf:(id<BNCodec>)codec {
+  if ([codec isKindOfClass:[BNNuBSONCodec class]]
+      && [(BNNuBSONCodec *)codec canonical])
+    return @"BNNuBSONCodec (canonical)";
+  return NSStringFromClass([codec class]);
+}
+
+- (NSArray *) dictionaries {
+  NSMutableArray *dicts = [NSMutableArray array];
+  for (int i = 0; i < 100; i++)
+    [dicts addObject:[NSDictionary randomDictionary]];
+
+  NSString *path;
+  path = [[NSBundle mainBundle] pathForResource:@"hamlet" ofType: @"txt"];
+  NSString *hamlet = [NSString stringWithContentsOfFile:path
+    encoding:NSUTF8StringEncoding error:NULL];
+  [dicts addObject:[NSDictionary dictionaryWithObject:hamlet forKey:@"hamlet"]];
+  return dicts;
+}
+
+//------------------------------------------------------------------------------
+#pragma mark round trips
+
+- (void) testA_RoundTrip {
+  NSArray *dicts = [self dictionaries];
+  for (id<BNCodec> codec in codecs) {
+    for (NSDictionary *dict in dicts) {
+      NSData *data = [codec encodeDictionary:dict];
+      GHAssertTrue([[codec decodeData:data] isEqualToDictionary:dict],
+        @"%@ round trip", [self nameOf:codec]);
+    }
+  }
+}
+
+- (void) testB_Interoperable {
+  // Every codec must read what every other one writes.
+  NSArray *dicts = [self dictionaries];
+  for (id<BNCodec> encoder in codecs) {
+    for (id<BNCodec> decoder in codecs) {
+      for (NSDictionary *dict in dicts) {
+        NSData *data = [encoder encodeDictionary:dict];
+        GHAssertTrue([[decoder decodeData:data] isEqualToDictionary:dict],
+          @"%@ -> %@", [self nameOf:encoder], [self nameOf:decoder]);
+      }
+    }
+  }
+}
+
+- (void) testC_Empty {
+  for (id<BNCodec> codec in codecs) {
+    NSData *data = [codec encodeDictionary:[NSDictionary dictionary]];
+    GHAssertTrue([data length] == 5, @"%@ empty", [self nameOf:codec]);
+    GHAssertTrue([[codec decodeData:data] count] == 0, @"%@ empty",
+      [self nameOf:codec]);
+  }
+}
+
+//------------------------------------------------------------------------------
+#pragma mark benchmarks
+
+- (void) testD_Benchmark {
+  NSArray *dicts = [self dictionaries];
+  NSMutableArray *encoded = [NSMutableArray array];
+  for (NSDictionary *dict in dicts)
+    [encoded addObject:[[codecs objectAtIndex:0] encodeDictionary:dict]];
+
+  for (id<BNCodec> codec in codecs) {
+    NSDate *start = [NSDate date];
+    for (int round = 0; round < 10; round++) {
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      for (NSDictionary *dict in dicts)
+        [codec encodeDictionary:dict];
+      [pool drain];
+    }
+    NSTimeInterval encode = -[start timeIntervalSinceNow];
+
+    start = [NSDate date];
+    for (int round = 0; round < 10; round++) {
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+      for (NSData *data in encoded)
+        [codec decodeData:data];
+      [pool drain];
+    }
+    NSTimeInterval decode = -[start timeIntervalSinceNow];
+
+    NSLog(@"%@: encode %.3fs, decode %.3fs", [self nameOf:codec], encode,
+      decode);
+  }
+}
+
+- (void) testE_BenchmarkValidate {
+  // Every frame read is validated before anything decodes it, so this is
+  // the floor under every decode above. memcpy of the same bytes is the
+  // memory bandwidth it is measured against.
+  NSArray *dicts = [self dictionaries];
+  NSMutableArray *encoded = [NSMutableArray array];
+  NSUInteger bytes = 0;
+  for (NSDictionary *dict in dicts) {
+    NSData *data = [[codecs objectAtIndex:0] encodeDictionary:dict];
+    [encoded addObject:data];
+    bytes += [data length];
+  }
+
+  int rounds = 100;
+  BOOL valid = YES;
+  NSDate *start = [NSDate date];
+  for (int round = 0; round < rounds; round++) {
+    for (NSData *data in encoded)
+      valid &= bson_validate([data bytes], [data length]);
+  }
+  NSTimeInterval validate = -[start timeIntervalSinceNow];
+  GHAssertTrue(valid, @"valid");
+
+  char *copy = malloc([[encoded valueForKeyPath:@"@max.length"]
+    unsignedIntegerValue]);
+  start = [NSDate date];
+  for (int round = 0; round < rounds; round++) {
+    for (NSData *data in encoded)
+      memcpy(copy, [data bytes], [data length]);
+  }
+  NSTimeInterval copying = -[start timeIntervalSinceNow];
+  free(copy);
+
+  double megabytes = (double)bytes * rounds / (1 << 20);
+  NSLog(@"bson_validate: %.0f MB/s, memcpy: %.0f MB/s (%lu bytes x %d)",
+    megabytes / validate, megabytes / copying, (unsigned long)bytes, rounds);
+}
+
+@end
@@ -6,6 +6,7 @@
 //
 
 #import "BNConnection.h"
+#import "BNServer.h"
 #import "RandomObjects.h"
 
 #ifndef WAIT_WHILE
@@ -23,6 +24,12 @@
 
   NSString *lastToConnect;
   NSString *lastToDisconnect;
+  BNMessageId lastSent;
+  NSUInteger framesBatched;
+  NSMutableData *streamed;
+  NSMutableDictionary *threads; // each connection's.
+  NSUInteger drains;
+  BNServer *echoServer;
 }
 
 @end
@@ -37,6 +44,75 @@ static NSString *kHOST1 = @"localhost:1337";
 static NSString *kHOST2 = @"localhost:1338";
 static NSString *kHOST3 = @"localhost:1339";
 static NSString *kHOST4 = @"localhost:1340";
+static NSString *kHOST5 = @"localhost:1345"; // a BNServer, echoing.
+
+
+// Sends back whatever a BNServer's connections receive. The server's ends are
+// told to compress only in server:didConnect:, after connecting, so it is
+// their answer to the handshake that tells the other end they inflate.
+@interface BNEchoDelegate : NSObject <BNServerDelegate, BNConnectionDelegate>
+@end
+
+@implementation BNEchoDelegate
+
+- (void) server:(BNServer *)server error:(NSError *)error {
+  NSLog(@"Echo server: %@ error: %@", server, error);
+}
+
+- (void) server:(BNServer *)server didConnect:(BNConnection *)conn {
+  conn.delegate = self;
+  conn.compressionThreshold = 1024;
+}
+
+- (void) server:(BNServer *)server failedToConnect:(BNConnection *)conn
+  withError:(NSError *)error {}
+
+- (void) connection:(BNConnection *)conn error:(NSError *)error {}
+- (void) connectionStateDidChange:(BNConnection *)conn {}
+
+- (void) connection:(BNConnection *)conn receivedBSONData:(NSData *)bson {
+  [conn sendBSONData:bson];
+}
+
+@end
+
+
+// Takes no large frame parts, so frames over maxFrameSize are refused.
+@interface BNRejectingDelegate : NSObject <BNConnectionDelegate> {
+  NSInteger errorCode;
+  BOOL disconnected;
+}
+@property (readonly) NSInteger errorCode;
+@property (readonly) BOOL disconnected;
+@end
+
+@implementation BNRejectingDelegate
+
+@synthesize errorCode, disconnected;
+
+- (void) connection:(BNConnection *)conn error:(NSError *)error {
+  if ([[error domain] isEqualToString:BNConnectionErrorDomain])
+    errorCode = [error code];
+}
+
+- (void) connectionStateDidChange:(BNConnection *)conn {
+  if (conn.state == BNConnectionDisconnected)
+    disconnected = YES;
+}
+
+@end
+
+// Same, but takes large frame parts (and drops them).
+@interface BNStreamingRejectingDelegate : BNRejectingDelegate
+@end
+
+@implementation BNStreamingRejectingDelegate
+
+- (void) connection:(BNConnection *)conn
+  receivedPartOfLargeFrame:(NSData *)part offset:(NSUInteger)offset
+  ofLength:(NSUInteger)length {}
+
+@end
 
 
 @implementation BNConnectionTest
@@ -54,7 +130,18 @@ static NSString *kHOST4 = @"localhost:1340";
 
   BNConnection *conn = [[BNConnection alloc] initWithAddress:address];
   conn.delegate = self;
+  // half of the connections read frame by frame, the rest in stream mode.
+  conn.readsWholeFrames = (address == kHOST2 || address == kHOST4);
+  // and kHOST4 coalesces its writes.
+  if (address == kHOST4)
+    conn.coalesceBytes = 4096;
+  // kHOST5 compresses, and so do the server's ends (see BNEchoDelegate).
+  if (address == kHOST5)
+    conn.compressionThreshold = 1024;
   [connections setValue:conn forKey:address];
+  @synchronized(threads) {
+    [threads setValue:[NSThread currentThread] forKey:address];
+  }
   GHAssertTrue([conn connect], @"Connection Setup");
 
   [[NSRunLoop currentRunLoop] run];
@@ -63,9 +150,31 @@ static NSString *kHOST4 = @"localhost:1340";
   [pool release];
 }
 
+- (void)setupEchoServer:(NSString *)address {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+  NSString *host;
+  UInt16 port;
+  [BNConnection extractHost:&host andPort:&port fromAddress:address];
+
+  BNEchoDelegate *echo = [[BNEchoDelegate alloc] init];
+  BNServer *server = [[BNServer alloc] init];
+  server.delegate = echo;
+  GHAssertTrue([server startListeningOnPort:port],
+    @"Should be able to begin listening.");
+  echoServer = server;
+
+  [[NSRunLoop currentRunLoop] run];
+
+  [server release];
+  [echo release];
+  [pool release];
+}
+
 - (void)setUpClass {
   connections = [[NSMutableDictionary alloc] initWithCapacity:10];
   expect = [[NSMutableDictionary alloc] initWithCapacity:10];
+  threads = [[NSMutableDictionary alloc] initWithCapacity:10];
 
   [[NSNotificationCenter defaultCenter] addObserver:self
     selector:@selector(connectionNotification:)
@@ -75,11 +184,16 @@ static NSString *kHOST4 = @"localhost:1340";
     selector:@selector(connectionNotification:)
     name:BNConnectionConnectedNotification object:nil];
 
+  [NSThread detachNewThreadSelector:@selector(setupEchoServer:)
+    toTarget:self withObject:kHOST5];
+  WAIT_WHILE(echoServer == nil);
+
   SEL setup = @selector(setupConnection:);
   [NSThread detachNewThreadSelector:setup toTarget:self withObject:kHOST1];
   [NSThread detachNewThreadSelector:setup toTarget:self withObject:kHOST2];
   [NSThread detachNewThreadSelector:setup toTarget:self withObject:kHOST3];
   [NSThread detachNewThreadSelector:setup toTarget:self withObject:kHOST4];
+  [NSThread detachNewThreadSelector:setup toTarget:self withObject:kHOST5];
 
 }
 
@@ -89,8 +203,11 @@ static NSString *kHOST4 = @"localhost:1340";
 
   for (BNConnection *conn in [connections allValues])
     [conn disconnect];
+  [echoServer stopListening];
   [connections release];
   [expect release];
+  [threads release];
+  [streamed release];
 }
 
 - (void)setUp {
@@ -130,8 +247,14 @@ static NSString *kHOST4 = @"localhost:1340";
   NSData *bson = [dict BSONRepresentation];
   NSData *xdata = nil;
 
+  // An array expects several frames, in order.
+  NSMutableArray *xarray = nil;
   @synchronized(expect) {
     xdata = [expect valueForKey:conn.address];
+    if ([xdata isKindOfClass:[NSMutableArray class]]) {
+      xarray = (NSMutableArray *)xdata;
+      xdata = [xarray count] > 0 ? [xarray objectAtIndex:0] : nil;
+    }
   }
   NSLog(@"conn: %@ received. (%lu==%lu)", conn, [bson length], [xdata length]);
 
@@ -142,7 +265,46 @@ static NSString *kHOST4 = @"localhost:1340";
     GHAssertTrue(false, @"Unexpected dictionary received.");
 
   @synchronized(expect) {
-    [expect setValue:nil forKey:conn.address];
+    if (xarray && [xarray count] > 0)
+      [xarray removeObjectAtIndex:0];
+    if (!xarray || [xarray count] == 0)
+      [expect setValue:nil forKey:conn.address];
+  }
+}
+
+- (void) connection:(BNConnection *)conn receivedBatch:(NSArray *)frames {
+  GHAssertTrue([frames count] > 0, @"Batches are never empty.");
+  @synchronized(expect) {
+    framesBatched += [frames count];
+  }
+}
+
+- (void) connection:(BNConnection *)conn
+  receivedPartOfLargeFrame:(NSData *)part offset:(NSUInteger)offset
+  ofLength:(NSUInteger)length {
+  @synchronized(expect) {
+    if (offset == 0) {
+      [streamed release];
+      streamed = [[NSMutableData alloc] init];
+    }
+    GHAssertTrue([streamed length] == offset, @"Parts must come in order.");
+    [streamed appendData:part];
+
+    if (offset + [part length] == length) {
+      NSData *xdata = [expect valueForKey:conn.address];
+      GHAssertTrue([xdata isEqualToData:streamed], @"Large frame streamed.");
+      [expect setValue:nil forKey:conn.address];
+    }
+  }
+}
+
+- (void) connection:(BNConnection *)conn didSendMessage:(BNMessageId)msgId {
+  lastSent = msgId;
+}
+
+- (void) connectionDidDrain:(BNConnection *)conn {
+  @synchronized(expect) {
+    drains++;
   }
 }
 
@@ -154,6 +316,20 @@ static NSString *kHOST4 = @"localhost:1340";
   GHAssertTrue([expect count] == 0, @"Should be expecting nothing else.");
 }
 
+// Keeps a connection's thread from writing (or reading) for a while.
+- (void) stallFor:(NSNumber *)seconds {
+  [NSThread sleepForTimeInterval:[seconds doubleValue]];
+}
+
+- (void) stallConnection:(NSString *)address for:(NSTimeInterval)seconds {
+  NSThread *thread;
+  @synchronized(threads) {
+    thread = [threads valueForKey:address];
+  }
+  [self performSelector:@selector(stallFor:) onThread:thread
+    withObject:[NSNumber numberWithDouble:seconds] waitUntilDone:NO];
+}
+
 - (void) connectionNotification:(NSNotification *)notification {
   NSLog(@"Received %@ notification.", notification);
 
@@ -301,6 +477,348 @@ static NSString *kHOST4 = @"localhost:1340";
   }
 }
 
+- (void) testJ_BounceLargeDataWholeFrames {
+  NSString *path;
+  path = [[NSBundle mainBundle] pathForResource:@"hamlet" ofType: @"txt"];
+  NSString *hamlet = [NSString stringWithContentsOfFile:path
+    encoding:NSUTF8StringEncoding error:NULL];
+
+  NSDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:hamlet forKey:@"hamlet"];
+  NSData *data = [dict BSONRepresentation];
+
+  @synchronized(self) {
+    [expect setValue:data forKey:kHOST2];
+  }
+  BNConnection *conn = [connections valueForKey:kHOST2];
+  GHAssertTrue(conn.readsWholeFrames, @"kHOST2 reads whole frames.");
+  GHAssertTrue([conn sendBSONData:data] > 0, @"Sending ok.");
+
+  [self waitForAllExpected];
+}
+
+- (void) testK_Enqueue {
+  NSData *data = [[NSDictionary randomDictionary] BSONRepresentation];
+  @synchronized(expect) {
+    [expect setValue:data forKey:kHOST3];
+  }
+
+  BNConnection *conn = [connections valueForKey:kHOST3];
+  BNMessageId msgId = [conn enqueueBSONData:data];
+  GHAssertTrue(msgId > 0, @"Enqueueing ok.");
+
+  [self waitForAllExpected];
+  GHAssertTrue(lastSent == msgId, @"Must report the enqueued message sent.");
+}
+
+- (void) testL_EnqueueCoalesced {
+  NSDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:@"Herp" forKey:@"Derp"];
+  NSData *data = [dict BSONRepresentation];
+  @synchronized(expect) {
+    [expect setValue:data forKey:kHOST4];
+  }
+
+  BNConnection *conn = [connections valueForKey:kHOST4];
+  GHAssertTrue(conn.coalesceBytes > [data length], @"Small enough to gather.");
+  BNMessageId msgId = [conn enqueueBSONData:data];
+  GHAssertTrue(msgId > 0, @"Enqueueing ok.");
+
+  [self waitForAllExpected];
+  GHAssertTrue(lastSent == msgId, @"Must report the coalesced message sent.");
+}
+
+- (void) testM_QueuedBytes {
+  BNConnection *conn = [connections valueForKey:kHOST3];
+  conn.highWatermark = 1 << 20;
+  conn.lowWatermark = 1 << 16;
+  conn.backpressurePolicy = BNBackpressureBlock;
+
+  NSData *data = [[NSDictionary randomDictionary] BSONRepresentation];
+  @synchronized(expect) {
+    [expect setValue:data forKey:kHOST3];
+  }
+  GHAssertTrue([conn sendBSONData:data] > 0, @"Under the watermark.");
+
+  [self waitForAllExpected];
+  GHAssertTrue(conn.queuedBytes == 0, @"Everything was written.");
+  conn.highWatermark = 0;
+}
+
+- (void) testMA_BackpressureFail {
+  BNConnection *conn = [connections valueForKey:kHOST3];
+  NSData *data = [[NSDictionary randomDictionary] BSONRepresentation];
+  conn.highWatermark = [data length];
+  conn.lowWatermark = 0;
+  conn.backpressurePolicy = BNBackpressureFail;
+
+  NSUInteger drainsBefore;
+  @synchronized(expect) {
+    [expect setValue:data forKey:kHOST3];
+    drainsBefore = drains;
+  }
+
+  // While the connection's thread can't write, the first frame stays queued.
+  [self stallConnection:kHOST3 for:0.5];
+  GHAssertTrue([conn enqueueBSONData:data] > 0, @"Fits an empty queue.");
+  GHAssertTrue([conn enqueueBSONData:data] == 0, @"Over highWatermark.");
+  GHAssertTrue([conn sendBSONData:data] == 0, @"Over highWatermark.");
+
+  [self waitForAllExpected];
+  GHAssertTrue(conn.queuedBytes == 0, @"Everything was written.");
+  WAIT_WHILE(drains == drainsBefore);
+  GHAssertTrue(drains == drainsBefore + 1, @"Must report draining once.");
+  conn.highWatermark = 0;
+}
+
+- (void) testMB_BackpressureBlock {
+  BNConnection *conn = [connections valueForKey:kHOST3];
+  NSData *data1 = [[NSDictionary randomDictionary] BSONRepresentation];
+  NSData *data2 = [[NSDictionary randomDictionary] BSONRepresentation];
+  conn.highWatermark = [data1 length];
+  conn.lowWatermark = 0;
+  conn.backpressurePolicy = BNBackpressureBlock;
+
+  NSUInteger drainsBefore;
+  @synchronized(expect) {
+    [expect setValue:[NSMutableArray arrayWithObjects:data1, data2, nil]
+      forKey:kHOST3];
+    drainsBefore = drains;
+  }
+
+  // The second send has to wait for the first to be written.
+  [self stallConnection:kHOST3 for:1.0];
+  GHAssertTrue([conn enqueueBSONData:data1] > 0, @"Fits an empty queue.");
+  NSDate *start = [NSDate date];
+  GHAssertTrue([conn sendBSONData:data2] > 0, @"Sent once drained.");
+  GHAssertTrue(-[start timeIntervalSinceNow] > 0.5, @"Must have blocked.");
+
+  [self waitForAllExpected];
+  GHAssertTrue(conn.queuedBytes == 0, @"Everything was written.");
+  GHAssertTrue(drains > drainsBefore, @"Must report draining.");
+  conn.highWatermark = 0;
+  conn.backpressurePolicy = BNBackpressureFail;
+}
+
+- (void) testN_Batch {
+  NSUInteger before;
+  @synchronized(expect) {
+    before = framesBatched;
+  }
+
+  [self testF_BounceDataMultiple];
+  [self waitForAllExpected];
+
+  @synchronized(expect) {
+    GHAssertTrue(framesBatched == before + 4, @"Every frame comes batched.");
+  }
+}
+
+- (void) testO_Stats {
+  BNConnection *conn = [connections valueForKey:kHOST1];
+  BNConnectionStats before = [conn stats];
+
+  [self testE_BounceLargeDict];
+
+  BNConnectionStats after = [conn stats];
+  GHAssertTrue(after.framesOut == before.framesOut + 1, @"One frame out.");
+  GHAssertTrue(after.framesIn == before.framesIn + 1, @"One frame in.");
+  GHAssertTrue(after.bytesIn - before.bytesIn <= after.largestFrameIn,
+    @"Just that frame's bytes in.");
+  GHAssertTrue(after.bytesOut > before.bytesOut, @"Bytes written.");
+
+  uint64_t reads = 0;
+  for (int i = 0; i < BNConnectionReadSizeBuckets; i++)
+    reads += after.readSizes[i] - before.readSizes[i];
+  GHAssertTrue(reads > 0, @"Reads are counted.");
+  NSLog(@"%@", [conn statsString]);
+}
+
+- (void) testP_LargeFrameStreams {
+  NSString *path;
+  path = [[NSBundle mainBundle] pathForResource:@"hamlet" ofType: @"txt"];
+  NSString *hamlet = [NSString stringWithContentsOfFile:path
+    encoding:NSUTF8StringEncoding error:NULL];
+
+  NSDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:hamlet forKey:@"hamlet"];
+  NSData *data = [dict BSONRepresentation];
+
+  // kHOST3 reads a stream, kHOST4 whole frames.
+  for (NSString *host in [NSArray arrayWithObjects:kHOST3, kHOST4, nil]) {
+    BNConnection *conn = [connections valueForKey:host];
+    NSUInteger max = conn.maxFrameSize;
+    conn.maxFrameSize = 1024;
+
+    @synchronized(expect) {
+      [expect setValue:data forKey:host];
+    }
+    GHAssertTrue([conn sendBSONData:data] > 0, @"Sending ok.");
+    [self waitForAllExpected];
+    conn.maxFrameSize = max;
+  }
+}
+
+- (NSData *) headerWithLength:(int)length {
+  uint32_t header = NSSwapHostIntToLittle((unsigned int)length);
+  return [NSData dataWithBytes:&header length:4];
+}
+
+// Has the bouncer send back data, which host's connection must refuse with
+// code, dropping the peer. Then reconnects.
+- (void) expectData:(NSData *)data refusedBy:(NSString *)host
+  withCode:(BNConnectionErrorCode)code streaming:(BOOL)streaming
+  maxFrameSize:(NSUInteger)maxFrameSize {
+  BNConnection *conn = [connections valueForKey:host];
+  BNRejectingDelegate *rejecting = streaming
+    ? [[BNStreamingRejectingDelegate alloc] init]
+    : [[BNRejectingDelegate alloc] init];
+  NSUInteger max = conn.maxFrameSize;
+  conn.maxFrameSize = maxFrameSize;
+  conn.delegate = rejecting;
+
+  GHAssertTrue([conn sendBSONData:data] > 0, @"Sending ok.");
+
+  WAIT_WHILE(!rejecting.disconnected);
+  GHAssertTrue(rejecting.disconnected, @"%@ must drop the peer.", host);
+  GHAssertTrue(rejecting.errorCode == code, @"%@ refused with %d.", host,
+    (int)rejecting.errorCode);
+  GHAssertFalse(conn.isConnected, @"Must be disconnected.");
+
+  conn.delegate = self;
+  conn.maxFrameSize = max;
+  [rejecting release];
+
+  GHAssertTrue([conn connect], @"Reconnecting.");
+  WAIT_WHILE(!conn.isConnected);
+  GHAssertTrue(conn.isConnected, @"Must be connected again.");
+}
+
+- (void) expectData:(NSData *)data refusedBy:(NSString *)host
+  withCode:(BNConnectionErrorCode)code streaming:(BOOL)streaming {
+  [self expectData:data refusedBy:host withCode:code streaming:streaming
+    maxFrameSize:1024];
+}
+
+- (void) expectHeader:(int)length refusedBy:(NSString *)host
+  withCode:(BNConnectionErrorCode)code {
+  [self expectData:[self headerWithLength:length] refusedBy:host
+    withCode:code streaming:NO];
+}
+
+- (void) testPA_LargeFrameRefused {
+  // kHOST3 reads a stream, kHOST2 whole frames.
+  for (NSString *host in [NSArray arrayWithObjects:kHOST3, kHOST2, nil]) {
+    [self expectHeader:1 << 20 refusedBy:host
+      withCode:BNConnectionErrorFrameTooLarge];
+  }
+}
+
+- (void) testPB_BadLengthRefused {
+  for (NSString *host in [NSArray arrayWithObjects:kHOST3, kHOST2, nil]) {
+    [self expectHeader:-1 refusedBy:host
+      withCode:BNConnectionErrorInvalidFrame];
+    [self expectHeader:-(1 << 20) refusedBy:host
+      withCode:BNConnectionErrorInvalidFrame];
+    [self expectHeader:4 refusedBy:host
+      withCode:BNConnectionErrorInvalidFrame];
+  }
+}
+
+- (void) testQ_Compressed {
+  NSString *path;
+  path = [[NSBundle mainBundle] pathForResource:@"hamlet" ofType: @"txt"];
+  NSString *hamlet = [NSString stringWithContentsOfFile:path
+    encoding:NSUTF8StringEncoding error:NULL];
+
+  NSDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:hamlet forKey:@"hamlet"];
+  NSData *data = [dict BSONRepresentation];
+
+  @synchronized(expect) {
+    [expect setValue:data forKey:kHOST5];
+  }
+  BNConnection *conn = [connections valueForKey:kHOST5];
+  BNConnectionStats before = [conn stats];
+  GHAssertTrue([conn sendBSONData:data] > 0, @"Sending ok.");
+  [self waitForAllExpected];
+
+  BNConnectionStats after = [conn stats];
+  GHAssertTrue(after.bytesOut - before.bytesOut < [data length] / 2,
+    @"Hamlet must go out deflated.");
+  GHAssertTrue(after.bytesIn - before.bytesIn < [data length] / 2,
+    @"and come back deflated.");
+}
+
+// Reconnects host with compression on, so it starts the handshake, which the
+// bouncer answers with its echo. The threshold is too high for anything to
+// go out deflated.
+- (void) handshake:(NSString *)host {
+  BNConnection *conn = [connections valueForKey:host];
+  conn.compressionThreshold = 1 << 30;
+  [conn disconnect];
+  WAIT_WHILE(conn.isConnected);
+  GHAssertTrue([conn connect], @"Reconnecting.");
+  WAIT_WHILE(!conn.isConnected);
+  GHAssertTrue(conn.isConnected, @"Must be connected again.");
+  [NSThread sleepForTimeInterval:0.5]; // for the echo.
+}
+
+- (void) testQA_CorruptCompressedFrame {
+  [self handshake:kHOST3];
+
+  // A $deflate frame that doesn't inflate, then (in the same read, most
+  // likely) the start of a frame to stream. Nothing may be read after the
+  // first one is refused.
+  BNDocumentBuilder *b = [BNDocumentBuilder builderWithPool:nil];
+  [b appendData:[@"not zlib" dataUsingEncoding:NSUTF8StringEncoding]
+    forKey:@"$deflate"];
+  [b appendInt:100 forKey:@"$length"];
+  NSMutableData *data = [NSMutableData dataWithData:[b finish]];
+  [data appendData:[self headerWithLength:1 << 20]];
+
+  [self expectData:data refusedBy:kHOST3
+    withCode:BNConnectionErrorInvalidFrame streaming:YES];
+}
+
+- (void) testQB_InflationCapped {
+  [self handshake:kHOST3]; // expectData's reconnect, too.
+
+  // With no maxFrameSize, $length is still held to 64MB; nothing is
+  // allocated for it.
+  BNDocumentBuilder *b = [BNDocumentBuilder builderWithPool:nil];
+  [b appendData:[@"not zlib" dataUsingEncoding:NSUTF8StringEncoding]
+    forKey:@"$deflate"];
+  [b appendInt:1 << 30 forKey:@"$length"];
+
+  [self expectData:[b finish] refusedBy:kHOST3
+    withCode:BNConnectionErrorFrameTooLarge streaming:NO maxFrameSize:0];
+
+  BNConnection *conn = [connections valueForKey:kHOST3];
+  conn.compressionThreshold = 0;
+}
+
+- (void) testQC_NoHandshakeNoUnwrapping {
+  // kHOST1 doesn't compress, so it never completes a handshake: documents
+  // that look like compressed frames or handshakes are just documents.
+  NSDictionary *deflate = [NSDictionary dictionaryWithObject:
+    [@"not zlib" dataUsingEncoding:NSUTF8StringEncoding] forKey:@"$deflate"];
+  NSDictionary *hello = [NSDictionary dictionaryWithObject:
+    [NSDictionary dictionaryWithObject:[NSNumber numberWithBool:YES]
+      forKey:@"deflate"] forKey:@"$bsonnetwork"];
+  NSMutableArray *datas = [NSMutableArray arrayWithObjects:
+    [deflate BSONRepresentation], [hello BSONRepresentation], nil];
+
+  @synchronized(expect) {
+    [expect setValue:datas forKey:kHOST1];
+  }
+  BNConnection *conn = [connections valueForKey:kHOST1];
+  for (NSData *data in [[datas copy] autorelease])
+    GHAssertTrue([conn sendBSONData:data] > 0, @"Sending ok.");
+  [self waitForAllExpected];
+  GHAssertTrue(conn.isConnected, @"Still connected.");
+}
+
 //------------------------------------------------------------------------------
 
 @end
@@ -0,0 +1,156 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import "BNDocument.h"
+#import "BNMessage.h"
+#import "RandomObjects.h"
+#import <bson-objc/BSONCodec.h>
+
+
+@interface BNDocumentTest : GHTestCase {}
+@end
+
+@implementation BNDocumentTest
+
+//------------------------------------------------------------------------------
+#pragma mark setup
+
+- (BOOL) shouldRunOnMainThread {
+  return NO;
+}
+
+- (void) setUpClass {}
+- (void) tearDownClass {}
+- (void) setUp {}
+- (void) tearDown {}
+
+- (NSDictionary *) headerDictionary {
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:@"herp" forKey:BNMessageSource];
+  [dict setValue:@"derp" forKey:BNMessageDestination];
+  [dict setValue:[NSNumber numberWithInt:4124321] forKey:BNMessageSeqNo];
+  [dict setValue:[NSNumber numberWithInt:654365] forKey:BNMessageAckNo];
+  [dict setValue:[NSDictionary randomDictionary] forKey:@"payload"];
+  return dict;
+}
+
+//------------------------------------------------------------------------------
+#pragma mark tests
+
+- (void) testA_Lookup {
+  NSDictionary *dict = [self headerDictionary];
+  BNDocument *doc = [BNDocument documentWithData:[dict BSONRepresentation]];
+
+  GHAssertTrue([doc containsKey:BNMessageSource], @"src");
+  GHAssertTrue([doc containsKey:BNMessageDestination], @"dst");
+  GHAssertTrue([[doc stringForKey:BNMessageSource] isEqualToString:@"herp"],
+    @"src");
+  GHAssertTrue([[doc objectForKey:BNMessageDestination]
+    isEqualToString:@"derp"], @"dst");
+  GHAssertTrue([[doc objectForKey:BNMessageSeqNo] intValue] == 4124321, @"seq");
+  GHAssertTrue([[doc objectForKey:BNMessageAckNo] intValue] == 654365, @"ack");
+}
+
+- (void) testB_Missing {
+  NSDictionary *dict = [self headerDictionary];
+  BNDocument *doc = [BNDocument documentWithData:[dict BSONRepresentation]];
+
+  GHAssertFalse([doc containsKey:BNMessageToken], @"tok");
+  GHAssertTrue([doc objectForKey:BNMessageToken] == nil, @"tok");
+  GHAssertTrue([doc stringForKey:@"dsaiofidsajfdsa"] == nil, @"missing");
+  GHAssertTrue([doc stringForKey:BNMessageSeqNo] == nil, @"not a string");
+}
+
+- (void) testC_Empty {
+  NSData *data = [[NSDictionary dictionary] BSONRepresentation];
+  BNDocument *doc = [BNDocument documentWithData:data];
+
+  GHAssertFalse([doc containsKey:BNMessageSource], @"src");
+  GHAssertTrue([[doc dictionaryValue] count] == 0, @"empty");
+
+  doc = [BNDocument documentWithData:[NSData data]];
+  GHAssertFalse([doc containsKey:BNMessageSource], @"src");
+  GHAssertTrue([[doc dictionaryValue] count] == 0, @"empty");
+}
+
+- (void) testD_DictionaryValue {
+  for (int i = 0; i < 100; i++) {
+    NSData *data = [[NSDictionary randomDictionary] BSONRepresentation];
+    BNDocument *doc = [BNDocument documentWithData:data];
+
+    GHAssertTrue([[doc dictionaryValue] isEqualToDictionary:[data BSONValue]],
+      @"decoded dictionary must match");
+  }
+}
+
+- (void) testE_Nested {
+  NSDictionary *dict = [self headerDictionary];
+  BNDocument *doc = [BNDocument documentWithData:[dict BSONRepresentation]];
+
+  NSDictionary *payload = [doc objectForKey:@"payload"];
+  GHAssertTrue([payload isKindOfClass:[NSDictionary class]], @"payload");
+  GHAssertTrue([payload count] == [[dict valueForKey:@"payload"] count],
+    @"payload");
+}
+
+- (void) testF_Typed {
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:[NSNumber numberWithInt:-5] forKey:@"int"];
+  [dict setValue:[NSNumber numberWithLongLong:1LL << 40] forKey:@"long"];
+  [dict setValue:[NSNumber numberWithDouble:2.5] forKey:@"double"];
+  [dict setValue:[NSNumber numberWithBool:YES] forKey:@"bool"];
+  [dict setValue:@"1234" forKey:@"string"];
+  BNDocument *doc = [BNDocument documentWithData:[dict BSONRepresentation]];
+
+  GHAssertTrue([doc int64ForKey:@"int"] == -5, @"int");
+  GHAssertTrue([doc int64ForKey:@"long"] == 1LL << 40, @"long");
+  GHAssertTrue([doc doubleForKey:@"double"] == 2.5, @"double");
+  GHAssertTrue([doc int64ForKey:@"double"] == 2, @"double as int");
+  GHAssertTrue([doc doubleForKey:@"int"] == -5.0, @"int as double");
+  GHAssertTrue([doc boolForKey:@"bool"], @"bool");
+  GHAssertTrue([doc int64ForKey:@"bool"] == 1, @"bool as int");
+  GHAssertTrue([doc boolForKey:@"int"], @"int as bool");
+
+  GHAssertTrue([doc int64ForKey:@"string"] == 0, @"not a number");
+  GHAssertFalse([doc boolForKey:@"string"], @"not a number");
+  GHAssertTrue([doc doubleForKey:@"missing"] == 0, @"missing");
+}
+
+- (void) testG_Slices {
+  NSMutableData *blob = [NSMutableData dataWithLength:4096];
+  memset([blob mutableBytes], 'x', 4096);
+  NSData *small = [NSData dataWithBytes:"aBcDeFg" length:7];
+
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:blob forKey:@"blob"];
+  [dict setValue:small forKey:@"small"];
+  NSData *data = [dict BSONRepresentation];
+  BNDocument *doc = [BNDocument documentWithData:data];
+
+  // Large blobs point into the frame; small ones are cheaper to copy.
+  NSData *value = [doc objectForKey:@"blob"];
+  const char *start = [data bytes];
+  GHAssertTrue([value isEqualToData:blob], @"blob");
+  GHAssertTrue((const char *)[value bytes] > start
+    && (const char *)[value bytes] < start + [data length], @"no copy");
+
+  value = [[doc dictionaryValue] valueForKey:@"small"];
+  GHAssertTrue([value isEqualToData:small], @"small");
+  GHAssertFalse((const char *)[value bytes] > start
+    && (const char *)[value bytes] < start + [data length], @"copied");
+
+  // The slice keeps the frame alive on its own.
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSData *frame = [[NSData alloc] initWithData:data];
+  value = [[[BNDocument documentWithData:frame] objectForKey:@"blob"] retain];
+  [frame release];
+  [pool drain];
+  GHAssertTrue([value isEqualToData:blob], @"retained");
+  [value release];
+}
+
+@end
@@ -0,0 +1,545 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import "BNEpollSocket.h"
+
+#ifdef __linux__
+
+#import <sys/socket.h>
+#import <sys/time.h>
+#import <netinet/in.h>
+#import <arpa/inet.h>
+#import <fcntl.h>
+#import <unistd.h>
+
+#ifndef WAIT_WHILE
+#define WAIT_WHILE(condition) \
+  for (int i = 0; (condition) && i < 10000; i++) \
+    [NSThread sleepForTimeInterval:0.5]; // main thread apparently.
+#endif
+
+static UInt16 kPORT = 1380;         // BNEpollSocket listening.
+static UInt16 kSTUCK_PORT = 1381;   // plain socket, backlog full.
+static UInt16 kREFUSED_PORT = 1382; // nothing.
+
+// A thread running a run loop with a BNEpollLoop, as BNServer's workers do.
+// A socket must only be used from the thread of the loop it is in.
+@interface BNEpollTestThread : NSObject {
+  NSThread *thread;
+  NSRunLoop *runLoop;
+  NSCondition *started;
+  volatile BOOL stopped;
+}
+@property (readonly) NSThread *thread;
+@property (readonly) NSRunLoop *runLoop;
+- (void) stop;
+@end
+
+@implementation BNEpollTestThread
+
+@synthesize thread, runLoop;
+
+- (id) init {
+  if ((self = [super init])) {
+    started = [[NSCondition alloc] init];
+    thread = [[NSThread alloc] initWithTarget:self selector:@selector(main)
+      object:nil];
+    [thread start];
+
+    [started lock];
+    while (runLoop == nil)
+      [started wait];
+    [started unlock];
+  }
+  return self;
+}
+
+- (void) dealloc {
+  [thread release];
+  [started release];
+  [super dealloc];
+}
+
+- (void) main {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSRunLoop *loop = [NSRunLoop currentRunLoop];
+  [loop addPort:[NSPort port] forMode:NSDefaultRunLoopMode];
+  [BNEpollLoop currentLoop];
+
+  [started lock];
+  runLoop = loop;
+  [started signal];
+  [started unlock];
+
+  while (!stopped) {
+    NSAutoreleasePool *inner = [[NSAutoreleasePool alloc] init];
+    [loop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
+    [inner drain];
+  }
+  [pool drain];
+}
+
+- (void) __stop {
+  stopped = YES;
+}
+
+- (void) stop {
+  [self performSelector:@selector(__stop) onThread:thread withObject:nil
+    waitUntilDone:YES];
+}
+
+@end
+
+//------------------------------------------------------------------------------
+
+// The other end of most tests is a plain blocking socket, so the test
+// decides exactly when bytes are written, read, or the peer goes away.
+static int peer_connect(UInt16 port, int rcvbuf) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (rcvbuf) // before connect, so the window is small from the start.
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  struct timeval tv = { 5, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static BOOL peer_write(int fd, NSData *data) {
+  const char *bytes = [data bytes];
+  size_t done = 0;
+  while (done < [data length]) {
+    ssize_t sent = write(fd, bytes + done, [data length] - done);
+    if (sent <= 0)
+      return NO;
+    done += sent;
+  }
+  return YES;
+}
+
+// Whatever arrived before length bytes, EOF, or the 5s receive timeout.
+static NSData *peer_read(int fd, size_t length) {
+  NSMutableData *data = [NSMutableData dataWithLength:length];
+  size_t done = 0;
+  while (done < length) {
+    ssize_t got = read(fd, (char *)[data mutableBytes] + done, length - done);
+    if (got <= 0)
+      break;
+    done += got;
+  }
+  [data setLength:done];
+  return data;
+}
+
+static NSData *pattern(NSUInteger length, unsigned char seed) {
+  NSMutableData *data = [NSMutableData dataWithLength:length];
+  unsigned char *bytes = [data mutableBytes];
+  for (NSUInteger i = 0; i < length; i++)
+    bytes[i] = (unsigned char)(seed + i * 7 + (i >> 11));
+  return data;
+}
+
+//------------------------------------------------------------------------------
+
+@interface BNEpollSocketTest : GHTestCase {
+  BNEpollTestThread *listenThread;
+  BNEpollTestThread *workerThread;
+  NSRunLoop *handOffTo; // what onSocket:wantsRunLoopForNewSocket: answers.
+
+  BNEpollSocket *listener;
+  BNEpollSocket *client;
+  BNEpollSocket *accepted;
+  NSThread *acceptedThread; // where accepted said it connected.
+  BOOL clientConnected;
+
+  NSMutableData *readData;
+  NSMutableArray *readTags;
+  NSMutableArray *wroteTags;
+  NSUInteger partialWrites;
+  NSMutableArray *disconnects; // sockets, in order.
+  NSError *disconnectError;
+  BOOL sawDisconnectError;
+}
+@end
+
+@implementation BNEpollSocketTest
+
+//------------------------------------------------------------------------------
+#pragma mark setup
+
+- (BOOL) shouldRunOnMainThread {
+  return NO;
+}
+
+- (void) setUpClass {
+  listenThread = [[BNEpollTestThread alloc] init];
+  workerThread = [[BNEpollTestThread alloc] init];
+  readData = [[NSMutableData alloc] init];
+  readTags = [[NSMutableArray alloc] init];
+  wroteTags = [[NSMutableArray alloc] init];
+  disconnects = [[NSMutableArray alloc] init];
+}
+
+- (void) tearDownClass {
+  [listenThread stop];
+  [workerThread stop];
+  [listenThread release];
+  [workerThread release];
+  [readData release];
+  [readTags release];
+  [wroteTags release];
+  [disconnects release];
+}
+
+- (void) setUp {
+  handOffTo = workerThread.runLoop;
+  [self performSelector:@selector(__listen) onThread:listenThread.thread
+    withObject:nil waitUntilDone:YES];
+  GHAssertNotNil(listener, @"Should be listening on %d.", kPORT);
+}
+
+- (void) tearDown {
+  [self performSelector:@selector(__close:) onThread:listenThread.thread
+    withObject:[NSArray arrayWithObjects:listener, client, nil]
+    waitUntilDone:YES];
+  if (accepted && acceptedThread)
+    [self performSelector:@selector(__close:) onThread:acceptedThread
+      withObject:[NSArray arrayWithObject:accepted] waitUntilDone:YES];
+
+  @synchronized(self) {
+    [listener release];
+    [client release];
+    [accepted release];
+    listener = client = accepted = nil;
+    acceptedThread = nil;
+    clientConnected = NO;
+    [readData setLength:0];
+    [readTags removeAllObjects];
+    [wroteTags removeAllObjects];
+    partialWrites = 0;
+    [disconnects removeAllObjects];
+    [disconnectError release];
+    disconnectError = nil;
+    sawDisconnectError = NO;
+  }
+}
+
+//------------------------------------------------------------------------------
+#pragma mark on the sockets' threads
+
+- (void) __listen {
+  listener = [[BNEpollSocket alloc] initWithDelegate:self];
+  if (![listener acceptOnPort:kPORT error:nil]) {
+    [listener release];
+    listener = nil;
+  }
+}
+
+- (void) __connectTo:(NSNumber *)port {
+  client = [[BNEpollSocket alloc] initWithDelegate:self];
+  NSError *error = nil;
+  if ([client connectToHost:@"127.0.0.1" onPort:[port unsignedShortValue]
+      withTimeout:1.0 error:&error])
+    return;
+
+  // Failed at once: record it as if it had failed asynchronously.
+  @synchronized(self) {
+    disconnectError = [error retain];
+    sawDisconnectError = YES;
+    [disconnects addObject:client];
+  }
+}
+
+- (void) __close:(NSArray *)sockets {
+  for (BNEpollSocket *socket in sockets) {
+    [socket disconnect];
+    socket.delegate = nil;
+  }
+}
+
+// Lengths of 0 read whatever is available. Tags count from 1.
+- (void) __read:(NSArray *)lengths {
+  long tag = 1;
+  for (NSNumber *length in lengths) {
+    if ([length unsignedIntegerValue] == 0)
+      [accepted readDataWithTimeout:-1 tag:tag++];
+    else
+      [accepted readDataToLength:[length unsignedIntegerValue] withTimeout:-1
+        tag:tag++];
+  }
+}
+
+- (void) __write:(NSArray *)datas {
+  long tag = 1;
+  for (NSData *data in datas)
+    [accepted writeData:data withTimeout:-1 tag:tag++];
+}
+
+- (void) __clientWrite:(NSData *)data {
+  [client writeData:data withTimeout:-1 tag:0];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark socket delegate
+
+- (void) onSocket:(AsyncSocket *)sock didAcceptNewSocket:(AsyncSocket *)sock2 {
+  @synchronized(self) {
+    accepted = [(BNEpollSocket *)sock2 retain];
+  }
+}
+
+- (NSRunLoop *) onSocket:(AsyncSocket *)sock
+  wantsRunLoopForNewSocket:(AsyncSocket *)sock2 {
+  return handOffTo;
+}
+
+- (void) onSocket:(AsyncSocket *)sock didConnectToHost:(NSString *)host
+  port:(UInt16)port {
+  @synchronized(self) {
+    if ((id)sock == client)
+      clientConnected = YES;
+    else if ((id)sock == accepted)
+      acceptedThread = [NSThread currentThread];
+  }
+}
+
+- (void) onSocket:(AsyncSocket *)sock didReadData:(NSData *)data
+  withTag:(long)tag {
+  @synchronized(self) {
+    [readData appendData:data];
+    [readTags addObject:[NSNumber numberWithLong:tag]];
+  }
+}
+
+- (void) onSocket:(AsyncSocket *)sock
+  didWritePartialDataOfLength:(NSUInteger)length tag:(long)tag {
+  @synchronized(self) {
+    partialWrites++;
+  }
+}
+
+- (void) onSocket:(AsyncSocket *)sock didWriteDataWithTag:(long)tag {
+  @synchronized(self) {
+    [wroteTags addObject:[NSNumber numberWithLong:tag]];
+  }
+}
+
+- (void) onSocket:(AsyncSocket *)sock willDisconnectWithError:(NSError *)err {
+  @synchronized(self) {
+    [disconnectError release];
+    disconnectError = [err retain];
+    sawDisconnectError = YES;
+  }
+}
+
+- (void) onSocketDidDisconnect:(AsyncSocket *)sock {
+  @synchronized(self) {
+    [disconnects addObject:sock];
+  }
+}
+
+//------------------------------------------------------------------------------
+#pragma mark tests
+
+- (void) waitForAccepted {
+  WAIT_WHILE(acceptedThread == nil);
+  GHAssertNotNil(accepted, @"Should have accepted.");
+  GHAssertNotNil(acceptedThread, @"Accepted socket should have connected.");
+}
+
+- (void) testA_ConnectAndHandOff {
+  [self performSelector:@selector(__connectTo:) onThread:listenThread.thread
+    withObject:[NSNumber numberWithUnsignedShort:kPORT] waitUntilDone:YES];
+  WAIT_WHILE(!clientConnected);
+  GHAssertTrue(clientConnected, @"Client should connect.");
+
+  // moveToRunLoop: took it to the worker's loop before __attachAccepted.
+  [self waitForAccepted];
+  GHAssertTrue(acceptedThread == workerThread.thread,
+    @"Accepted socket should run on the thread it was handed to.");
+  GHAssertTrue([accepted localPort] == kPORT, @"Accepted on kPORT.");
+
+  NSData *hello = pattern(1000, 1);
+  [self performSelector:@selector(__read:) onThread:workerThread.thread
+    withObject:[NSArray arrayWithObject:[NSNumber numberWithInt:1000]]
+    waitUntilDone:YES];
+  [self performSelector:@selector(__clientWrite:) onThread:listenThread.thread
+    withObject:hello waitUntilDone:YES];
+  WAIT_WHILE([readTags count] < 1);
+  GHAssertEqualObjects(readData, hello, @"Read what the client wrote.");
+}
+
+- (void) testB_HandOffWithoutLoop {
+  // The test thread has no BNEpollLoop, so the socket can't move there.
+  handOffTo = [NSRunLoop currentRunLoop];
+  int peer = peer_connect(kPORT, 0);
+  GHAssertTrue(peer >= 0, @"Peer should connect.");
+
+  [self waitForAccepted];
+  GHAssertTrue(acceptedThread == listenThread.thread,
+    @"Accepted socket should stay in the listener's loop.");
+  close(peer);
+}
+
+- (void) testC_ReadsAfterTheEdge {
+  int peer = peer_connect(kPORT, 0);
+  GHAssertTrue(peer >= 0, @"Peer should connect.");
+  [self waitForAccepted];
+
+  // The only EPOLLIN edge comes and goes with no read queued; readable_ has
+  // to remember it for reads queued later.
+  NSData *sent = pattern(3000, 2);
+  GHAssertTrue(peer_write(peer, sent), @"Peer should write.");
+  [NSThread sleepForTimeInterval:0.5];
+
+  NSArray *lengths = [NSArray arrayWithObjects:[NSNumber numberWithInt:10],
+    [NSNumber numberWithInt:990], [NSNumber numberWithInt:2000], nil];
+  [self performSelector:@selector(__read:) onThread:acceptedThread
+    withObject:lengths waitUntilDone:YES];
+  WAIT_WHILE([readTags count] < 3);
+
+  NSArray *tags = [NSArray arrayWithObjects:[NSNumber numberWithInt:1],
+    [NSNumber numberWithInt:2], [NSNumber numberWithInt:3], nil];
+  GHAssertEqualObjects(readTags, tags, @"All three reads, in order.");
+  GHAssertEqualObjects(readData, sent, @"Read what the peer wrote.");
+
+  // Drained now: a read of what is available waits for the next edge.
+  [self performSelector:@selector(__read:) onThread:acceptedThread
+    withObject:[NSArray arrayWithObject:[NSNumber numberWithInt:0]]
+    waitUntilDone:YES];
+  [NSThread sleepForTimeInterval:0.5];
+  GHAssertTrue([readTags count] == 3, @"Nothing more to read yet.");
+
+  NSData *more = pattern(100, 3);
+  GHAssertTrue(peer_write(peer, more), @"Peer should write.");
+  WAIT_WHILE([readTags count] < 4);
+  GHAssertTrue([readData length] == 3100, @"Read the rest when it came.");
+  close(peer);
+}
+
+- (void) testD_PartialWrites {
+  // A small receive window, and a peer that doesn't read yet, so sendmsg
+  // comes up short and writable_ must wait for the next EPOLLOUT.
+  int peer = peer_connect(kPORT, 4096);
+  GHAssertTrue(peer >= 0, @"Peer should connect.");
+  [self waitForAccepted];
+
+  NSArray *datas = [NSArray arrayWithObjects:pattern(8 << 20, 4),
+    pattern(10, 5), pattern(3 << 20, 6), pattern(1, 7), nil];
+  NSMutableData *all = [NSMutableData data];
+  for (NSData *data in datas)
+    [all appendData:data];
+
+  [self performSelector:@selector(__write:) onThread:acceptedThread
+    withObject:datas waitUntilDone:YES];
+  WAIT_WHILE(partialWrites == 0);
+  GHAssertTrue(partialWrites > 0, @"The first write should go out in parts.");
+  GHAssertTrue([wroteTags count] == 0, @"Nothing can be done writing yet.");
+
+  NSData *got = peer_read(peer, [all length]);
+  GHAssertTrue([got length] == [all length], @"Peer got every byte.");
+  GHAssertEqualObjects(got, all, @"Peer got the bytes in order.");
+
+  WAIT_WHILE([wroteTags count] < 4);
+  NSArray *tags = [NSArray arrayWithObjects:[NSNumber numberWithInt:1],
+    [NSNumber numberWithInt:2], [NSNumber numberWithInt:3],
+    [NSNumber numberWithInt:4], nil];
+  GHAssertEqualObjects(wroteTags, tags, @"Each write reported, in order.");
+  close(peer);
+}
+
+- (void) testE_PeerHangup {
+  int peer = peer_connect(kPORT, 0);
+  GHAssertTrue(peer >= 0, @"Peer should connect.");
+  [self waitForAccepted];
+
+  // The data and the FIN both arrive before anything is read.
+  NSData *bye = pattern(3, 8);
+  GHAssertTrue(peer_write(peer, bye), @"Peer should write.");
+  close(peer);
+  [NSThread sleepForTimeInterval:0.5];
+
+  NSArray *lengths = [NSArray arrayWithObjects:[NSNumber numberWithInt:3],
+    [NSNumber numberWithInt:0], nil];
+  [self performSelector:@selector(__read:) onThread:acceptedThread
+    withObject:lengths waitUntilDone:YES];
+  WAIT_WHILE([disconnects count] < 1);
+
+  GHAssertEqualObjects(readData, bye, @"Data before the hangup is read.");
+  GHAssertTrue([readTags count] == 1, @"Only the first read completes.");
+  GHAssertTrue(sawDisconnectError, @"willDisconnectWithError: is called.");
+  GHAssertNil(disconnectError, @"An orderly shutdown has no error.");
+  GHAssertTrue([disconnects lastObject] == accepted, @"Accepted disconnects.");
+  GHAssertFalse([accepted isConnected], @"No longer connected.");
+}
+
+- (void) testF_ConnectTimeout {
+  // With a backlog of 0 the kernel queues one connection; SYNs after that
+  // are dropped, so a connect in the queue's wake never completes.
+  int stuck = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(stuck, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(kSTUCK_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  GHAssertTrue(bind(stuck, (struct sockaddr *)&addr, sizeof(addr)) == 0
+    && listen(stuck, 0) == 0, @"Should listen on %d.", kSTUCK_PORT);
+
+  int fillers[2];
+  for (int i = 0; i < 2; i++) {
+    fillers[i] = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(fillers[i], F_SETFL, O_NONBLOCK);
+    connect(fillers[i], (struct sockaddr *)&addr, sizeof(addr));
+    [NSThread sleepForTimeInterval:0.2];
+  }
+
+  NSDate *start = [NSDate date];
+  [self performSelector:@selector(__connectTo:) onThread:listenThread.thread
+    withObject:[NSNumber numberWithUnsignedShort:kSTUCK_PORT]
+    waitUntilDone:YES];
+  WAIT_WHILE([disconnects count] < 1);
+  NSTimeInterval took = -[start timeIntervalSinceNow];
+
+  GHAssertFalse(clientConnected, @"Should never connect.");
+  GHAssertEqualObjects([disconnectError domain], AsyncSocketErrorDomain,
+    @"Timeouts are AsyncSocket errors.");
+  GHAssertTrue([disconnectError code] == AsyncSocketConnectTimeoutError,
+    @"Should time out.");
+  GHAssertTrue(took >= 0.9, @"Not before the 1s timeout (%f).", took);
+
+  for (int i = 0; i < 2; i++)
+    close(fillers[i]);
+  close(stuck);
+}
+
+- (void) testG_ConnectRefused {
+  [self performSelector:@selector(__connectTo:) onThread:listenThread.thread
+    withObject:[NSNumber numberWithUnsignedShort:kREFUSED_PORT]
+    waitUntilDone:YES];
+  WAIT_WHILE([disconnects count] < 1);
+
+  GHAssertFalse(clientConnected, @"Should never connect.");
+  GHAssertEqualObjects([disconnectError domain], NSPOSIXErrorDomain,
+    @"Refusal comes from SO_ERROR.");
+  GHAssertTrue([disconnectError code] == ECONNREFUSED, @"Refused.");
+}
+
+@end
+
+#endif // __linux__
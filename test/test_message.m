@@ -93,6 +93,88 @@
   [msg release];
 }
 
+- (void) testM_messageDocument {
+  NSDictionary *dict = [NSDictionary randomDictionary];
+  NSData *data = [dict BSONRepresentation];
+  BNMessage *msg = [BNMessage messageWithDocument:
+    [BNDocument documentWithData:data]];
+
+  GHAssertTrue([msg.contents isEqualToDictionary:[data BSONValue]], @"doc");
+  GHAssertTrue([msg.contents isKindOfClass:[NSMutableDictionary class]],
+    @"mutable");
+}
+
+- (void) testM_messageTyped {
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:[NSNumber numberWithInt:4124321] forKey:BNMessageSeqNo];
+  [dict setValue:[NSNumber numberWithLongLong:1LL << 40] forKey:BNMessageAckNo];
+  [dict setValue:[NSNumber numberWithDouble:0.25] forKey:@"double"];
+  [dict setValue:[NSNumber numberWithBool:YES] forKey:@"bool"];
+  [dict setValue:@"herp" forKey:BNMessageSource];
+  NSData *data = [dict BSONRepresentation];
+
+  // Once from the undecoded bytes, once more after contents are decoded.
+  BNMessage *msg = [BNMessage messageWithDocument:
+    [BNDocument documentWithData:data]];
+  for (int i = 0; i < 2; i++) {
+    GHAssertTrue(msg.seqNo == 4124321, @"seq");
+    GHAssertTrue([msg int64ForKey:BNMessageAckNo] == 1LL << 40, @"ack");
+    GHAssertTrue([msg doubleForKey:@"double"] == 0.25, @"double");
+    GHAssertTrue([msg boolForKey:@"bool"], @"bool");
+    GHAssertTrue([msg int64ForKey:BNMessageSource] == 0, @"not a number");
+    GHAssertTrue([msg int64ForKey:BNMessageToken] == 0, @"missing");
+    GHAssertTrue([msg isReliableMessage], @"reliable");
+    GHAssertTrue([msg.source isEqualToString:@"herp"], @"src");
+    [msg contents];
+  }
+
+  msg.seqNo = 7; // writes go to (decoded) contents.
+  GHAssertTrue(msg.seqNo == 7, @"seq");
+}
+
+- (void) testM_messageWideNumbers {
+  int64_t ack = (1LL << 40) + 3;
+  int64_t seq = 5000000000LL;
+  double token = 6442450944.0; // 1.5 * 2^32, as a double.
+  NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:[NSNumber numberWithLongLong:ack] forKey:BNMessageAckNo];
+  [dict setValue:[NSNumber numberWithLongLong:seq] forKey:BNMessageSeqNo];
+  [dict setValue:[NSNumber numberWithDouble:token] forKey:BNMessageToken];
+  [dict setValue:[NSNumber numberWithDouble:7.75] forKey:@"fraction"];
+  NSData *data = [dict BSONRepresentation];
+
+  // Once from the undecoded bytes, once more after contents are decoded.
+  BNMessage *msg = [BNMessage messageWithDocument:
+    [BNDocument documentWithData:data]];
+  for (int i = 0; i < 2; i++) {
+    GHAssertTrue([msg int64ForKey:BNMessageAckNo] == ack, @"ack, 64 bits");
+    GHAssertTrue([msg int64ForKey:BNMessageSeqNo] == seq, @"seq, 64 bits");
+    GHAssertTrue([msg int64ForKey:BNMessageToken] == (int64_t)token,
+      @"token, from a double");
+    GHAssertTrue([msg int64ForKey:@"fraction"] == 7, @"truncated");
+    GHAssertTrue([msg doubleForKey:BNMessageAckNo] == (double)ack, @"ack");
+    GHAssertTrue(msg.ackNo == (NSUInteger)ack, @"ack");
+    GHAssertTrue(msg.seqNo == (NSUInteger)seq, @"seq");
+    GHAssertTrue(msg.token == (NSUInteger)(int64_t)token, @"token");
+    GHAssertTrue([msg isReliableMessage], @"reliable");
+    [msg contents];
+  }
+
+  // Sequence numbers sent as doubles, as some peers' encoders do.
+  dict = [NSMutableDictionary dictionary];
+  [dict setValue:[NSNumber numberWithDouble:12.0] forKey:BNMessageSeqNo];
+  [dict setValue:[NSNumber numberWithDouble:ack] forKey:BNMessageAckNo];
+  msg = [BNMessage messageWithDocument:
+    [BNDocument documentWithData:[dict BSONRepresentation]]];
+  for (int i = 0; i < 2; i++) {
+    GHAssertTrue(msg.seqNo == 12, @"seq, from a double");
+    GHAssertTrue([msg int64ForKey:BNMessageAckNo] == ack,
+      @"ack, from a double");
+    GHAssertTrue([msg isReliableMessage], @"reliable");
+    [msg contents];
+  }
+}
+
 @end
 
 
@@ -106,11 +188,15 @@
   NSMutableArray *outArr2;
   int lastSent1;
   int lastSent2;
+  BOOL receivesDocuments;
 }
+@property (assign) BOOL receivesDocuments;
 @end
 
 @implementation BNMessageQueueSender
 
+@synthesize receivesDocuments;
+
 - (id) init {
   if ((self = [super init])) {
     inArr1 = [[NSMutableArray alloc] init];
@@ -185,6 +271,13 @@
   return [BNMessage messageWithContents:[data BSONValue]];
 }
 
+// As BNNode receives them: undecoded, so the queue reads its numbers off the
+// bytes.
+- (BNMessage *) documentMsgForMsg:(BNMessage *)msg {
+  NSData *data = [msg.contents BSONRepresentation];
+  return [BNMessage messageWithDocument:[BNDocument documentWithData:data]];
+}
+
 - (BOOL) runWithLoss:(float)loss {
 
   long int runTimes = MAX([inArr1 count], [inArr2 count]) * 1000;
@@ -214,11 +307,19 @@
     BNMessage *m1 = [q1 dequeueSendMessage];
     BNMessage *m2 = [q2 dequeueSendMessage];
 
+    if (receivesDocuments) {
+      m1 = m1 ? [self documentMsgForMsg:m1] : nil;
+      m2 = m2 ? [self documentMsgForMsg:m2] : nil;
+    } else {
+      m1 = m1 ? [self msgForMsg:m1] : nil;
+      m2 = m2 ? [self msgForMsg:m2] : nil;
+    }
+
     if (m1 && kARC4RANDOM_FLOAT >= loss)
-      [q2 enqueueRecvMessage:[self msgForMsg:m1]];
+      [q2 enqueueRecvMessage:m1];
 
     if (m2 && kARC4RANDOM_FLOAT >= loss)
-      [q1 enqueueRecvMessage:[self msgForMsg:m2]];
+      [q1 enqueueRecvMessage:m2];
 
     BNMessage *mo = [q2 dequeueRecvMessage];
     if (mo)
@@ -535,6 +636,24 @@
   [s release];
 }
 
+- (void) testGA_100_TwoWay_Documents_loss_20 {
+
+  BNMessageQueueSender *s = [[BNMessageQueueSender alloc] init];
+  s.receivesDocuments = YES;
+
+  for (int i = 0; i < 100; i++) {
+    NSDictionary *dict1 = [NSDictionary randomDictionary];
+    NSDictionary *dict2 = [NSDictionary randomDictionary];
+    BNMessage *msg1 = [BNMessage messageWithContents:dict1];
+    BNMessage *msg2 = [BNMessage messageWithContents:dict2];
+    [s inputMessage1:msg1];
+    [s inputMessage2:msg2];
+  }
+
+  GHAssertTrue([s runWithLoss:0.2], @"running");
+  [s release];
+}
+
 - (void) testFA_1000_TwoWay {
 
   BNMessageQueueSender *s = [[BNMessageQueueSender alloc] init];
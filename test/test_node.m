@@ -20,6 +20,7 @@
   NSMutableArray *links;
   NSMutableDictionary *nodes;
   NSMutableDictionary *expect;
+  NSError *nodeError; // the last of BNNodeErrorDomain.
 
 }
 
@@ -111,6 +112,7 @@
   [links release];
   [nodes release];
   [expect release];
+  [nodeError release];
 
   links = nil;
   nodes = nil;
@@ -133,6 +135,12 @@
 
 - (void) node:(BNNode *)node error:(NSError *)error {
   NSLog(@"Node: %@ error: %@", node, error);
+  if ([[error domain] isEqualToString:BNNodeErrorDomain]) {
+    @synchronized(expect) {
+      [nodeError release];
+      nodeError = [error retain];
+    }
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -422,6 +430,93 @@
 
 }
 
+- (void) testBI_forwarding {
+
+  // client1 <-> client2 <-> client3, with client2 relaying.
+  BNNode *node1 = [nodes valueForKey:@"client1"];
+  BNNode *node2 = [nodes valueForKey:@"client2"];
+  BNNode *node3 = [nodes valueForKey:@"client3"];
+  node2.forwardsMessages = YES;
+
+  [node1.server connectToAddress:@"localhost:1342"];
+  WAIT_WHILE([links count] < 2);
+  [node2.server connectToAddress:@"localhost:1343"];
+  WAIT_WHILE([links count] < 4);
+
+  GHAssertNil([node1 linkForName:node3.name], @"Should not be linked.");
+  GHAssertNotNil([node2 linkForName:node3.name], @"Should be linked.");
+
+  // node1 only has its default link (to client2) for client3. client2 must
+  // pass the frame on rather than deliver it (receivedMessageNotification
+  // checks the receiving node is the destination).
+  NSDictionary *dict = [NSMutableDictionary dictionary];
+  [dict setValue:@"Herp" forKey:@"Derp"];
+  BNMessage *msg = [BNMessage messageWithContents:dict];
+  msg.source = node1.name;
+  msg.destination = node3.name;
+
+  NSData *data = [msg.contents BSONRepresentation];
+  @synchronized(expect) {
+    [[expect valueForKey:node3.name] addObject:data];
+  }
+
+  GHAssertTrue([node1 sendMessage:msg], @"Should send ok.");
+  [self waitForAllExpected];
+
+  // Without a link to the destination, the relay drops it.
+  msg = [BNMessage messageWithContents:dict];
+  msg.source = node1.name;
+  msg.destination = @"client4";
+  GHAssertTrue([node1 sendMessage:msg], @"Should send ok.");
+  [NSThread sleepForTimeInterval:0.5];
+
+  node2.forwardsMessages = NO;
+  for (BNNode *node in [nodes allValues])
+    [node disconnectLinks];
+
+  WAIT_WHILE([links count] > 0);
+  GHAssertTrue([links count] == 0, @"Should have no open connections.");
+}
+
+- (void) testBJ_nonStringHeaders {
+
+  BNNode *node1 = [nodes valueForKey:@"client1"];
+  BNNode *node2 = [nodes valueForKey:@"client2"];
+  [node1.server connectToAddress:@"localhost:1342"];
+  WAIT_WHILE([links count] < 2 || [node1 linkForName:node2.name] == nil);
+  BNLink *link = [node1 linkForName:node2.name];
+  GHAssertNotNil(link, @"Should be linked.");
+
+  // Raw, so the headers can be anything. Neither may be delivered
+  // (receivedMessageNotification fails on anything unexpected).
+  NSMutableDictionary *badSource = [NSMutableDictionary dictionary];
+  [badSource setValue:[NSNumber numberWithInt:1] forKey:BNMessageSource];
+  [badSource setValue:node2.name forKey:BNMessageDestination];
+  NSMutableDictionary *badDestination = [NSMutableDictionary dictionary];
+  [badDestination setValue:node1.name forKey:BNMessageSource];
+  [badDestination setValue:[NSArray arrayWithObject:node2.name]
+    forKey:BNMessageDestination];
+
+  for (NSDictionary *dict in [NSArray arrayWithObjects:badSource,
+      badDestination, nil]) {
+    @synchronized(expect) {
+      [nodeError release];
+      nodeError = nil;
+    }
+    GHAssertTrue([link.connection sendDictionary:dict] > 0, @"Sending ok.");
+    WAIT_WHILE(nodeError == nil);
+    GHAssertEqualObjects([nodeError domain], BNNodeErrorDomain,
+      @"Should be refused by the node.");
+    GHAssertTrue([nodeError code] == BNNodeErrorBadHeader,
+      @"Should be refused for its headers.");
+  }
+
+  for (BNNode *node in [nodes allValues])
+    [node disconnectLinks];
+  WAIT_WHILE([links count] > 0);
+  GHAssertTrue([links count] == 0, @"Should have no open connections.");
+}
+
 - (void) testCA_allConnect {
 
   NSUInteger nextCount;
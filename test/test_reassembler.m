@@ -0,0 +1,172 @@
+//
+//  Part of BsonNetork
+//
+//  Created by Juan Batiz-Benet 2011.
+//  MIT License, see LICENSE file for details.
+//
+
+#import "BNConnection.h"
+#import "NuBSON.h"
+
+
+@interface BNFrameReassemblerTest : GHTestCase {
+  BNFrameReassembler *frames;
+}
+@end
+
+@implementation BNFrameReassemblerTest
+
+//------------------------------------------------------------------------------
+#pragma mark setup
+
+- (BOOL) shouldRunOnMainThread {
+  return NO;
+}
+
+- (void) setUpClass {}
+- (void) tearDownClass {}
+
+- (void) setUp {
+  frames = [[BNFrameReassembler alloc] init];
+}
+
+- (void) tearDown {
+  [frames release];
+  frames = nil;
+}
+
+// A valid document of exactly length bytes: { "p": "xxx..." }.
+- (NSData *) frameOfLength:(NSUInteger)length {
+  NSString *padding = [@"" stringByPaddingToLength:length - 13
+    withString:@"x" startingAtIndex:0];
+  NSData *frame = [[NSDictionary dictionaryWithObject:padding forKey:@"p"]
+    NuBSONRepresentation];
+  GHAssertTrue([frame length] == length, @"frame of %lu",
+    (unsigned long)length);
+  return frame;
+}
+
+- (NSData *) nextFrame {
+  BNConnectionErrorCode error;
+  NSData *frame = [frames nextFrame:&error];
+  GHAssertTrue(error == 0, @"no error expected, got %d", error);
+  return frame;
+}
+
+- (NSData *) subdataOf:(NSData *)data from:(NSUInteger)from
+  to:(NSUInteger)to {
+  return [data subdataWithRange:NSMakeRange(from, to - from)];
+}
+
+//------------------------------------------------------------------------------
+#pragma mark tests
+
+- (void) testA_SplitHeader {
+  NSData *frame = [self frameOfLength:100];
+
+  // Every way of splitting the length header over the first reads.
+  for (NSUInteger cut = 1; cut < 4; cut++) {
+    [frames reset];
+    [frames appendData:[self subdataOf:frame from:0 to:cut]];
+    GHAssertNil([self nextFrame], @"%lu header bytes are not a length",
+      (unsigned long)cut);
+    [frames appendData:[self subdataOf:frame from:cut to:cut + 1]];
+    GHAssertNil([self nextFrame], @"%lu header bytes", (unsigned long)cut + 1);
+    [frames appendData:[self subdataOf:frame from:cut + 1 to:100]];
+    GHAssertEqualObjects([self nextFrame], frame, @"cut at %lu",
+      (unsigned long)cut);
+    GHAssertNil([self nextFrame], @"nothing left");
+  }
+}
+
+- (void) testB_FrameOverManyReads {
+  NSData *frame = [self frameOfLength:50000];
+  NSUInteger cuts[] = { 0, 3, 4, 700, 16384, 16390, 40000, 50000 };
+  for (int i = 0; i < 7; i++) {
+    [frames appendData:[self subdataOf:frame from:cuts[i] to:cuts[i + 1]]];
+    if (i < 6)
+      GHAssertNil([self nextFrame], @"incomplete after read %d", i);
+  }
+  GHAssertEqualObjects([self nextFrame], frame, @"reassembled");
+  GHAssertNil([self nextFrame], @"nothing left");
+}
+
+- (void) testC_ManyFramesInOneRead {
+  NSMutableArray *sent = [NSMutableArray array];
+  NSMutableData *read = [NSMutableData data];
+  for (int i = 0; i < 100; i++) {
+    NSData *frame = [self frameOfLength:13 + (i * 37) % 500];
+    [sent addObject:frame];
+    [read appendData:frame];
+  }
+
+  // Nothing was pending, so the read is adopted and sliced in place.
+  [frames appendData:read];
+  const char *at = [read bytes];
+  for (NSData *frame in sent) {
+    NSData *got = [self nextFrame];
+    GHAssertEqualObjects(got, frame, @"frames in order");
+    GHAssertTrue([got bytes] == at, @"a slice of the read, not a copy");
+    at += [frame length];
+  }
+  GHAssertNil([self nextFrame], @"nothing left");
+}
+
+- (void) testD_CarryOverThenAdopt {
+  NSData *a = [self frameOfLength:300];
+  NSData *b = [self frameOfLength:400];
+  NSData *c = [self frameOfLength:500];
+
+  // a and the start of b; then the rest of b, copied in behind it.
+  NSMutableData *first = [NSMutableData dataWithData:a];
+  [first appendData:[self subdataOf:b from:0 to:150]];
+  [frames appendData:first];
+  GHAssertEqualObjects([self nextFrame], a, @"a");
+  GHAssertNil([self nextFrame], @"b is partial");
+  [frames appendData:[self subdataOf:b from:150 to:400]];
+  NSData *gotB = [[self nextFrame] retain];
+  GHAssertEqualObjects(gotB, b, @"b carried over");
+
+  // Nothing pending again: c is adopted, and b's chunk is left alone.
+  NSMutableData *third = [NSMutableData dataWithData:c];
+  [frames appendData:third];
+  NSData *gotC = [self nextFrame];
+  GHAssertEqualObjects(gotC, c, @"c");
+  GHAssertTrue([gotC bytes] == [third bytes], @"c was not copied");
+  GHAssertEqualObjects(gotB, b, @"b still intact");
+  [gotB release];
+}
+
+- (void) testE_Growth {
+  // Unbounded: a frame spanning many small reads grows its chunk at least
+  // 2x at a time (up to the frame's length), so it is copied O(1) times.
+  NSUInteger length = 1 << 20;
+  NSData *frame = [self frameOfLength:length];
+  NSUInteger capacity = 0;
+  int growths = 0;
+  for (NSUInteger at = 0; at < length; at += 4096) {
+    [frames appendData:[self subdataOf:frame from:at
+      to:MIN(at + 4096, length)]];
+    NSUInteger now = [frames capacity];
+    if (at > 0 && now != capacity) {
+      GHAssertTrue(now >= MIN(2 * capacity, length), @"grew from %lu to %lu",
+        (unsigned long)capacity, (unsigned long)now);
+      growths++;
+    }
+    capacity = now;
+  }
+  GHAssertTrue(growths <= 8, @"%d growths for 1MB in 4K reads", growths);
+  GHAssertEqualObjects([self nextFrame], frame, @"reassembled");
+
+  // Bounded by maxFrameSize, the length is trusted: one chunk for all of it.
+  [frames reset];
+  frames.maxFrameSize = length;
+  [frames appendData:[self subdataOf:frame from:0 to:4096]];
+  [frames appendData:[self subdataOf:frame from:4096 to:8192]];
+  GHAssertTrue([frames capacity] == length, @"sized to the frame at once");
+  [frames appendData:[self subdataOf:frame from:8192 to:length]];
+  GHAssertTrue([frames capacity] == length, @"no further growth");
+  GHAssertEqualObjects([self nextFrame], frame, @"reassembled");
+}
+
+@end
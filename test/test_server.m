@@ -21,6 +21,9 @@
 
   NSMutableDictionary *expect;
 
+  BNServer *workerServer;
+  BNServer *reusePortServer;
+  NSMutableSet *threads; // that server:didConnect: was called on.
 }
 
 @end
@@ -29,6 +32,8 @@ static NSString *kHOST1 = @"localhost:1337";
 static NSString *kHOST2 = @"localhost:1338";
 static NSString *kHOST3 = @"localhost:1339";
 static NSString *kHOST4 = @"localhost:1340";
+static NSString *kHOST5 = @"localhost:1341"; // with workers.
+static NSString *kHOST6 = @"localhost:1342"; // with workers listening.
 
 @implementation BNServerTest
 
@@ -63,7 +68,33 @@ static NSString *kHOST4 = @"localhost:1340";
   [pool release];
 }
 
+- (void) setupWorkerServer:(NSString *)address {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+  NSString *host;
+  UInt16 port;
+  [BNConnection extractHost:&host andPort:&port fromAddress:address];
+
+  BNServer *server = [[BNServer alloc] init];
+  server.delegate = self;
+  server.workerCount = 4;
+  server.listensOnWorkers = (address == kHOST6);
+  GHAssertTrue([server startListeningOnPort:port],
+    @"Should be able to begin listening.");
+  GHAssertThrows(server.workerCount = 2, @"Workers are fixed once listening.");
+  if (server.listensOnWorkers)
+    reusePortServer = server;
+  else
+    workerServer = server;
+
+  [[NSRunLoop currentRunLoop] run];
+
+  [server release];
+  [pool release];
+}
+
 - (void) setUpClass {
+  threads = [[NSMutableSet alloc] init];
   connections = [[NSMutableArray alloc] initWithCapacity:10];
   servers = [[NSMutableDictionary alloc] initWithCapacity:10];
   expect = [[NSMutableDictionary alloc] initWithCapacity:10];
@@ -79,6 +110,7 @@ static NSString *kHOST4 = @"localhost:1340";
 }
 
 - (void) tearDownClass {
+  [threads release];
   [connections release];
   [servers release];
   [expect release];
@@ -106,6 +138,7 @@ static NSString *kHOST4 = @"localhost:1340";
   conn.delegate = self;
   @synchronized(connections) {
     [connections addObject:conn];
+    [threads addObject:[NSThread currentThread]];
   }
 }
 
@@ -422,4 +455,71 @@ static NSString *kHOST4 = @"localhost:1340";
   GHAssertTrue([connections count] == 0, @"Should have none now.");
 }
 
+- (void) testDA_firstOfAddresses {
+  BNServer *serv1 = [servers valueForKey:kHOST1];
+
+  // Nothing listens on port 1, so kHOST2 should win; kHOST3 may be tried too.
+  NSArray *addresses = [NSArray arrayWithObjects:@"localhost:1", kHOST2,
+    kHOST3, nil];
+  [serv1 connectToFirstOfAddresses:addresses];
+
+  WAIT_WHILE([connections count] < 2);
+  [NSThread sleepForTimeInterval:1.0]; // for losers to show up, if they would.
+  GHAssertTrue([connections count] == 2, @"Only the winner stays connected.");
+
+  for (BNServer *serv in [servers allValues])
+    [serv disconnectAllConnections];
+  WAIT_WHILE([connections count] > 0);
+}
+
+- (void) testEA_workers {
+  [NSThread detachNewThreadSelector:@selector(setupWorkerServer:)
+    toTarget:self withObject:kHOST5];
+  WAIT_WHILE(workerServer == nil);
+  @synchronized(connections) {
+    [threads removeAllObjects];
+  }
+
+  BNServer *serv1 = [servers valueForKey:kHOST1];
+  for (int i = 0; i < 8; i++)
+    [serv1 connectToAddress:kHOST5];
+  WAIT_WHILE([connections count] < 16);
+  GHAssertTrue([connections count] == 16, @"Both ends of each connection.");
+
+  // serv1's thread for its ends, and all four workers for the accepted ones.
+  GHAssertTrue([threads count] == 5, @"Accepted connections are spread.");
+
+  for (BNConnection *conn in connections)
+    GHAssertTrue(conn.isConnected, @"Connection should be established.");
+
+  [serv1 disconnectAllConnections];
+  WAIT_WHILE([connections count] > 0);
+  GHAssertTrue([connections count] == 0, @"Should have none now.");
+}
+
+- (void) testEB_listensOnWorkers {
+  [NSThread detachNewThreadSelector:@selector(setupWorkerServer:)
+    toTarget:self withObject:kHOST6];
+  WAIT_WHILE(reusePortServer == nil);
+  GHAssertTrue(reusePortServer.listenPort == 1342, @"All on the one port.");
+  @synchronized(connections) {
+    [threads removeAllObjects];
+  }
+
+  BNServer *serv1 = [servers valueForKey:kHOST1];
+  for (int i = 0; i < 8; i++)
+    [serv1 connectToAddress:kHOST6];
+  WAIT_WHILE([connections count] < 16);
+  GHAssertTrue([connections count] == 16, @"Both ends of each connection.");
+
+  // Which workers get them is up to the kernel; but none are on serv1's.
+  GHAssertTrue([threads count] >= 2, @"Accepted on the workers.");
+
+  [serv1 disconnectAllConnections];
+  WAIT_WHILE([connections count] > 0);
+
+  [reusePortServer stopListening];
+  GHAssertFalse(reusePortServer.isListening, @"Stopped.");
+}
+
 @end